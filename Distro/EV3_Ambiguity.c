@@ -0,0 +1,524 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Offline map ambiguity analysis. For every start state (intersection and heading) it works out how many scans the
+robot needs to know where it is, and which states can never be told apart because the map reads the same from both
+for every sequence of moves. Run it on a map before printing it; the robot loads the result at startup (see
+load_ambiguity()) and stops exploring once its beliefs sit on states that no scan can separate.
+
+ The analysis uses the ideal robot: every move lands on the next intersection (bouncing off the red border as the
+motion model does) and every scan reads the map exactly. What the robot knows after each scan is the set of states
+consistent with everything it read so far, and that set is what the policies below act on.
+
+ Usage:
+
+   EV3_Ambiguity [-p adaptive|straight] [-d max_scans] [-t threads] map_name out_file
+
+   -p   adaptive (default) picks every move to minimize the worst-case number of scans left, searched over the
+        hypothesis sets reachable within max_scans. straight always drives straight ahead.
+   -d   scans after which a start state is reported as not localized (default AMB_MAX_SCANS)
+   -t   worker threads for the search (default all cores)
+
+ Output format, '#' starts a comment:
+
+   sx sy
+   x y dir scans class      (one line per state)
+
+   scans  - scans to localize from that start state, counting the first one. -1 never: another state reads the same
+            for every move sequence. -2 not within max_scans.
+   class  - states with the same class read the same for every move sequence
+
+ The indistinguishable pairs are listed at the end of the file as comments.
+
+*/
+
+#include <string.h>
+#include <time.h>
+#include "EV3_Localization_Core.h"
+#include "EV3_ThreadPool.h"
+#include "EV3_MapCache.h"
+
+#define AMB_MAX_SCANS 12
+
+#define POLICY_ADAPTIVE 0
+#define POLICY_STRAIGHT 1
+
+// The ideal robot on a map: exact moves and exact scans
+struct amb_model {
+    const struct loc_map *m;
+    int n;                      // N_STATES()
+    int *next[4];               // State reached from s by action a
+    unsigned char *bounce[4];   // 1 if that move bounced off the red border
+    int *cls;                   // Indistinguishability class of each state
+    int *cls_size;              // Number of states in each class
+    int n_cls;
+};
+
+// Memoized search results for one hypothesis set (a sorted list of states)
+struct memo_entry {
+    int *key;                   // NULL for an empty slot
+    int len;
+    unsigned int hash;
+    int value;                  // Fewest extra scans to reach a single class, -1 if not known yet
+    int more_than;              // Known to need more than this many extra scans
+    int action;                 // Move that achieves value
+};
+
+// Open addressing hash table of memo entries, one per worker
+struct memo {
+    struct memo_entry *slots;
+    int cap;
+    int used;
+};
+
+// Shared by the analysis workers, one first-scan signature per task. Only scans[] is written, and each state's entry
+// by exactly one task.
+struct amb_job {
+    const struct amb_model *am;
+    int policy;
+    int max_scans;
+    struct memo *memo;          // One per worker
+    int *scans;                 // Result for each start state
+    int failed;                 // Set if a worker ran out of memory
+};
+
+// Tuple a state is ranked by during partition refinement
+struct refine_key {
+    int k[9];                   // Class, then (bounced, class reached) for each action
+    int s;
+};
+
+/*!
+ * Orders refinement keys lexicographically
+ */
+int compare_refine_keys(const void *a, const void *b) {
+    const struct refine_key *ka = (const struct refine_key *) a;
+    const struct refine_key *kb = (const struct refine_key *) b;
+
+    for (int i = 0; i < 9; i++) {
+        if (ka->k[i] != kb->k[i]) return (ka->k[i] < kb->k[i] ? -1 : 1);
+    }
+    return (0);
+}
+
+int compare_split(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return ((x > y) - (x < y));
+}
+
+int compare_ints(const void *a, const void *b) {
+    return (*(const int *) a - *(const int *) b);
+}
+
+/*!
+ * Splits the states into classes that read the same for every move sequence (Moore's partition refinement). States
+ * start grouped by their signature, and a class is split whenever two of its states bounce differently or land in
+ * different classes for some action, until nothing changes.
+ * @return int, 1 success 0 fail
+ */
+int refine_classes(struct amb_model *am) {
+    struct refine_key *keys;
+    int n = am->n, n_cls = 0, prev;
+
+    keys = (struct refine_key *) calloc(n, sizeof(struct refine_key));
+    am->cls = (int *) calloc(n, sizeof(int));
+    am->cls_size = (int *) calloc(n, sizeof(int));
+    if (keys == NULL || am->cls == NULL || am->cls_size == NULL) {
+        free(keys);
+        return (0);
+    }
+    for (int s = 0; s < n; s++) am->cls[s] = am->m->map_sig[s];
+
+    do {
+        prev = n_cls;
+        for (int s = 0; s < n; s++) {
+            keys[s].s = s;
+            keys[s].k[0] = am->cls[s];
+            for (int a = 0; a < 4; a++) {
+                keys[s].k[1 + (2 * a)] = am->bounce[a][s];
+                keys[s].k[2 + (2 * a)] = am->cls[am->next[a][s]];
+            }
+        }
+        qsort(keys, n, sizeof(struct refine_key), compare_refine_keys);
+        n_cls = 0;
+        for (int i = 0; i < n; i++) {
+            if (i > 0 && compare_refine_keys(&keys[i - 1], &keys[i]) != 0) n_cls++;
+            am->cls[keys[i].s] = n_cls;
+        }
+        n_cls++;
+    } while (n_cls != prev);
+
+    am->n_cls = n_cls;
+    for (int s = 0; s < n; s++) am->cls_size[am->cls[s]]++;
+    free(keys);
+    return (1);
+}
+
+/*!
+ * Builds the ideal robot for map m: the exact move from every state for every action, and the state classes
+ * @return int, 1 success 0 fail
+ */
+int build_model(struct amb_model *am, const struct loc_map *m) {
+    int b;
+
+    memset(am, 0, sizeof(*am));
+    am->m = m;
+    am->n = N_STATES(m);
+    for (int a = 0; a < 4; a++) {
+        am->next[a] = (int *) calloc(am->n, sizeof(int));
+        am->bounce[a] = (unsigned char *) calloc(am->n, sizeof(unsigned char));
+        if (am->next[a] == NULL || am->bounce[a] == NULL) return (0);
+        for (int s = 0; s < am->n; s++) {
+            am->next[a][s] = exact_move(m, s, a, &b);
+            am->bounce[a][s] = (unsigned char) b;
+        }
+    }
+    return (refine_classes(am));
+}
+
+void free_model(struct amb_model *am) {
+    for (int a = 0; a < 4; a++) {
+        free(am->next[a]);
+        free(am->bounce[a]);
+    }
+    free(am->cls);
+    free(am->cls_size);
+    memset(am, 0, sizeof(*am));
+}
+
+/*!
+ * Finds the memo entry for the hypothesis set H (k states, sorted), adding an empty one if there is none.
+ * @return the entry, NULL if out of memory. Only valid until the next call on the same table.
+ */
+struct memo_entry *memo_find(struct memo *mm, const int *H, int k) {
+    struct memo_entry *e, *old;
+    unsigned int h = 2166136261u;
+    int old_cap;
+
+    for (int i = 0; i < k; i++) h = (h ^ (unsigned int) H[i]) * 16777619u;
+
+    if (2 * (mm->used + 1) > mm->cap) {
+        // Grow to keep the table at most half full
+        old = mm->slots;
+        old_cap = mm->cap;
+        mm->cap = (old_cap == 0) ? 1024 : old_cap * 2;
+        mm->slots = (struct memo_entry *) calloc(mm->cap, sizeof(struct memo_entry));
+        if (mm->slots == NULL) {
+            mm->slots = old;
+            mm->cap = old_cap;
+            return (NULL);
+        }
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].key == NULL) continue;
+            e = &mm->slots[old[i].hash & (mm->cap - 1)];
+            while (e->key != NULL) e = (e == &mm->slots[mm->cap - 1]) ? mm->slots : e + 1;
+            *e = old[i];
+        }
+        free(old);
+    }
+
+    e = &mm->slots[h & (mm->cap - 1)];
+    while (e->key != NULL) {
+        if (e->hash == h && e->len == k && memcmp(e->key, H, k * sizeof(int)) == 0) return (e);
+        e = (e == &mm->slots[mm->cap - 1]) ? mm->slots : e + 1;
+    }
+    e->key = (int *) malloc(k * sizeof(int));
+    if (e->key == NULL) return (NULL);
+    memcpy(e->key, H, k * sizeof(int));
+    e->len = k;
+    e->hash = h;
+    e->value = -1;
+    e->more_than = -1;
+    e->action = 0;
+    mm->used++;
+    return (e);
+}
+
+void free_memo(struct memo *mm) {
+    for (int i = 0; i < mm->cap; i++) free(mm->slots[i].key);
+    free(mm->slots);
+    memset(mm, 0, sizeof(*mm));
+}
+
+/*!
+ * 1 if every state in H is in the same class, so no further scan can split it
+ */
+int settled(const struct amb_model *am, const int *H, int k) {
+    for (int i = 1; i < k; i++) {
+        if (am->cls[H[i]] != am->cls[H[0]]) return (0);
+    }
+    return (1);
+}
+
+/*!
+ * Applies action a to every state of H and sorts the results by what the next scan reads (bounce flag and signature),
+ * then by state. Each run of equal readings in out[] is one hypothesis set the robot can end up with.
+ * @param out k values: reading << 32 | state
+ */
+void split_set(const struct amb_model *am, const int *H, int k, int a, long long *out) {
+    int t;
+
+    for (int i = 0; i < k; i++) {
+        t = am->next[a][H[i]];
+        out[i] = ((long long) ((am->bounce[a][H[i]] << 8) | am->m->map_sig[t]) << 32) | t;
+    }
+    qsort(out, k, sizeof(long long), compare_split);
+}
+
+/*!
+ * Fewest extra scans that take the hypothesis set H (k sorted states) down to a single class whatever the robot
+ * reads, looking at most d scans ahead. Minimax over the moves with the results memoized in mm: a set that shows up
+ * again (on another branch, or on another start state's search) is not searched twice.
+ * @return int, the number of scans, d + 1 if it takes more than d, -1 if out of memory
+ */
+int solve(const struct amb_model *am, struct memo *mm, const int *H, int k, int d) {
+    const int order[4] = {0, 1, 3, 2};
+    struct memo_entry *e;
+    long long *split;
+    int *G;
+    int best = d + 1, best_a = 0, bound, worst, r, i, j, a;
+
+    if (settled(am, H, k)) return (0);
+    if (d == 0) return (1);
+    e = memo_find(mm, H, k);
+    if (e == NULL) return (-1);
+    if (e->value >= 0) return (e->value <= d ? e->value : d + 1);
+    if (e->more_than >= d) return (d + 1);
+
+    split = (long long *) malloc(k * sizeof(long long));
+    G = (int *) malloc(k * sizeof(int));
+    if (split == NULL || G == NULL) {
+        free(split);
+        free(G);
+        return (-1);
+    }
+    for (int o = 0; o < 4 && best > 1; o++) {
+        a = order[o];
+        bound = best - 1;
+        split_set(am, H, k, a, split);
+        worst = 0;
+        for (i = 0; i < k && worst <= bound; i = j) {
+            for (j = i; j < k && (split[j] >> 32) == (split[i] >> 32); j++) G[j - i] = (int) (split[j] & 0xffffffff);
+            r = solve(am, mm, G, j - i, bound - 1);
+            if (r < 0) {
+                free(split);
+                free(G);
+                return (-1);
+            }
+            if (1 + r > worst) worst = 1 + r;
+        }
+        if (worst <= bound) {
+            best = worst;
+            best_a = a;
+        }
+    }
+    free(split);
+    free(G);
+
+    // The table may have grown during the search
+    e = memo_find(mm, H, k);
+    if (e == NULL) return (-1);
+    if (best <= d) {
+        e->value = best;
+        e->action = best_a;
+    } else if (d > e->more_than) {
+        e->more_than = d;
+    }
+    return (best);
+}
+
+/*!
+ * Follows the policy from start state t, whose first scan left the robot with the hypothesis set H0 (k0 states).
+ * @return int, scans to localize (-1 never, -2 not within max_scans, -3 out of memory)
+ */
+int trace_start(struct amb_job *job, struct memo *mm, const int *H0, int k0, int t) {
+    const struct amb_model *am = job->am;
+    long long *split;
+    int *H;
+    int k = k0, scans = 1, a = 0, start = t, r, i, j, n;
+
+    split = (long long *) malloc(k0 * sizeof(long long));
+    H = (int *) malloc(k0 * sizeof(int));
+    if (split == NULL || H == NULL) {
+        free(split);
+        free(H);
+        return (-3);
+    }
+    memcpy(H, H0, k0 * sizeof(int));
+    while (!settled(am, H, k)) {
+        if (scans >= job->max_scans) {
+            scans = -2;
+            break;
+        }
+        if (job->policy == POLICY_ADAPTIVE) {
+            r = solve(am, mm, H, k, job->max_scans - scans);
+            if (r < 0) {
+                scans = -3;
+                break;
+            }
+            if (r > job->max_scans - scans) {
+                scans = -2;
+                break;
+            }
+            a = memo_find(mm, H, k)->action;
+        }
+        // Keep the part of the split that holds the true state
+        split_set(am, H, k, a, split);
+        t = am->next[a][t];
+        for (i = 0; (split[i] & 0xffffffff) != t; i++);
+        n = 0;
+        for (j = 0; j < k; j++) {
+            if ((split[j] >> 32) == (split[i] >> 32)) H[n++] = (int) (split[j] & 0xffffffff);
+        }
+        k = n;
+        scans++;
+    }
+    // Never localized only if the start state itself has a look-alike, t is the state the robot ended up in by now
+    if (scans > 0 && am->cls_size[am->cls[start]] > 1) scans = -1;
+    free(split);
+    free(H);
+    return (scans);
+}
+
+/*!
+ * Analysis task: every start state whose first scan reads signature task
+ */
+void analyze_task(int task, int worker, void *arg) {
+    struct amb_job *job = (struct amb_job *) arg;
+    const struct loc_map *m = job->am->m;
+    int k = m->sig_start[task + 1] - m->sig_start[task];
+    int *H;
+
+    if (k == 0) return;
+    H = (int *) malloc(k * sizeof(int));
+    if (H == NULL) {
+        job->failed = 1;
+        return;
+    }
+    memcpy(H, &m->sig_states[m->sig_start[task]], k * sizeof(int));
+    qsort(H, k, sizeof(int), compare_ints);
+    for (int i = 0; i < k; i++) {
+        job->scans[H[i]] = trace_start(job, &job->memo[worker], H, k, H[i]);
+        if (job->scans[H[i]] == -3) job->failed = 1;
+    }
+    free(H);
+}
+
+/*!
+ * Writes the analysis in the format load_ambiguity() reads
+ * @return int, 1 success 0 fail
+ */
+int write_ambiguity(const char *filename, const struct amb_model *am, const int *scans, const char *map_name,
+                    const char *policy, int max_scans) {
+    const struct loc_map *m = am->m;
+    int cells = m->sx * m->sy;
+    FILE *f;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create %s\n", filename);
+        return (0);
+    }
+    fprintf(f, "# EV3_Ambiguity: map %s, policy %s, max_scans %d\n", map_name, policy, max_scans);
+    fprintf(f, "# scans: -1 never (indistinguishable), -2 not within max_scans\n");
+    fprintf(f, "%d %d\n", m->sx, m->sy);
+    fprintf(f, "# x y dir scans class\n");
+    for (int s = 0; s < am->n; s++) {
+        fprintf(f, "%d %d %d %d %d\n", (s % cells) % m->sx, (s % cells) / m->sx, s / cells, scans[s], am->cls[s]);
+    }
+    fprintf(f, "# indistinguishable pairs: x y dir  x y dir\n");
+    for (int s = 0; s < am->n; s++) {
+        for (int q = s + 1; q < am->n; q++) {
+            if (am->cls[q] != am->cls[s]) continue;
+            fprintf(f, "# %d %d %d  %d %d %d\n", (s % cells) % m->sx, (s % cells) / m->sx, s / cells,
+                    (q % cells) % m->sx, (q % cells) / m->sx, q / cells);
+        }
+    }
+    fclose(f);
+    return (1);
+}
+
+int main(int argc, char *argv[]) {
+    struct loc_map world;
+    struct amb_model am;
+    struct amb_job job;
+    struct timespec t0, t1;
+    const char *policy = "adaptive";
+    int a = 1, n_workers, used, ok;
+    int n_found = 0, n_never = 0, n_over = 0, worst = 0, total = 0;
+    double secs;
+
+    memset(&world, 0, sizeof(world));
+    memset(&job, 0, sizeof(job));
+    job.policy = POLICY_ADAPTIVE;
+    job.max_scans = AMB_MAX_SCANS;
+    n_workers = default_workers();
+
+    while (a < argc && argv[a][0] == '-') {
+        if (strcmp(argv[a], "-p") == 0 && a + 1 < argc) {
+            policy = argv[a + 1];
+            job.policy = (strcmp(policy, "straight") == 0) ? POLICY_STRAIGHT : (strcmp(policy, "adaptive") == 0) ?
+                                                                               POLICY_ADAPTIVE : -1;
+            a += 2;
+        } else if (strcmp(argv[a], "-d") == 0 && a + 1 < argc) {
+            job.max_scans = atoi(argv[a + 1]);
+            a += 2;
+        } else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+            n_workers = atoi(argv[a + 1]);
+            a += 2;
+        } else {
+            break;
+        }
+    }
+    if (argc - a != 2 || job.policy < 0 || job.max_scans < 1 || n_workers < 1) {
+        fprintf(stderr, "Usage: EV3_Ambiguity [-p adaptive|straight] [-d max_scans] [-t threads] map_name out_file\n");
+        exit(1);
+    }
+
+    if (load_map(argv[a], &world) == 0) {
+        fprintf(stderr, "Unable to read map %s\n", argv[a]);
+        exit(1);
+    }
+
+    job.am = &am;
+    job.scans = (int *) calloc(N_STATES(&world), sizeof(int));
+    job.memo = (struct memo *) calloc(n_workers, sizeof(struct memo));
+    if (job.scans == NULL || job.memo == NULL || build_model(&am, &world) == 0) {
+        fprintf(stderr, "Out of memory setting up the analysis\n");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    used = parallel_for(256, n_workers, analyze_task, &job);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + ((t1.tv_nsec - t0.tv_nsec) * 1e-9);
+
+    ok = !job.failed;
+    if (!ok) fprintf(stderr, "Out of memory during the search, try a smaller -d\n");
+    else ok = write_ambiguity(argv[a + 1], &am, job.scans, argv[a], policy, job.max_scans);
+
+    for (int s = 0; s < am.n; s++) {
+        if (job.scans[s] == -1) n_never++;
+        else if (job.scans[s] == -2) n_over++;
+        else {
+            n_found++;
+            total += job.scans[s];
+            if (job.scans[s] > worst) worst = job.scans[s];
+        }
+    }
+    printf("%d x %d map, %d states in %d classes, policy %s\n", world.sx, world.sy, am.n, am.n_cls, policy);
+    printf("localizable from %d states, %.2f scans on average, %d in the worst case\n", n_found,
+           n_found ? (double) total / n_found : 0.0, worst);
+    printf("never localizable (map symmetry): %d states, not within %d scans: %d states\n", n_never, job.max_scans,
+           n_over);
+    printf("%.3f s on %d workers\n", secs, used);
+
+    for (int w = 0; w < n_workers; w++) free_memo(&job.memo[w]);
+    free(job.memo);
+    free(job.scans);
+    free_model(&am);
+    free_loc_map(&world);
+    exit(ok ? 0 : 1);
+}
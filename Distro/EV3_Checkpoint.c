@@ -0,0 +1,114 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Memory-mapped belief checkpoint, see EV3_Checkpoint.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "EV3_Checkpoint.h"
+
+static struct checkpoint_header *cp = NULL;     // The mapped file, NULL if checkpoints are off
+static double *cp_beliefs = NULL;               // Beliefs right after the header
+static size_t cp_size = 0;
+static char cp_name[1024];
+
+/*!
+ * Maps the checkpoint file for map m, creating it if needed. A file left by a run on the same map is kept for
+ * checkpoint_resume(), anything else is overwritten.
+ * @return int, 1 success 0 fail (the robot then runs without checkpoints)
+ */
+int checkpoint_open(const char *filename, const struct loc_map *m) {
+    unsigned long long hash = map_hash(m);
+    int n = N_STATES(m);
+    struct stat st;
+    void *p;
+    int fd, keep;
+
+    cp_size = sizeof(struct checkpoint_header) + ((size_t) n * sizeof(double));
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return (0);
+    keep = (fstat(fd, &st) == 0 && (size_t) st.st_size == cp_size);
+    if ((!keep && ftruncate(fd, cp_size) != 0) ||
+        (p = mmap(NULL, cp_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return (0);
+    }
+    close(fd);
+    cp = (struct checkpoint_header *) p;
+    cp_beliefs = (double *) (cp + 1);
+    snprintf(cp_name, sizeof(cp_name), "%s", filename);
+
+    if (!keep || cp->magic != CHECKPOINT_MAGIC || cp->version != CHECKPOINT_VERSION || cp->map_hash != hash ||
+        cp->n_states != n) {
+        memset(cp, 0, sizeof(*cp));
+        cp->magic = CHECKPOINT_MAGIC;
+        cp->version = CHECKPOINT_VERSION;
+        cp->map_hash = hash;
+        cp->n_states = n;
+    }
+    return (1);
+}
+
+/*!
+ * Loads the last complete checkpoint's beliefs into ctx and returns the rest of the saved state. The beliefs are
+ * converted if the checkpoint was written in the other belief domain. The red border flag is not saved: the robot
+ * resumes at the start of a leg, where it is always clear.
+ * @return int, 1 if there was a checkpoint to resume from, 0 otherwise (nothing changed)
+ */
+int checkpoint_resume(struct loc_context *ctx, int *last_act, int *dest_x, int *dest_y, int *had_fix) {
+    int n = N_STATES(ctx->m);
+    double mx = -INFINITY;
+
+    if (cp == NULL || cp->seq == 0 || (cp->seq & 1) || cp->n_states != n) return (0);
+    for (int s = 0; s < n; s++) {
+        if (cp->log_domain == ctx->log_beliefs) ctx->beliefs[s] = cp_beliefs[s];
+        else if (ctx->log_beliefs) ctx->beliefs[s] = log(cp_beliefs[s]);
+        else if (cp_beliefs[s] > mx) mx = cp_beliefs[s];
+    }
+    if (cp->log_domain && !ctx->log_beliefs) {
+        for (int s = 0; s < n; s++) ctx->beliefs[s] = exp(cp_beliefs[s] - mx);
+    }
+    ctx->redflag = 0;
+    ctx->sparse_mode = 0;
+    normalize_beliefs(ctx);
+    *last_act = cp->last_act;
+    *dest_x = cp->dest_x;
+    *dest_y = cp->dest_y;
+    *had_fix = cp->had_fix;
+    return (1);
+}
+
+/*!
+ * Checkpoints the state after a scan: ctx's beliefs, the action the robot is about to take, its target, and whether
+ * it is localized
+ */
+void checkpoint_save(const struct loc_context *ctx, int last_act, int dest_x, int dest_y, int had_fix) {
+    if (cp == NULL) return;
+    __atomic_store_n(&cp->seq, cp->seq + 1, __ATOMIC_RELEASE);
+    memcpy(cp_beliefs, ctx->beliefs, cp->n_states * sizeof(double));
+    cp->log_domain = ctx->log_beliefs;
+    cp->last_act = last_act;
+    cp->dest_x = dest_x;
+    cp->dest_y = dest_y;
+    cp->had_fix = had_fix;
+    __atomic_store_n(&cp->seq, cp->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * Unmaps the checkpoint. done 1 means the run finished, so the file is removed and the next run starts afresh.
+ */
+void checkpoint_close(int done) {
+    if (cp == NULL) return;
+    munmap(cp, cp_size);
+    cp = NULL;
+    cp_beliefs = NULL;
+    if (done) unlink(cp_name);
+}
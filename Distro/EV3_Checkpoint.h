@@ -0,0 +1,49 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Belief checkpoint for the robot. After every scan the localization state (beliefs, the action being taken, the target
+and whether the robot was localized) is copied into a memory-mapped file. If the bluetooth link drops and the process
+exits, the next run on the same map picks the state up again instead of relocalizing from uniform beliefs. Writing is
+a memcpy into the mapping, the kernel flushes it to disk on its own.
+
+ File layout (host byte order):
+
+   struct checkpoint_header
+   double beliefs[n_states], in STATE() order, log-probabilities if log_domain is set
+
+ The header's seq is odd while a checkpoint is being written, so one torn by a crash is never resumed from.
+
+*/
+
+#ifndef __checkpoint_header
+#define __checkpoint_header
+
+#include <stdint.h>
+#include "EV3_Localization_Core.h"
+
+#define CHECKPOINT_MAGIC 0x4b504345    // "ECPK" on disk
+#define CHECKPOINT_VERSION 2     // 2 dropped the red border flag
+
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t map_hash;      // map_hash() of the map the beliefs are over
+    int32_t n_states;
+    int32_t log_domain;     // 1 if the beliefs are log-probabilities
+    int32_t last_act;       // Action the robot was taking after the last scan
+    int32_t dest_x;         // Target of the run
+    int32_t dest_y;
+    int32_t had_fix;        // 1 if the robot was localized at the last scan
+    uint32_t seq;           // Checkpoints written, 0 if none; odd while one is being written
+};
+
+int checkpoint_open(const char *filename, const struct loc_map *m);
+
+int checkpoint_resume(struct loc_context *ctx, int *last_act, int *dest_x, int *dest_y, int *had_fix);
+
+void checkpoint_save(const struct loc_context *ctx, int last_act, int dest_x, int dest_y, int had_fix);
+
+void checkpoint_close(int done);
+
+#endif
@@ -0,0 +1,251 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ AVX2 / SSE2 / scalar kernels for the belief update and map parsing, see EV3_Kernels.h. The x86 versions are compiled with
+function-level target attributes so the program still runs on CPUs without AVX2.
+
+*/
+
+#include <math.h>
+#include "EV3_Kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static double axpy_scalar(double *y, const double *x, double a, int n) {
+    double sum = 0;
+    for (int k = 0; k < n; k++) {
+        y[k] += a * x[k];
+        sum += a * x[k];
+    }
+    return (sum);
+}
+
+/*!
+ * Empties a belief summary before values are fed to track_stats()
+ */
+void reset_stats(struct belief_stats *st) {
+    st->max = -1;
+    st->second = -1;
+    st->best = -1;
+    st->runner_up = -1;
+    st->entropy = 0;
+}
+
+/*!
+ * Feeds belief p of state k into the running best / runner-up of a summary (entropy is accumulated by the caller)
+ */
+void track_stats(struct belief_stats *st, double p, int k) {
+    if (p > st->max) {
+        st->second = st->max;
+        st->runner_up = st->best;
+        st->max = p;
+        st->best = k;
+    } else if (p > st->second) {
+        st->second = p;
+        st->runner_up = k;
+    }
+}
+
+static void masked_scale_scalar(double *b, const unsigned char *sig, unsigned char g, double hit, double miss, int n,
+                                struct belief_stats *st) {
+    double f[2] = {miss, hit};
+    for (int k = 0; k < n; k++) {
+        b[k] *= f[sig[k] == g];
+        track_stats(st, b[k], k);
+        if (b[k] > 0) st->entropy -= b[k] * log(b[k]);
+    }
+}
+
+static long find_rgb_scalar(const unsigned char *img, long n, unsigned char r, unsigned char g, unsigned char b) {
+    for (long p = 0; p < n; p++) {
+        if (img[p * 3] == r && img[(p * 3) + 1] == g && img[(p * 3) + 2] == b) return (p);
+    }
+    return (-1);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2")))
+static double axpy_avx2(double *y, const double *x, double a, int n) {
+    __m256d va = _mm256_set1_pd(a);
+    __m256d acc = _mm256_setzero_pd();
+    __m256d t;
+    double lane[4];
+    double sum;
+    int k = 0;
+
+    for (; k + 4 <= n; k += 4) {
+        t = _mm256_mul_pd(va, _mm256_loadu_pd(x + k));
+        _mm256_storeu_pd(y + k, _mm256_add_pd(_mm256_loadu_pd(y + k), t));
+        acc = _mm256_add_pd(acc, t);
+    }
+    _mm256_storeu_pd(lane, acc);
+    sum = lane[0] + lane[1] + lane[2] + lane[3];
+    return (sum + axpy_scalar(y + k, x + k, a, n - k));
+}
+
+__attribute__((target("avx2")))
+static void masked_scale_avx2(double *b, const unsigned char *sig, unsigned char g, double hit, double miss, int n,
+                              struct belief_stats *st) {
+    __m256i vg = _mm256_set1_epi64x(g);
+    __m256d vhit = _mm256_set1_pd(hit);
+    __m256d vmiss = _mm256_set1_pd(miss);
+    __m256d m1 = _mm256_set1_pd(-1), m2 = m1;   // Per-lane best and runner-up values
+    __m256d i1 = _mm256_set1_pd(-1), i2 = i1;   // and their state indices
+    __m256d idx = _mm256_set_pd(3, 2, 1, 0);
+    __m256d v, mask, gt1, gt2;
+    double lane[4], lane_i[4];
+    int four;
+    int k = 0;
+
+    for (; k + 4 <= n; k += 4) {
+        __builtin_memcpy(&four, sig + k, sizeof(four));
+        mask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four)), vg));
+        v = _mm256_mul_pd(_mm256_loadu_pd(b + k), _mm256_blendv_pd(vmiss, vhit, mask));
+        _mm256_storeu_pd(b + k, v);
+
+        gt1 = _mm256_cmp_pd(v, m1, _CMP_GT_OQ);
+        gt2 = _mm256_cmp_pd(v, m2, _CMP_GT_OQ);
+        m2 = _mm256_blendv_pd(_mm256_blendv_pd(m2, v, gt2), m1, gt1);
+        i2 = _mm256_blendv_pd(_mm256_blendv_pd(i2, idx, gt2), i1, gt1);
+        m1 = _mm256_blendv_pd(m1, v, gt1);
+        i1 = _mm256_blendv_pd(i1, idx, gt1);
+        idx = _mm256_add_pd(idx, _mm256_set1_pd(4));
+
+        _mm256_storeu_pd(lane, v);
+        for (int l = 0; l < 4; l++) if (lane[l] > 0) st->entropy -= lane[l] * log(lane[l]);
+    }
+    // The overall top two are among the lanes' top two
+    _mm256_storeu_pd(lane, m1);
+    _mm256_storeu_pd(lane_i, i1);
+    for (int l = 0; l < 4; l++) if (lane_i[l] >= 0) track_stats(st, lane[l], (int) lane_i[l]);
+    _mm256_storeu_pd(lane, m2);
+    _mm256_storeu_pd(lane_i, i2);
+    for (int l = 0; l < 4; l++) if (lane_i[l] >= 0) track_stats(st, lane[l], (int) lane_i[l]);
+
+    for (; k < n; k++) {
+        b[k] *= (sig[k] == g) ? hit : miss;
+        track_stats(st, b[k], k);
+        if (b[k] > 0) st->entropy -= b[k] * log(b[k]);
+    }
+}
+
+// One 32-byte load holds 10 whole pixels. Bytes equal to r, g and b give three bit masks; shifting the g mask by 1 and
+// the b mask by 2 lines each pixel's three tests up on the bit of its first byte, and 0x09249249 keeps those bits.
+__attribute__((target("avx2")))
+static long find_rgb_avx2(const unsigned char *img, long n, unsigned char r, unsigned char g, unsigned char b) {
+    __m256i vr = _mm256_set1_epi8((char) r), vg = _mm256_set1_epi8((char) g), vb = _mm256_set1_epi8((char) b);
+    __m256i v;
+    unsigned int hit;
+    long p = 0, rest;
+
+    for (; (p + 11) <= n; p += 10) {
+        v = _mm256_loadu_si256((const __m256i *) (img + (p * 3)));
+        hit = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vr));
+        hit &= ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vg))) >> 1;
+        hit &= ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vb))) >> 2;
+        hit &= 0x09249249;
+        if (hit) return (p + (__builtin_ctz(hit) / 3));
+    }
+    rest = find_rgb_scalar(img + (p * 3), n - p, r, g, b);
+    return (rest < 0 ? -1 : p + rest);
+}
+
+__attribute__((target("sse2")))
+static double axpy_sse2(double *y, const double *x, double a, int n) {
+    __m128d va = _mm_set1_pd(a);
+    __m128d acc = _mm_setzero_pd();
+    __m128d t;
+    double lane[2];
+    int k = 0;
+
+    for (; k + 2 <= n; k += 2) {
+        t = _mm_mul_pd(va, _mm_loadu_pd(x + k));
+        _mm_storeu_pd(y + k, _mm_add_pd(_mm_loadu_pd(y + k), t));
+        acc = _mm_add_pd(acc, t);
+    }
+    _mm_storeu_pd(lane, acc);
+    return (lane[0] + lane[1] + axpy_scalar(y + k, x + k, a, n - k));
+}
+
+__attribute__((target("sse2")))
+static void masked_scale_sse2(double *b, const unsigned char *sig, unsigned char g, double hit, double miss, int n,
+                              struct belief_stats *st) {
+    double f[2] = {miss, hit};
+    __m128d v;
+    double lane[2];
+    int k = 0;
+
+    for (; k + 2 <= n; k += 2) {
+        v = _mm_mul_pd(_mm_loadu_pd(b + k), _mm_set_pd(f[sig[k + 1] == g], f[sig[k] == g]));
+        _mm_storeu_pd(b + k, v);
+        _mm_storeu_pd(lane, v);
+        for (int l = 0; l < 2; l++) {
+            track_stats(st, lane[l], k + l);
+            if (lane[l] > 0) st->entropy -= lane[l] * log(lane[l]);
+        }
+    }
+    for (; k < n; k++) {
+        b[k] *= f[sig[k] == g];
+        track_stats(st, b[k], k);
+        if (b[k] > 0) st->entropy -= b[k] * log(b[k]);
+    }
+}
+
+// find_rgb_avx2() with 16-byte loads of 5 pixels
+__attribute__((target("sse2")))
+static long find_rgb_sse2(const unsigned char *img, long n, unsigned char r, unsigned char g, unsigned char b) {
+    __m128i vr = _mm_set1_epi8((char) r), vg = _mm_set1_epi8((char) g), vb = _mm_set1_epi8((char) b);
+    __m128i v;
+    unsigned int hit;
+    long p = 0, rest;
+
+    for (; (p + 6) <= n; p += 5) {
+        v = _mm_loadu_si128((const __m128i *) (img + (p * 3)));
+        hit = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vr));
+        hit &= ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vg))) >> 1;
+        hit &= ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vb))) >> 2;
+        hit &= 0x1249;
+        if (hit) return (p + (__builtin_ctz(hit) / 3));
+    }
+    rest = find_rgb_scalar(img + (p * 3), n - p, r, g, b);
+    return (rest < 0 ? -1 : p + rest);
+}
+
+#endif
+
+double (*axpy_run)(double *y, const double *x, double a, int n) = axpy_scalar;
+void (*masked_scale)(double *b, const unsigned char *sig, unsigned char g, double hit, double miss, int n,
+                     struct belief_stats *st) = masked_scale_scalar;
+long (*find_rgb)(const unsigned char *img, long n, unsigned char r, unsigned char g, unsigned char b) =
+        find_rgb_scalar;
+
+/*!
+ * Points the kernel function pointers at the fastest versions this CPU supports.
+ * @return name of the instruction set selected
+ */
+const char *select_kernels(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        axpy_run = axpy_avx2;
+        masked_scale = masked_scale_avx2;
+        find_rgb = find_rgb_avx2;
+        return ("avx2");
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        axpy_run = axpy_sse2;
+        masked_scale = masked_scale_sse2;
+        find_rgb = find_rgb_sse2;
+        return ("sse2");
+    }
+#endif
+    axpy_run = axpy_scalar;
+    masked_scale = masked_scale_scalar;
+    find_rgb = find_rgb_scalar;
+    return ("scalar");
+}
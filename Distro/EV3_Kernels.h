@@ -0,0 +1,41 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Vector kernels for the belief update. The belief grid is stored as four contiguous planes of doubles, one per
+heading, so the prediction is a set of shifted, scaled copies between planes and the sensing update is a masked
+multiply over the whole grid. parse_map() also uses one to find the first intersection pixel in the image. Each
+kernel has AVX2, SSE2 and scalar versions, select_kernels() picks the best one the CPU supports when the program
+starts.
+
+*/
+
+#ifndef __kernels_header
+#define __kernels_header
+
+// y[0..n-1] += a * x[0..n-1], returns the sum of the added values
+extern double (*axpy_run)(double *y, const double *x, double a, int n);
+
+// Summary of a belief grid, filled in by the same pass that normalizes it
+struct belief_stats {
+    double max;         // Largest belief
+    double second;      // Second largest belief
+    int best;           // State holding the largest belief
+    int runner_up;      // State holding the second largest belief
+    double entropy;     // -sum(p * log(p)), in nats
+};
+
+// b[k] *= (sig[k] == g) ? hit : miss for k in 0..n-1, summarizing the result in st
+extern void (*masked_scale)(double *b, const unsigned char *sig, unsigned char g, double hit, double miss, int n,
+                            struct belief_stats *st);
+
+// Index of the first pixel of img (n packed RGB pixels) equal to (r, g, b), -1 if there is none
+extern long (*find_rgb)(const unsigned char *img, long n, unsigned char r, unsigned char g, unsigned char b);
+
+void reset_stats(struct belief_stats *st);
+
+void track_stats(struct belief_stats *st, double p, int k);
+
+const char *select_kernels(void);
+
+#endif
@@ -89,25 +89,33 @@
 #include "EV3_Localization.h"
 #include <stdbool.h>
 
-int redflag = 0;
-int map[400][4];            
-                            // This holds the representation of the map, up to 20x20
-                            // intersections, raster ordered, 4 building colours per
-                            // intersection.
-int sx, sy;                 // Size of the map (number of intersections along x and y)
-int rbt_x, rbt_y, rbt_dir = -1;
-double beliefs[400][4];     // Beliefs for each location and motion direction
+struct loc_map world;       // The map the robot is driving on, filled by parse_map()
+struct loc_context loc;     // The robot's belief filter over world
+struct loc_ambiguity ambiguity;     // Offline analysis of world (EV3_Ambiguity), ambiguity.n is 0 if there is none
+struct loc_map candidates[MAX_MAPS];    // The maps the robot may be on when it is started with several,
+struct multi_loc search;            //  their filters (see search_maps())
+char *map_names[MAX_MAPS];          //  and their file names
+int n_maps = 1;                     // Candidate maps still in play, 1 once the robot knows its map (world)
+int print_beliefs = PRINT_BELIEFS;  // 1 to also print the belief grid after every scan
 int rgb[3];
 double possibility[8];
 int Black[3],Blue[3],Green[3],Yellow[3],Red[3],White[3];
 int tl = 0, tr = 0, br = 0, bl = 0;
 int turn_choice = -1;
 int turn = -1;
+int had_fix = 0;    // 1 if the last scan left the robot localized
+double *route_dist = NULL;  // Distance from every intersection to the target along the streets, see go_to_target()
 
 int dest_x, dest_y;
 
 
 #define FILE_NAME "rgb.dat" //save for RGB initial value
+#define CONFUSION_FILE "confusion.dat"  // Colour confusion counts from calibration, read_confusion_counts() format
+#define CONFUSION_SAMPLES 20            // Sensor readings per confusion sampling round in calibrate_sensor()
+#define MOTION_FILE "motion.dat"        // Per-action motion weights fitted from logged runs (EV3_Replay -b)
+#define CHECKPOINT_FILE "checkpoint.bin" // Localization state after the last scan, to resume after a disconnect
+#define TELEMETRY_FILE "telemetry.bin" // Belief snapshots and scans, decode with EV3_TelemetryDump
+#define AMBIGUITY_SUFFIX ".amb"        // map_name.amb holds the EV3_Ambiguity analysis of the map, if there is one
 #define ROBOT_INIT 0
 #define ON_THE_ROAD 1
 #define FIND_ROAD 2
@@ -115,7 +123,7 @@ int dest_x, dest_y;
 #define FIND_YELLOW 4
 #define FIND_RED 5
 #define ROBOT_STOP 6
-void update_beliefs(int last_act, int intersection_reading[4]);
+
 
 
 
@@ -123,8 +131,11 @@ void update_beliefs(int last_act, int intersection_reading[4]);
 
 int main(int argc, char *argv[]) {
     char mapname[1024];
-    int rx, ry;
-    unsigned char *map_image;
+    char ambiguity_name[1100];
+    struct loc_params params;
+    double confusion_counts[N_COLOURS][N_COLOURS];
+    int have_confusion;
+    int saved_x, saved_y;
 
 
     //read the RGB initail value from rgb.dat
@@ -159,21 +170,21 @@ int main(int argc, char *argv[]) {
     printf("White  is %i %i %i\n", White[0], White[1], White[2]);
 
 
-    memset(&map[0][0], 0, 400 * 4 * sizeof(int));
-    sx = 0;
-    sy = 0;
-
-    if (argc < 4) {
-        fprintf(stderr, "Usage: EV3_Localization map_name dest_x dest_y\n");
+    if (argc < 4 || argc - 3 > MAX_MAPS) {
+        fprintf(stderr, "Usage: EV3_Localization map_name [map_name ...] dest_x dest_y\n");
         fprintf(stderr, "    map_name - should correspond to a properly formatted .ppm map image\n");
+        fprintf(stderr, "               several (up to %d) may be given, the robot then works out which one it is on\n",
+                MAX_MAPS);
         fprintf(stderr,
                 "    dest_x, dest_y - target location for the bot within the map, -1 -1 calls calibration routine\n");
         exit(1);
     }
 
     strcpy(&mapname[0], argv[1]);
-    dest_x = atoi(argv[2]);
-    dest_y = atoi(argv[3]);
+    n_maps = argc - 3;
+    for (int k = 0; k < n_maps; k++) map_names[k] = argv[k + 1];
+    dest_x = atoi(argv[argc - 2]);
+    dest_y = atoi(argv[argc - 1]);
 
     /******************************************************************************************************************
     * OPTIONAL TO DO: If you added code for sensor calibration, add just below this comment block any code needed to
@@ -181,18 +192,48 @@ int main(int argc, char *argv[]) {
     * ****************************************************************************************************************/
 
 
+    // The confusion counts are optional, without them a scan is scored all-or-nothing with P_HIT / P_MISS
+    have_confusion = read_confusion_counts(CONFUSION_FILE, confusion_counts);
+    if (have_confusion) fprintf(stderr, "Scoring scans with the colour confusion counts in %s\n", CONFUSION_FILE);
+
     // Your code for reading any calibration information should not go below this line //
 
-    map_image = readPPMimage(&mapname[0], &rx, &ry);
-    if (map_image == NULL) {
-        fprintf(stderr, "Unable to open specified map image\n");
-        exit(1);
-    }
+    fprintf(stderr, "Belief update kernels: %s\n", select_kernels());
 
-    if (parse_map(map_image, rx, ry) == 0) {
-        fprintf(stderr, "Unable to parse input image map. Make sure the image is properly formatted\n");
-        free(map_image);
-        exit(1);
+    default_params(&params);
+    if (have_confusion) set_confusion(&params, confusion_counts);
+    if (load_motion_params(MOTION_FILE, &params)) fprintf(stderr, "Using the motion weights in %s\n", MOTION_FILE);
+
+    if (n_maps > 1) {
+        // Several candidate maps are all searched at once, world and loc are set up (along with the map analysis,
+        // telemetry and checkpoints) from the one the robot turns out to be on, see search_maps()
+        if (load_candidates(&params) == 0) exit(1);
+    } else {
+        // Parsed once, then loaded from the compiled map next to the image on later runs
+        if (load_map(&mapname[0], &world) == 0) {
+            fprintf(stderr, "Unable to parse input image map. Make sure the image is properly formatted\n");
+            exit(1);
+        }
+
+        if (init_context(&loc, &world, &params) == 0) {
+            fprintf(stderr, "Out of memory setting up the beliefs for a %d x %d map\n", world.sx, world.sy);
+            free_loc_map(&world);
+            exit(1);
+        }
+
+        // The map analysis is optional too, without it the robot just keeps exploring until it localizes
+        snprintf(ambiguity_name, sizeof(ambiguity_name), "%s%s", mapname, AMBIGUITY_SUFFIX);
+        if (load_ambiguity(ambiguity_name, &world, &ambiguity)) {
+            fprintf(stderr, "Loaded %s: localizing takes at most %d scans, %d states can never be told apart\n",
+                    ambiguity_name, ambiguity.worst, ambiguity.never);
+        }
+
+        // Telemetry is best effort, the robot runs without it
+        if (telemetry_open(TELEMETRY_FILE, world.sx, world.sy)) {
+            atexit(telemetry_close);
+        } else {
+            fprintf(stderr, "Unable to open %s, running without telemetry\n", TELEMETRY_FILE);
+        }
     }
 
     /******************************************************************************************************************
@@ -203,7 +244,7 @@ int main(int argc, char *argv[]) {
     if (BT_open(HEXKEY) != 0) {
         fprintf(stderr, "Unable to open comm socket to the EV3, make sure the EV3 kit is powered on, and that the\n");
         fprintf(stderr, " hex key for the EV3 matches the one in EV3_Localization.h\n");
-        free(map_image);
+        free_maps();
         exit(1);
     }
 
@@ -212,23 +253,37 @@ int main(int argc, char *argv[]) {
     if (dest_x == -1 && dest_y == -1) {
         calibrate_sensor();
         BT_close();
-        free(map_image);
+        free_maps();
         exit(1);
     }
 
-    if (dest_x < 0 || dest_x >= sx || dest_y < 0 || dest_y >= sy) {
-        fprintf(stderr, "Destination location is outside of the map\n");
-        free(map_image);
-        exit(1);
+    // The target has to be on whichever map the robot turns out to be on
+    for (int k = 0; k < n_maps; k++) {
+        if (dest_x < 0 || dest_x >= (n_maps > 1 ? candidates[k].sx : world.sx) || dest_y < 0 ||
+            dest_y >= (n_maps > 1 ? candidates[k].sy : world.sy)) {
+            fprintf(stderr, "Destination location is outside of the map %s\n", map_names[k]);
+            free_maps();
+            exit(1);
+        }
     }
 
-    // Initialize beliefs - uniform probability for each location and direction
-    for (int j = 0; j < sy; j++) {
-        for (int i = 0; i < sx; i++) {
-            beliefs[i + (j * sx)][0] = 1.0 / (double) (sx * sy * 4);
-            beliefs[i + (j * sx)][1] = 1.0 / (double) (sx * sy * 4);
-            beliefs[i + (j * sx)][2] = 1.0 / (double) (sx * sy * 4);
-            beliefs[i + (j * sx)][3] = 1.0 / (double) (sx * sy * 4);
+    // Initialize beliefs - uniform probability for each location and direction, unless the last run on this map
+    // stopped before reaching its target (the bluetooth link dropped): then carry on from its last checkpoint, which
+    // the next scan confirms or corrects. A search over several maps always starts from uniform beliefs (init_multi()
+    // set them up), and only checkpoints once it has settled on a map.
+    if (n_maps > 1) {
+        fprintf(stderr, "Searching %d candidate maps for the robot\n", n_maps);
+    } else {
+        uniform_beliefs(&loc);
+        if (checkpoint_open(CHECKPOINT_FILE, &world) == 0) {
+            fprintf(stderr, "Unable to open %s, running without checkpoints\n", CHECKPOINT_FILE);
+        } else if (checkpoint_resume(&loc, &turn, &saved_x, &saved_y, &had_fix)) {
+            fprintf(stderr, "Resuming from %s (target %d %d, %s)\n", CHECKPOINT_FILE, saved_x, saved_y,
+                    had_fix ? "localized" : "not localized yet");
+            if (saved_x != dest_x || saved_y != dest_y) {
+                fprintf(stderr, "Heading for the new target %d %d instead\n", dest_x, dest_y);
+            }
+            if (had_fix && robot_localization(&loc) >= 0) expect_move(&loc, turn);
         }
     }
 
@@ -240,16 +295,19 @@ int main(int argc, char *argv[]) {
     *
     *          The beliefs array contains one row per intersection (recall that the number of intersections in the map_image
     *          is given by sx, sy, and that the map[][] array contains the colour indices of buildings around each intersection.
-    *          Indexing into the map[][] and beliefs[][] arrays is by raster order, so for an intersection at i,j (with 0<=i<=sx-1
+    *          Indexing into the map[][] and beliefs[] arrays is by raster order, so for an intersection at i,j (with 0<=i<=sx-1
     *          and 0<=j<=sy-1), index=i+(j*sx)
     *
-    *          In the beliefs[][] array, you need to keep track of 4 values per intersection, these correspond to the belief the
+    *          In the beliefs[] array, you need to keep track of 4 values per intersection, these correspond to the belief the
     *          robot is at that specific intersection, moving in one of the 4 possible directions as follows:
     *
-    *          beliefs[i][0] <---- belief the robot is at intersection with index i, facing UP
-    *          beliefs[i][1] <---- belief the robot is at intersection with index i, facing RIGHT
-    *          beliefs[i][2] <---- belief the robot is at intersection with index i, facing DOWN
-    *          beliefs[i][3] <---- belief the robot is at intersection with index i, facing LEFT
+    *          loc.beliefs[STATE(&world, i, 0)] <---- belief the robot is at intersection with index i, facing UP
+    *          loc.beliefs[STATE(&world, i, 1)] <---- belief the robot is at intersection with index i, facing RIGHT
+    *          loc.beliefs[STATE(&world, i, 2)] <---- belief the robot is at intersection with index i, facing DOWN
+    *          loc.beliefs[STATE(&world, i, 3)] <---- belief the robot is at intersection with index i, facing LEFT
+    *
+    *          The beliefs for each direction are stored as one contiguous plane of sx*sy values (see STATE()), the map is
+    *          in world (world.sx, world.sy, world.map[][]) and the beliefs in the context loc.
     *
     *          Initially, all of these beliefs have uniform, equal probability. Your robot must scan intersections and update
     *          belief values based on agreement between what the robot sensed, and the colours in the map.
@@ -279,10 +337,85 @@ int main(int argc, char *argv[]) {
 
     // Cleanup and exit - DO NOT WRITE ANY CODE BELOW THIS LINE
     BT_close();
-    free(map_image);
+    checkpoint_close(0);
+    free_ambiguity(&ambiguity);
+    free_maps();
     exit(0);
 }
 
+/*!
+ * Parses every map named on the command line into candidates[] and sets up the search over them, all with the model
+ * weights in p.
+ * @return int, 1 success 0 fail (nothing is left allocated)
+ */
+int load_candidates(const struct loc_params *p) {
+    int parsed = 0;
+
+    while (parsed < n_maps) {
+        if (load_map(map_names[parsed], &candidates[parsed]) == 0) {
+            fprintf(stderr, "Unable to read map %s. Make sure the image is properly formatted\n", map_names[parsed]);
+            break;
+        }
+        parsed++;
+    }
+    if (parsed == n_maps && init_multi(&search, candidates, n_maps, p, default_workers())) return (1);
+    if (parsed == n_maps) fprintf(stderr, "Out of memory setting up the beliefs for %d maps\n", n_maps);
+    for (int k = 0; k < parsed; k++) free_loc_map(&candidates[k]);
+    return (0);
+}
+
+/*!
+ * One scan of the search over candidate maps: updates the filters of all of them, and once multi_localization()
+ * settles on a map, makes it the robot's map (world and loc, with its map analysis, telemetry and checkpoints) as if
+ * the robot had been started on it alone. The other candidates are dropped.
+ * @return int, 0 if the robot now knows its map and pose (in loc), -1 if still searching
+ */
+int search_maps(int last_act, const int sc[4]) {
+    char ambiguity_name[1100];
+    int k;
+
+    multi_update(&search, last_act, loc.redflag, sc);
+    k = multi_localization(&search);
+    if (k < 0) return (-1);
+
+    fprintf(stderr, "The robot is on map %s\n", map_names[k]);
+    world = candidates[k];
+    loc = search.ctx[k];
+    loc.m = &world;
+    loc.verbose = 1;
+    // The chosen filter now belongs to loc, free_multi() must not free it
+    memset(&search.ctx[k], 0, sizeof(struct loc_context));
+    free_multi(&search);
+    for (int j = 0; j < n_maps; j++) if (j != k) free_loc_map(&candidates[j]);
+    n_maps = 1;
+
+    snprintf(ambiguity_name, sizeof(ambiguity_name), "%s%s", map_names[k], AMBIGUITY_SUFFIX);
+    if (load_ambiguity(ambiguity_name, &world, &ambiguity)) {
+        fprintf(stderr, "Loaded %s: localizing takes at most %d scans, %d states can never be told apart\n",
+                ambiguity_name, ambiguity.worst, ambiguity.never);
+    }
+    if (telemetry_open(TELEMETRY_FILE, world.sx, world.sy)) atexit(telemetry_close);
+    if (checkpoint_open(CHECKPOINT_FILE, &world) == 0) {
+        fprintf(stderr, "Unable to open %s, running without checkpoints\n", CHECKPOINT_FILE);
+    }
+    return (robot_localization(&loc));
+}
+
+/*!
+ * Frees the robot's map and filter, or the candidate maps and their filters if it never settled on one
+ */
+void free_maps(void) {
+    free(route_dist);
+    route_dist = NULL;
+    if (n_maps > 1) {
+        free_multi(&search);
+        for (int k = 0; k < n_maps; k++) free_loc_map(&candidates[k]);
+        return;
+    }
+    free_context(&loc);
+    free_loc_map(&world);
+}
+
 /*!
  * This function gets your robot onto a street, wherever it is placed on the map. You can do this in many ways, but think
  * about what is the most effective and reliable way to detect a street and stop your robot once it's on it.
@@ -349,14 +482,57 @@ int drive_along_street(void) {
             //if(tl != 3 || tr != 6 || br != 2 || bl != 6) {
             printf("turn intersection !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
             int sc[4];
+            int path[HISTORY_LEN], n_path;
             sc[0] = tl;
             sc[1] = tr;
             sc[2] = br;
             sc[3] = bl;
             printf("last turn choice is %i\n",turn);
-            update_beliefs(turn,sc);
-            robot_localization();
-            turn = go_to_target(rbt_x,rbt_y,rbt_dir,dest_x, dest_y);
+            // No rescan is needed for a corner that failed to read (Black): the hit / miss model leaves it out of
+            // the update, and with confusion.dat loaded the confusion model scores Black like any other reading
+            telemetry_scan(turn, loc.redflag, sc);
+            int lost = 0, found;
+            if (n_maps > 1) {
+                // Not sure yet which printed map this is: every candidate takes the scan, and once a single map and
+                // pose dominate search_maps() carries on with that map alone as if the robot had started on it
+                found = search_maps(turn, sc);
+            } else {
+                // A localized robot knows which intersection it should be at: if the scan does not look like it, the
+                // robot was moved or missed a street, so pull the beliefs towards the states that match the scan
+                lost = check_expected(&loc, sc);
+                update_beliefs(&loc, turn, sc);
+                if (lost) partial_reset(&loc, sc);
+                found = robot_localization(&loc);
+                // Losing a fix means the robot slipped or was picked up: instead of re-converging from scratch,
+                // reseed the beliefs from the states that match the last few scans
+                if (found < 0 && had_fix && !lost && relocalize(&loc) > 0) found = robot_localization(&loc);
+            }
+            if (n_maps > 1) {
+                // Explore on the map that looks likeliest so far
+                turn = plan_exploration(&search.ctx[search.best_map]);
+            } else {
+                // The filter's best state must also end the most likely path over the recent scans, otherwise a
+                // misread may be propping it up: keep exploring rather than commit to a long drive on it
+                if (found >= 0 && (n_path = viterbi_path(&loc, path)) > 0 && path[n_path - 1] != loc.summary.best) {
+                    printf("Viterbi path disagrees with the filter, one more scan before trusting the fix\n");
+                    found = -1;
+                }
+                had_fix = (found >= 0);
+                telemetry_beliefs(loc.beliefs, N_STATES(&world), loc.log_beliefs);
+                telemetry_localized(found, loc.rbt_x, loc.rbt_y, loc.rbt_dir, loc.summary.max, loc.summary.second,
+                                    loc.summary.entropy);
+                if (print_beliefs) print_belief_grid(&loc);
+                if (found < 0 && ambiguity_stalled(&loc, &ambiguity)) {
+                    fprintf(stderr, "The map reads the same from every state left, more scans will not localize\n");
+                    BT_all_stop(0);
+                    return 1;
+                }
+                // Until it knows where it is, the robot goes where the next scan is expected to tell it the most
+                if (found < 0) turn = plan_exploration(&loc);
+                else turn = go_to_target(loc.rbt_x, loc.rbt_y, loc.rbt_dir, dest_x, dest_y);
+                if (found >= 0) expect_move(&loc, turn);
+                checkpoint_save(&loc, turn, dest_x, dest_y, had_fix);
+            }
             if (turn == 1){
                 turn_choice = 0;
                 turn_at_intersection(0);
@@ -372,7 +548,7 @@ int drive_along_street(void) {
 
             printf("forward intersection !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
             forward_small_1();
-            redflag = 0;
+            loc.redflag = 0;
             //
             //    forward_small_1();
             //}
@@ -476,636 +652,6 @@ int turn_at_intersection(int turn_direction) {
     return (0);
 }
 
-void update_beliefs(int last_act, int intersection_reading[4]){
-    double last_beliefs[400][4];
-    double C;
-
-    for (int j = 0; j < sy; j++) {
-        for (int i = 0; i < sx; i++) {
-            last_beliefs[i + (j * sx)][0] = beliefs[i + (j * sx)][0];
-            last_beliefs[i + (j * sx)][1] = beliefs[i + (j * sx)][1];
-            last_beliefs[i + (j * sx)][2] = beliefs[i + (j * sx)][2];
-            last_beliefs[i + (j * sx)][3] = beliefs[i + (j * sx)][3];
-        }
-    }
-    //acting 
-    if (redflag){// last point read is red
-        for (int j = 0; j < sy; j++) {
-            for (int i = 0; i < sx; i++) {
-
-                //acting
-                if (last_act == 0){ // going up
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = 0;
-                    } else {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + (j * sx)][1] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j - 1) * sx)][1] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j + 1) * sx)][1] * 0.05;
-                        }
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + (j * sx)][0] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + (j * sx)][0] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + (j * sx)][0] * 0.05;
-                        }
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i + (j * sx)][3] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][3] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j + 1) * sx)][3] * 0.05;
-                        }
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + (j * sx)][2] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + (j * sx)][2] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + (j * sx)][2] * 0.05;
-                        }
-                    }
-                }
-                if (last_act == 1){// turn right
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = 0;
-                    } else {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + (j * sx)][0] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j - 1) * sx)][0] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j + 1) * sx)][0] * 0.05;
-                        }
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + (j * sx)][3] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + (j * sx)][3] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + (j * sx)][3] * 0.05;
-                        }
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i + (j * sx)][2] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][2] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][2] * 0.05;
-                        }
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + (j * sx)][1] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + (j * sx)][1] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + (j * sx)][1] * 0.05;
-                        }
-                    }
-                }
-                if (last_act == 2){//turn back
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = 0;
-                    } else {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + (j * sx)][3] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j - 1) * sx)][3] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j + 1) * sx)][3] * 0.05;
-                        }
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + (j * sx)][2] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + (j * sx)][2] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + (j * sx)][2] * 0.05;
-                        }
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i + (j * sx)][1] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][1] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][1] * 0.05;
-                        }
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + (j * sx)][0] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + (j * sx)][0] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + (j * sx)][0] * 0.05;
-                        }
-                    }
-                } 
-                if (last_act == 3){//turn left
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = 0;
-                    } else {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + (j * sx)][2] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j - 1) * sx)][2] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][3] += last_beliefs[i + ((j + 1) * sx)][2] * 0.05;
-                        }
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + (j * sx)][1] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + (j * sx)][1] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + (j * sx)][1] * 0.05;
-                        }
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i + (j * sx)][0] * 0.8;
-                        if (j - 1 >= 0){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][0] * 0.05;
-                        }
-                        if (j + 1 < sy){
-                            beliefs[i + (j * sx)][1] += last_beliefs[i + ((j - 1) * sx)][0] * 0.05;
-                        }
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = 0;
-                    }else {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + (j * sx)][3] * 0.8;
-                        if (i - 1 >= 0){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + (j * sx)][3] * 0.05;
-                        }
-                        if (i + 1 < sx){
-                            beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + (j * sx)][3] * 0.05;
-                        }
-                    }
-                }
-                
-                //stay at the point
-                beliefs[i + (j * sx)][0] += last_beliefs[i + (j * sx)][0] * 0.1;
-                beliefs[i + (j * sx)][1] += last_beliefs[i + (j * sx)][1] * 0.1;
-                beliefs[i + (j * sx)][2] += last_beliefs[i + (j * sx)][2] * 0.1;
-                beliefs[i + (j * sx)][3] += last_beliefs[i + (j * sx)][3] * 0.1;
-
-                C = C + beliefs[i + (j * sx)][0] 
-                  + beliefs[i + (j * sx)][1]
-                  + beliefs[i + (j * sx)][2]
-                  + beliefs[i + (j * sx)][3];
-
-            }
-        }
-    }else if (last_act != -1){ //first time move, no act before
-        for (int j = 0; j < sy; j++) {
-            for (int i = 0; i < sx; i++) {
-
-                //acting
-                if (last_act == 0){ // going up
-                    //do great job
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + 1 + (j * sx)][3] * 0.8;
-                    } else {
-                        beliefs[i + (j * sx)][3] = 0;
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + ((j - 1) * sx)][2] * 0.8;
-                    }else {
-                        beliefs[i + (j * sx)][2] = 0;
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i - 1 + (j * sx)][1] * 0.8;
-                    }else {
-                        beliefs[i + (j * sx)][1] = 0;
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + ((j + 1) * sx)][0] * 0.8;
-                    }else {
-                        beliefs[i + (j * sx)][0] = 0;
-                    }
-
-                    //from left one
-                    if (i + 1 < sx && j - 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j - 1) * sx)][3] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + ((j - 1) * sx)][2] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j + 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j + 1) * sx)][1] * 0.05;
-                    }
-                    if (j + 1 < sy && i + 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + ((j + 1) * sx)][0] * 0.05;
-                    }
-
-                    //from right one
-                    if (i + 1 < sx && j + 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j + 1) * sx)][3] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i + 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + ((j - 1) * sx)][2] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j - 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j - 1) * sx)][1] * 0.05;
-                    }
-                    if (j + 1 < sy && i - 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + ((j + 1) * sx)][0] * 0.05;
-                    }
-                }
-                if (last_act == 1){// turn right
-                    //do great job
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + 1 + (j * sx)][2] * 0.8;
-                    }else {
-                        beliefs[i + (j * sx)][3] = 0;
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + ((j - 1) * sx)][1] * 0.8;
-                    }
-                    else {
-                        beliefs[i + (j * sx)][2] = 0;
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i - 1 + (j * sx)][0] * 0.8;
-                    }
-                    else {
-                        beliefs[i + (j * sx)][1] = 0;
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + ((j + 1) * sx)][3] * 0.8;
-                    }else {
-                        beliefs[i + (j * sx)][0] = 0;
-                    }
-
-                    //from the left one
-                    if (i + 1 < sx && j - 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j - 1) * sx)][2] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + ((j - 1) * sx)][1] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j + 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j + 1) * sx)][0] * 0.05;
-                    }
-                    if (j + 1 < sy && i + 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + ((j + 1) * sx)][3] * 0.05;
-                    }
-
-                    //from the right one
-                    if (i + 1 < sx && j + 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j + 1) * sx)][2] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i + 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + ((j - 1) * sx)][1] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j - 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j - 1) * sx)][0] * 0.05;
-                    }
-                    if (j + 1 < sy && i - 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + ((j + 1) * sx)][3] * 0.05;
-                    }
-                }
-                if (last_act == 2){//turn back
-                    //do great job
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + 1 + (j * sx)][1] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][3] = 0;
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + ((j - 1) * sx)][0] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][2] = 0;
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i - 1 + (j * sx)][3] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][1] = 0;
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + ((j + 1) * sx)][2] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][0] = 0;
-                    }
-
-                    //from the left one
-                    if (i + 1 < sx && j - 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j - 1) * sx)][1] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + ((j - 1) * sx)][0] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j + 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j + 1) * sx)][3] * 0.05;
-                    }
-                    if (j + 1 < sy && i + 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + ((j + 1) * sx)][2] * 0.05;
-                    }
-
-                    //from the right one
-                    if (i + 1 < sx && j + 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j + 1) * sx)][1] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i + 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + ((j - 1) * sx)][0] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j - 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j - 1) * sx)][3] * 0.05;
-                    }
-                    if (j + 1 < sy && i - 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + ((j + 1) * sx)][2] * 0.05;
-                    }
-                } 
-                if (last_act == 3){//turn left
-                    //do great job
-                    if (i + 1 < sx) {
-                        beliefs[i + (j * sx)][3] = last_beliefs[i + 1 + (j * sx)][0] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][3] = 0;
-                    }
-                    if (j - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] = last_beliefs[i + ((j - 1) * sx)][3] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][2] = 0;
-                    }
-                    if (i - 1 >= 0) {
-                        beliefs[i + (j * sx)][1] = last_beliefs[i - 1 + (j * sx)][2] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][1] = 0;
-                    }
-                    if (j + 1 < sy) {
-                        beliefs[i + (j * sx)][0] = last_beliefs[i + ((j + 1) * sx)][1] * 0.8;
-                    }else{
-                        beliefs[i + (j * sx)][0] = 0;
-                    }
-                    //from the left one
-                    if (i + 1 < sx && j - 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j - 1) * sx)][0] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i - 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i - 1 + ((j - 1) * sx)][3] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j + 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j + 1) * sx)][2] * 0.05;
-                    }
-                    if (j + 1 < sy && i + 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i + 1 + ((j + 1) * sx)][1] * 0.05;
-                    }
-                    //from the right one
-                    if (i + 1 < sx && j + 1 >= 0) {
-                        beliefs[i + (j * sx)][3] += last_beliefs[i + 1 + ((j + 1) * sx)][0] * 0.05;
-                    }
-                    if (j - 1 >= 0 && i + 1 >= 0) {
-                        beliefs[i + (j * sx)][2] += last_beliefs[i + 1 + ((j - 1) * sx)][3] * 0.05;
-                    }
-                    if (i - 1 >= 0 && j - 1 < sy) {
-                        beliefs[i + (j * sx)][1] += last_beliefs[i - 1 + ((j - 1) * sx)][2] * 0.05;
-                    }
-                    if (j + 1 < sy && i - 1 < sx) {
-                        beliefs[i + (j * sx)][0] += last_beliefs[i - 1 + ((j + 1) * sx)][1] * 0.05;
-                    }
-                }
-                
-                //stay at the point
-                beliefs[i + (j * sx)][0] += last_beliefs[i + (j * sx)][0] * 0.1;
-                beliefs[i + (j * sx)][1] += last_beliefs[i + (j * sx)][1] * 0.1;
-                beliefs[i + (j * sx)][2] += last_beliefs[i + (j * sx)][2] * 0.1;
-                beliefs[i + (j * sx)][3] += last_beliefs[i + (j * sx)][3] * 0.1;
-
-                C = C + beliefs[i + (j * sx)][0] 
-                  + beliefs[i + (j * sx)][1]
-                  + beliefs[i + (j * sx)][2]
-                  + beliefs[i + (j * sx)][3];
-
-            }
-        }
-        printf("After acting\n");
-        for (int j = 0; j < sy; j++) { //normolize and print
-            for (int i = 0; i < sx; i++) {
-                beliefs[i + (j * sx)][0] = beliefs[i + (j * sx)][0] / C;
-                beliefs[i + (j * sx)][1] = beliefs[i + (j * sx)][1] / C;
-                beliefs[i + (j * sx)][2] = beliefs[i + (j * sx)][2] / C;
-                beliefs[i + (j * sx)][3] = beliefs[i + (j * sx)][3] / C;
-                printf("i is %i j is %i :\n",i , j );
-                printf("direction is 0 belief is %2f \n", beliefs[i + (j * sx)][0]);
-                printf("direction is 1 belief is %2f \n", beliefs[i + (j * sx)][1]);
-                printf("direction is 2 belief is %2f \n", beliefs[i + (j * sx)][2]);
-                printf("direction is 3 belief is %2f \n", beliefs[i + (j * sx)][3]);
-                printf("\n");
-            }
-        }
-    }
-    //sensing
-    for (int j = 0; j < sy; j++) {
-        for (int i = 0; i < sx; i++) {
-
-            //sensing
-            if (map[i + (j * sx)][0] == intersection_reading[0] 
-                && map[i + (j * sx)][1] == intersection_reading[1]
-                && map[i + (j * sx)][2] == intersection_reading[2]
-                && map[i + (j * sx)][3] == intersection_reading[3]){
-                beliefs[i + (j * sx)][0] *= .7;
-            } else {
-                beliefs[i + (j * sx)][0] *= .3;
-            }
-
-            if (map[i + (j * sx)][1] == intersection_reading[0] 
-                && map[i + (j * sx)][2] == intersection_reading[1]
-                && map[i + (j * sx)][3] == intersection_reading[2]
-                && map[i + (j * sx)][0] == intersection_reading[3]){
-                beliefs[i + (j * sx)][1] *= .7;
-            } else {
-                beliefs[i + (j * sx)][1] *= .3;
-            }
-
-            if (map[i + (j * sx)][2] == intersection_reading[0] 
-                && map[i + (j * sx)][3] == intersection_reading[1]
-                && map[i + (j * sx)][0] == intersection_reading[2]
-                && map[i + (j * sx)][1] == intersection_reading[3]){
-                beliefs[i + (j * sx)][2] *= .7;
-            } else {
-                beliefs[i + (j * sx)][2] *= .3;
-            }
-
-            if (map[i + (j * sx)][3] == intersection_reading[0] 
-                && map[i + (j * sx)][0] == intersection_reading[1]
-                && map[i + (j * sx)][1] == intersection_reading[2]
-                && map[i + (j * sx)][2] == intersection_reading[3]){
-                beliefs[i + (j * sx)][3] *= .7;
-            } else {
-                beliefs[i + (j * sx)][3] *= .3;
-            }
-            C = C + beliefs[i + (j * sx)][0] 
-                  + beliefs[i + (j * sx)][1]
-                  + beliefs[i + (j * sx)][2]
-                  + beliefs[i + (j * sx)][3];
-        }
-    }
-    for (int j = 0; j < sy; j++) { //normolize and print
-        for (int i = 0; i < sx; i++) {
-            beliefs[i + (j * sx)][0] = beliefs[i + (j * sx)][0] / C;
-            beliefs[i + (j * sx)][1] = beliefs[i + (j * sx)][1] / C;
-            beliefs[i + (j * sx)][2] = beliefs[i + (j * sx)][2] / C;
-            beliefs[i + (j * sx)][3] = beliefs[i + (j * sx)][3] / C;
-            printf("i is %i j is %i :\n",i , j );
-            printf("direction is 0 belief is %2f \n", beliefs[i + (j * sx)][0]);
-            printf("direction is 1 belief is %2f \n", beliefs[i + (j * sx)][1]);
-            printf("direction is 2 belief is %2f \n", beliefs[i + (j * sx)][2]);
-            printf("direction is 3 belief is %2f \n", beliefs[i + (j * sx)][3]);
-            printf("\n");
-        }
-    }
-}
-
-int robot_localization() {
-    /*  This function implements the main robot localization process. You have to write all code that will control the robot
-     *  and get it to carry out the actions required to achieve localization.
-     *
-     *  Localization process:
-     *
-     *  - Find the street, and drive along the street toward an intersection
-     *  - Scan the colours of buildings around the intersection
-     *  - Update the beliefs in the beliefs[][] array according to the sensor measurements and the map data
-     *  - Repeat the process until a single intersection/facing direction is distintly more likely than all the rest
-     *
-     *  * We have provided headers for the following functions:
-     *
-     *  find_street()
-     *  drive_along_street()
-     *  scan_intersection()
-     *  turn_at_intersection()
-     *
-     *  You *do not* have to use them, and can write your own to organize your robot's work as you like, they are
-     *  provided as a suggestion.
-     *
-     *  Note that *your bot must explore* the map to achieve reliable localization, this means your intersection
-     *  scanning strategy should not rely exclusively on moving forward, but should include turning and exploring
-     *  other streets than the one your bot was initially placed on.
-     *
-     *  For each of the control functions, however, you will need to use the EV3 API, so be sure to become familiar with
-     *  it.
-     *
-     *  In terms of sensor management - the API allows you to read colours either as indexed values or rgb, it's up to
-     *  you which one to use, and how to interpret the noisy, unreliable data you're likely to get from the sensor
-     *  in order to update beliefs.
-     *
-     *  HOWEVER: *** YOU must document clearly both in comments within this function, and in your report, how the
-     *               sensor is used to read colour data, and how the beliefs are updated based on the sensor readings.
-     *
-     *  DO NOT FORGET - Beliefs should always remain normalized to be a probability distribution, that means the
-     *                  sum of beliefs over all intersections and facing directions must be 1 at all times.
-     *
-     *  The function receives as input pointers to three integer values, these will be used to store the estimated
-     *   robot's location and facing direction. The direction is specified as:
-     *   0 - UP
-     *   1 - RIGHT
-     *   2 - BOTTOM
-     *   3 - LEFT
-     *
-     *  The function's return value is 1 if localization was successful, and 0 otherwise.
-     */
-
-    /************************************************************************************************************************
-     *   TO DO  -   Complete this function
-     ***********************************************************************************************************************/
-
-    // Return an invalid location/direction and notify that localization was unsuccessful (you will delete this and replace it
-    // with your code).
-    double max = -1;
-    rbt_x, rbt_y, rbt_dir = -1;
-
-
-    for (int j = 0; j < sy; j++) {
-        for (int i = 0; i < sx; i++) {
-            if (max < beliefs[i + (j * sx)][0]){
-                max = beliefs[i + (j * sx)][0];
-                rbt_x = i;
-                rbt_y = j;
-                rbt_dir = 0;
-            }else if (max < beliefs[i + (j * sx)][1]){
-                max = beliefs[i + (j * sx)][1];
-                rbt_x = i;
-                rbt_y = j;
-                rbt_dir = 1;
-            }else if (max < beliefs[i + (j * sx)][2]){
-                max = beliefs[i + (j * sx)][2];
-                rbt_x = i;
-                rbt_y = j;
-                rbt_dir = 2;
-            }else if (max < beliefs[i + (j * sx)][3]){
-                max = beliefs[i + (j * sx)][3];
-                rbt_x = i;
-                rbt_y = j;
-                rbt_dir = 3;
-            }
-        }
-    }
-    printf("Max is %2f rbt_x is %i rbt_y is %i rbt_dir is %i\n", max,rbt_x,rbt_y,rbt_dir);
-    for (int j = 0; j < sy; j++) {
-        for (int i = 0; i < sx; i++) {
-            if (max == beliefs[i + (j * sx)][0] && (rbt_x != i || rbt_y != j || rbt_dir != 0)){
-                rbt_x = -1;
-                rbt_y = -1;
-                rbt_dir = -1;
-                return(-1);
-            }else if (max == beliefs[i + (j * sx)][1] && (rbt_x != i || rbt_y != j || rbt_dir != 1)){
-                rbt_x = -1;
-                rbt_y = -1;
-                rbt_dir = -1;
-                return(-1);
-            }else if (max == beliefs[i + (j * sx)][2] && (rbt_x != i || rbt_y != j || rbt_dir != 2)){
-                rbt_x = -1;
-                rbt_y = -1;
-                rbt_dir = -1;
-                return(-1);
-            }else if (max == beliefs[i + (j * sx)][3] && (rbt_x != i || rbt_y != j || rbt_dir != 3)){
-                rbt_x = -1;
-                rbt_y = -1;
-                rbt_dir = -1;
-                return(-1);
-            }
-        }
-    }
-    printf("Find the localization: i is %i j is %i direction is %i \n", rbt_x,rbt_y,rbt_dir);
-    return (0);
-}
-
 int go_to_target(int robot_x, int robot_y, int direction, int target_x, int target_y) {
     /*
      * This function is called once localization has been successful, it performs the actions required to take the robot
@@ -1129,6 +675,7 @@ int go_to_target(int robot_x, int robot_y, int direction, int target_x, int targ
      ***********************************************************************************************************************/
     if (robot_x == target_x && robot_y == target_y){
         printf("success!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
+        checkpoint_close(1);
         exit(0);
     }
 
@@ -1137,53 +684,25 @@ int go_to_target(int robot_x, int robot_y, int direction, int target_x, int targ
         return(0);
     }
 
-    if (robot_x == target_x){
-        if (robot_y < target_y){
-            if (direction == 0){
-                return 2;
-            }else if (direction == 1){
-                return 1;
-            }else if (direction == 2){
-                return 0;
-            }else{ // directiont ==3
-                return 3;
-            }
-        }else{//robot_y > target_y
-            if (direction == 0){
-                return 0;
-            }else if (direction == 1){
-                return 3;
-            }else if (direction == 2){
-                return 2;
-            }else{ // directiont ==3
-                return 1;
-            }
-        }
-
-    }else if (robot_x < target_x){
-        if (direction == 0){
-            return 1;
-        }else if (direction == 1){
-            return 0;
-        }else if (direction == 2){
-            return 3;
-        }else{ // directiont ==3
-            return 2;
-        }
-    }else{ //robot_x > target_x
-        if (direction == 0){
-            return 3;
-        }else if (direction == 1){
-            return 2;
-        }else if (direction == 2){
-            return 1;
-        }else{ // direction == 3
-            return 0;
+    // Drive along the shortest route through the map's streets, which avoids dead ends and missing streets. The
+    // distances to the target are worked out once, the first time the robot knows where it is.
+    if (route_dist == NULL) {
+        route_dist = (double *) calloc(world.sx * world.sy, sizeof(double));
+        if (route_dist == NULL || route_distances(&world, target_x + (target_y * world.sx), route_dist) == 0) {
+            fprintf(stderr, "Out of memory planning a route to %d %d\n", target_x, target_y);
+            free(route_dist);
+            route_dist = NULL;
+            return (0);
         }
-
     }
-
-    return (0);
+    int act = route_action(&world, route_dist, STATE(&world, robot_x + (robot_y * world.sx), direction));
+    if (act < 0) {
+        fprintf(stderr, "No street leads from %d %d to the target %d %d\n", robot_x, robot_y, target_x, target_y);
+        BT_all_stop(0);
+        free_maps();
+        exit(1);
+    }
+    return (act);
 }
 
 /*!
@@ -1214,8 +733,16 @@ void calibrate_sensor(void) {
     printf("4 Yellow calibration,Please enter: y\n");
     printf("5 Red    calibration,Please enter: r\n");
     printf("6 White  calibration,Please enter: w\n");
+    printf("7 Confusion sampling,Please enter: m\n");
     printf("Q Exit   calibration,Please enter: q\n");
     printf("=Select which the colour you want to calibration =\n");
+    // Confusion sampling: with the sensor over a known colour, count what Distinguish_Color() reads. The counts of
+    // every session are added to CONFUSION_FILE, the sensing model normalizes them (see set_confusion()).
+    const char *colour_keys = "bugyrw";
+    double counts[N_COLOURS][N_COLOURS];
+    int sampled = 0, read;
+    const char *key;
+    read_confusion_counts(CONFUSION_FILE, counts);
     char c = getchar();
     while (c != 'q') {
         getchar();
@@ -1268,6 +795,22 @@ void calibrate_sensor(void) {
                 White[2] = rgb[2];
                 printf("Black_RGB %i %i %i\n", rgb[0], rgb[1], rgb[2]);
                 break;
+            case 'm':
+                printf("7 Confusion sampling, enter the colour under the sensor (b u g y r w): ");
+                c = getchar();
+                getchar();
+                key = strchr(colour_keys, c);
+                if (c == '\0' || key == NULL) {
+                    printf("Please enter b u g y r w\n");
+                    break;
+                }
+                for (int i = 0; i < CONFUSION_SAMPLES; i++) {
+                    read = Distinguish_Color();
+                    if (read >= 1 && read <= N_COLOURS) counts[key - colour_keys][read - 1]++;
+                }
+                sampled = 1;
+                printf("Sampled %d readings of colour %d\n", CONFUSION_SAMPLES, (int) (key - colour_keys) + 1);
+                break;
 
             default:
                 printf("Please enter b u g y r w\n");
@@ -1279,6 +822,7 @@ void calibrate_sensor(void) {
         printf("4 Yellow calibration,Please enter: y\n");
         printf("5 Red    calibration,Please enter: r\n");
         printf("6 White  calibration,Please enter: w\n");
+        printf("7 Confusion sampling,Please enter: m\n");
         printf("Q Exit   calibration,Please enter: q\n");
         printf("=================================================\n");
         c = getchar();
@@ -1301,289 +845,12 @@ void calibrate_sensor(void) {
         fprintf(fp, "%i\n", White[i]);
     }
     fclose(fp);
+    if (sampled) write_confusion_counts(CONFUSION_FILE, counts);
 
 
     fprintf(stderr, "Calibration function called!\n");
 }
 
-int parse_map(unsigned char *map_img, int rx, int ry) {
-    /*
-      This function takes an input image map array, and two integers that specify the image size.
-      It attempts to parse this image into a representation of the map in the image. The size
-      and resolution of the map image should not affect the parsing (i.e. you can make your own
-      maps without worrying about the exact position of intersections, roads, buildings, etc.).
-
-      However, this function requires:
-
-      * White background for the image  [255 255 255]
-      * Red borders around the map  [255 0 0]
-      * Black roads  [0 0 0]
-      * Yellow intersections  [255 255 0]
-      * Buildings that are pure green [0 255 0], pure blue [0 0 255], or white [255 255 255]
-      (any other colour values are ignored - so you can add markings if you like, those
-       will not affect parsing)
-
-      The image must be a properly formated .ppm image, see readPPMimage below for details of
-      the format. The GIMP image editor saves properly formatted .ppm images, as does the
-      imagemagick image processing suite.
-
-      The map representation is read into the map array, with each row in the array corrsponding
-      to one intersection, in raster order, that is, for a map with k intersections along its width:
-
-       (row index for the intersection)
-
-       0     1     2    3 ......   k-1
-
-       k    k+1   k+2  ........
-
-       Each row will then contain the colour values for buildings around the intersection
-       clockwise from top-left, that is
-
-
-       top-left               top-right
-
-               intersection
-
-       bottom-left           bottom-right
-
-       So, for the first intersection (at row 0 in the map array)
-       map[0][0] <---- colour for the top-left building
-       map[0][1] <---- colour for the top-right building
-       map[0][2] <---- colour for the bottom-right building
-       map[0][3] <---- colour for the bottom-left building
-
-       Color values for map locations are defined as follows (this agrees with what the
-       EV3 sensor returns in indexed-colour-reading mode):
-
-       1 -  Black
-       2 -  Blue
-       3 -  Green
-       4 -  Yellow
-       5 -  Red
-       6 -  White
-
-       If you find a 0, that means you're trying to access an intersection that is not on the
-       map! Also note that in practice, because of how the map is defined, you should find
-       only Green, Blue, or White around a given intersection.
-
-       The map size (the number of intersections along the horizontal and vertical directions) is
-       updated and left in the global variables sx and sy.
-
-       Feel free to create your own maps for testing (you'll have to print them to a reasonable
-       size to use with your bot).
-
-    */
-
-    int last3[3];
-    int x, y;
-    unsigned char R, G, B;
-    int ix, iy;
-    int bx, by, dx, dy, wx, wy;         // Intersection geometry parameters
-    int tgl;
-    int idx;
-
-    ix = iy = 0;       // Index to identify the current intersection
-
-    // Determine the spacing and size of intersections in the map
-    tgl = 0;
-    for (int i = 0; i < rx; i++) {
-        for (int j = 0; j < ry; j++) {
-            R = *(map_img + ((i + (j * rx)) * 3));
-            G = *(map_img + ((i + (j * rx)) * 3) + 1);
-            B = *(map_img + ((i + (j * rx)) * 3) + 2);
-            if (R == 255 && G == 255 && B == 0) {
-                // First intersection, top-left pixel. Scan right to find width and spacing
-                bx = i;           // Anchor for intersection locations
-                by = j;
-                for (int k = i; k < rx; k++)        // Find width and horizontal distance to next intersection
-                {
-                    R = *(map_img + ((k + (by * rx)) * 3));
-                    G = *(map_img + ((k + (by * rx)) * 3) + 1);
-                    B = *(map_img + ((k + (by * rx)) * 3) + 2);
-                    if (tgl == 0 && (R != 255 || G != 255 || B != 0)) {
-                        tgl = 1;
-                        wx = k - i;
-                    }
-                    if (tgl == 1 && R == 255 && G == 255 && B == 0) {
-                        tgl = 2;
-                        dx = k - i;
-                    }
-                }
-                for (int k = j; k < ry; k++)        // Find height and vertical distance to next intersection
-                {
-                    R = *(map_img + ((bx + (k * rx)) * 3));
-                    G = *(map_img + ((bx + (k * rx)) * 3) + 1);
-                    B = *(map_img + ((bx + (k * rx)) * 3) + 2);
-                    if (tgl == 2 && (R != 255 || G != 255 || B != 0)) {
-                        tgl = 3;
-                        wy = k - j;
-                    }
-                    if (tgl == 3 && R == 255 && G == 255 && B == 0) {
-                        tgl = 4;
-                        dy = k - j;
-                    }
-                }
-
-                if (tgl != 4) {
-                    fprintf(stderr, "Unable to determine intersection geometry!\n");
-                    return (0);
-                } else break;
-            }
-        }
-        if (tgl == 4) break;
-    }
-    fprintf(stderr,
-            "Intersection parameters: base_x=%d, base_y=%d, width=%d, height=%d, horiz_distance=%d, vertical_distance=%d\n",
-            bx, by, wx, wy, dx, dy);
-
-    sx = 0;
-    for (int i = bx + (wx / 2); i < rx; i += dx) {
-        R = *(map_img + ((i + (by * rx)) * 3));
-        G = *(map_img + ((i + (by * rx)) * 3) + 1);
-        B = *(map_img + ((i + (by * rx)) * 3) + 2);
-        if (R == 255 && G == 255 && B == 0) sx++;
-    }
-
-    sy = 0;
-    for (int j = by + (wy / 2); j < ry; j += dy) {
-        R = *(map_img + ((bx + (j * rx)) * 3));
-        G = *(map_img + ((bx + (j * rx)) * 3) + 1);
-        B = *(map_img + ((bx + (j * rx)) * 3) + 2);
-        if (R == 255 && G == 255 && B == 0) sy++;
-    }
-
-    fprintf(stderr, "Map size: Number of horizontal intersections=%d, number of vertical intersections=%d\n", sx, sy);
-
-    // Scan for building colours around each intersection
-    idx = 0;
-    for (int j = 0; j < sy; j++)
-        for (int i = 0; i < sx; i++) {
-            x = bx + (i * dx) + (wx / 2);
-            y = by + (j * dy) + (wy / 2);
-
-            fprintf(stderr, "Intersection location: %d, %d\n", x, y);
-            // Top-left
-            x -= wx;
-            y -= wy;
-            R = *(map_img + ((x + (y * rx)) * 3));
-            G = *(map_img + ((x + (y * rx)) * 3) + 1);
-            B = *(map_img + ((x + (y * rx)) * 3) + 2);
-            if (R == 0 && G == 255 && B == 0) map[idx][0] = 3;
-            else if (R == 0 && G == 0 && B == 255) map[idx][0] = 2;
-            else if (R == 255 && G == 255 && B == 255) map[idx][0] = 6;
-            else fprintf(stderr, "Colour is not valid for intersection %d,%d, Top-Left rgb=%d,%d,%d\n", i, j, R, G, B);
-
-            // Top-right
-            x += 2 * wx;
-            R = *(map_img + ((x + (y * rx)) * 3));
-            G = *(map_img + ((x + (y * rx)) * 3) + 1);
-            B = *(map_img + ((x + (y * rx)) * 3) + 2);
-            if (R == 0 && G == 255 && B == 0) map[idx][1] = 3;
-            else if (R == 0 && G == 0 && B == 255) map[idx][1] = 2;
-            else if (R == 255 && G == 255 && B == 255) map[idx][1] = 6;
-            else fprintf(stderr, "Colour is not valid for intersection %d,%d, Top-Right rgb=%d,%d,%d\n", i, j, R, G, B);
-
-            // Bottom-right
-            y += 2 * wy;
-            R = *(map_img + ((x + (y * rx)) * 3));
-            G = *(map_img + ((x + (y * rx)) * 3) + 1);
-            B = *(map_img + ((x + (y * rx)) * 3) + 2);
-            if (R == 0 && G == 255 && B == 0) map[idx][2] = 3;
-            else if (R == 0 && G == 0 && B == 255) map[idx][2] = 2;
-            else if (R == 255 && G == 255 && B == 255) map[idx][2] = 6;
-            else
-                fprintf(stderr, "Colour is not valid for intersection %d,%d, Bottom-Right rgb=%d,%d,%d\n", i, j, R, G,
-                        B);
-
-            // Bottom-left
-            x -= 2 * wx;
-            R = *(map_img + ((x + (y * rx)) * 3));
-            G = *(map_img + ((x + (y * rx)) * 3) + 1);
-            B = *(map_img + ((x + (y * rx)) * 3) + 2);
-            if (R == 0 && G == 255 && B == 0) map[idx][3] = 3;
-            else if (R == 0 && G == 0 && B == 255) map[idx][3] = 2;
-            else if (R == 255 && G == 255 && B == 255) map[idx][3] = 6;
-            else
-                fprintf(stderr, "Colour is not valid for intersection %d,%d, Bottom-Left rgb=%d,%d,%d\n", i, j, R, G,
-                        B);
-
-            fprintf(stderr, "Colours for this intersection: %d, %d, %d, %d\n", map[idx][0], map[idx][1], map[idx][2],
-                    map[idx][3]);
-
-            idx++;
-        }
-
-    return (1);
-}
-
-unsigned char *readPPMimage(const char *filename, int *rx, int *ry) {
-    // Reads an image from a .ppm file. A .ppm file is a very simple image representation
-    // format with a text header followed by the binary rgb data at 24bits per pixel.
-    // The header has the following form:
-    //
-    // P6
-    // # One or more comment lines preceded by '#'
-    // 340 200
-    // 255
-    //
-    // The first line 'P6' is the .ppm format identifier, this is followed by one or more
-    // lines with comments, typically used to inidicate which program generated the
-    // .ppm file.
-    // After the comments, a line with two integer values specifies the image resolution
-    // as number of pixels in x and number of pixels in y.
-    // The final line of the header stores the maximum value for pixels in the image,
-    // usually 255.
-    // After this last header line, binary data stores the rgb values for each pixel
-    // in row-major order. Each pixel requires 3 bytes ordered R, G, and B.
-    //
-    // NOTE: Windows file handling is rather crotchetty. You may have to change the
-    //       way this file is accessed if the images are being corrupted on read
-    //       on Windows.
-    //
-
-    FILE *f;
-    unsigned char *im;
-    char line[1024];
-    int i;
-    unsigned char *tmp;
-    double *frgb;
-
-    im = NULL;
-    f = fopen(filename, "rb+");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file %s for reading, please check name and path\n", filename);
-        return (NULL);
-    }
-    fgets(&line[0], 1000, f);
-    if (strcmp(&line[0], "P6\n") != 0) {
-        fprintf(stderr, "Wrong file format, not a .ppm file or header end-of-line characters missing\n");
-        fclose(f);
-        return (NULL);
-    }
-    fprintf(stderr, "%s\n", line);
-    // Skip over comments
-    fgets(&line[0], 511, f);
-    while (line[0] == '#') {
-        fprintf(stderr, "%s", line);
-        fgets(&line[0], 511, f);
-    }
-    sscanf(&line[0], "%d %d\n", rx, ry);                  // Read image size
-    fprintf(stderr, "nx=%d, ny=%d\n\n", *rx, *ry);
-
-    fgets(&line[0], 9, f);                    // Read the remaining header line
-    fprintf(stderr, "%s\n", line);
-    im = (unsigned char *) calloc((*rx) * (*ry) * 3, sizeof(unsigned char));
-    if (im == NULL) {
-        fprintf(stderr, "Out of memory allocating space for image\n");
-        fclose(f);
-        return (NULL);
-    }
-    fread(im, (*rx) * (*ry) * 3 * sizeof(unsigned char), 1, f);
-    fclose(f);
-
-    return (im);
-}
-
 /************************************************************************************************************************
  *   HELPER FUNCTION SECTION
  ***********************************************************************************************************************/
@@ -1766,7 +1033,7 @@ void command(void){
 */
 void find_red(void) {
     printf("find RED !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
-    redflag = 1;
+    loc.redflag = 1;
     turn_180_degree_both_wheel();
     printf("delay ***************************************************************************\n");
     for(int i = 0; i <= 1000000000; i ++);
@@ -67,17 +67,29 @@ code that you have to complete in order to implement the localization algorithms
 #include<math.h>
 #include<malloc.h>
 #include "./EV3_RobotControl/btcomm.h"
+#include "EV3_Localization_Core.h"
+#include "EV3_Telemetry.h"
+#include "EV3_Checkpoint.h"
+#include "EV3_MultiMap.h"
+#include "EV3_MapCache.h"
+#include "EV3_ThreadPool.h"
+
+#ifndef PRINT_BELIEFS
+#define PRINT_BELIEFS 0     // Build with -DPRINT_BELIEFS=1 to print the belief grid after every scan
+#endif
 
 #ifndef HEXKEY
 //#define HEXKEY "00:16:53:56:55:D9"	// <--- SET UP YOUR EV3's HEX ID here
 #define HEXKEY "00:16:53:55:D2:17"
 #endif
 
-int parse_map(unsigned char *map_img, int rx, int ry);
+int go_to_target(int robot_x, int robot_y, int direction, int target_x, int target_y);
 
-int robot_localization();
+int load_candidates(const struct loc_params *p);
 
-int go_to_target(int robot_x, int robot_y, int direction, int target_x, int target_y);
+int search_maps(int last_act, const int sc[4]);
+
+void free_maps(void);
 
 int find_street(void);
 
@@ -89,8 +101,6 @@ int turn_at_intersection(int turn_direction);
 
 void calibrate_sensor(void);
 
-unsigned char *readPPMimage(const char *filename, int *rx, int *ry);
-
 int color_recognize(void);
 
 void turn_90_degree_both_wheel(int);
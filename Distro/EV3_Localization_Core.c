@@ -0,0 +1,2556 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ The localization core: map parsing, the motion and sensing models, and the histogram filter over intersections and
+headings. Nothing in here talks to the robot, so the same code runs on the laptop driving the EV3 and in the offline
+tools (see EV3_Replay.c).
+
+ All the state lives in two objects: a struct loc_map, filled by parse_map() and read-only afterwards, and one
+struct loc_context per filter (model weights, transition tables, belief buffers). Any number of contexts can share one
+map and run on different threads.
+
+*/
+
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "EV3_Localization_Core.h"
+#include "EV3_ThreadPool.h"
+
+#define LOCALIZATION_RATIO 2.0  // The best state must be this many times likelier than the runner-up
+#define LOG_RENORM_RANGE 100.0  // Log-belief mode renormalizes once the largest log-belief is this far from 0
+
+#define SPARSE_K 64                 // Size of the hypothesis set in top-K mode
+#define SPARSE_ENTER_MASS 0.99      // Switch to top-K mode once the top SPARSE_K states hold this much mass
+#define SPARSE_KEEP_MASS 0.95       // Leave it if truncating to SPARSE_K would keep less than this,
+#define SPARSE_EXIT_LIKELIHOOD 0.4  //  or if the average likelihood of a scan over the set drops below this
+#define SPARSE_FLOOR 0.05           // Uniform mass mixed back in when returning to the dense grid
+
+#define RELOC_FLOOR 0.05            // Uniform mass mixed into the beliefs relocalize() seeds
+
+#define MATCH_DECAY 0.5             // Weight of the history in the running corner-match score
+#define MATCH_LOST 0.6              // The fix is dropped once the running score falls below this,
+#define MATCH_MAX_WRONG 3           //  or as soon as this many corners of one scan are wrong
+#define RESET_KEEP 0.3              // Share of the old beliefs partial_reset() keeps,
+#define RESET_FLOOR 0.05            //  spread uniformly, and the rest goes to the states matching the scan
+
+#define AMBIGUITY_STALL_MASS 0.9    // Stop exploring once a class of indistinguishable states holds this much mass
+
+#define CONFUSION_PRIOR 1.0         // Count added to every cell of the confusion matrix, no reading is ever impossible
+
+#define LABEL_TILES_PER_WORKER 4    // Horizontal tiles per worker when labelling the intersections of a map image
+#define COMPONENT_MIN_SHARE 0.2     // Yellow components smaller than this share of the largest are stray marks
+
+int step_x[4] = {0, 1, 0, -1};  // Intersection offsets for one move UP, RIGHT, DOWN, LEFT
+int step_y[4] = {-1, 0, 1, 0};
+
+/*!
+ * Sensing likelihood of every map signature for one scan: p_miss + (p_hit - p_miss) * (product over the corners of
+ * corner_lik[k][colour the signature has at k]). With all four corners known for certain this is p_hit for the
+ * signature read and p_miss for every other, and a corner nothing is known about matches any colour. Under the
+ * confusion model the corners are independent and the likelihood is the product alone.
+ */
+static void signature_likelihoods(const struct loc_params *p, const double corner_lik[4][3], double lik[256]) {
+    double L;
+    int c;
+
+    for (int g = 0; g < 256; g++) {
+        L = 1.0;
+        for (int k = 0; k < 4 && L > 0; k++) {
+            c = (g >> (2 * k)) & 3;
+            L *= (c < 3) ? corner_lik[k][c] : 0.0;
+        }
+        lik[g] = p->use_confusion ? L : p->p_miss + ((p->p_hit - p->p_miss) * L);
+    }
+}
+
+/*!
+ * Compiles the confusion matrix of ctx->p into pair_lik[][], so the likelihood of a scan under every map signature is
+ * two lookups and a multiply (the two halves of the signature are the two pairs of corners)
+ */
+static void build_sensing_table(struct loc_context *ctx) {
+    const int building[3] = {2, 3, 6};
+    double P[7][4];     // P[read][code]: likelihood of a corner read as colour read + 1 (6 not read), given its code
+
+    for (int r = 0; r < 7; r++) {
+        for (int c = 0; c < 4; c++) {
+            if (r == 6) P[r][c] = 1.0;
+            else P[r][c] = (c < 3) ? ctx->p.confusion[building[c] - 1][r] : 0.0;
+        }
+    }
+    for (int a = 0; a < 7; a++) {
+        for (int b = 0; b < 7; b++) {
+            for (int q = 0; q < 16; q++) ctx->pair_lik[(7 * a) + b][q] = P[a][q & 3] * P[b][q >> 2];
+        }
+    }
+}
+
+/*!
+ * Index of a reading into the confusion model tables: colour - 1, or 6 for anything that is not a sensor colour
+ */
+static int reading_index(int colour) {
+    return ((colour >= 1 && colour <= N_COLOURS) ? colour - 1 : 6);
+}
+
+static void filter_update(struct loc_context *ctx, int last_act, int sig, const double *lik){
+    const struct loc_map *m = ctx->m;
+    const struct transition_table *T;
+    double *tmp;
+    double *b;
+    double C = 1.0, C0, M, mx, P = 0, L = 0;
+    int exact = (sig >= 0 && !ctx->p.use_confusion);
+
+    //sensing - a reading with all four corners known is a one-byte signature sig, and the inverted index gives
+    //          exactly the states that expect it. Every other state would be scaled by p_miss, which cancels out in
+    //          the normalization, so only the matching states are touched, by p_hit / p_miss. Partial or uncertain
+    //          readings, and every reading under the confusion model, scale each state by lik[] of its map signature
+    //          instead.
+
+    // The last RELOC_WINDOW scans, for relocalize(). A reading that is not all building colours, or a scan with no
+    // known move before it, breaks the chain and the window starts over.
+    if (sig < 0 || last_act < 0 || last_act > 3) ctx->n_window = 0;
+    if (sig >= 0) {
+        if (ctx->n_window == RELOC_WINDOW) {
+            memmove(&ctx->window_sig[0], &ctx->window_sig[1], (RELOC_WINDOW - 1) * sizeof(int));
+            memmove(&ctx->window_act[0], &ctx->window_act[1], (RELOC_WINDOW - 1) * sizeof(int));
+            memmove(&ctx->window_flag[0], &ctx->window_flag[1], (RELOC_WINDOW - 1) * sizeof(int));
+            ctx->n_window--;
+        }
+        ctx->window_sig[ctx->n_window] = sig;
+        ctx->window_act[ctx->n_window] = last_act;
+        ctx->window_flag[ctx->n_window] = ctx->redflag;
+        ctx->n_window++;
+    }
+
+    // Once the belief has concentrated only the top SPARSE_K states are tracked. If the scan surprises that set, it
+    // falls back to the dense grid and beliefs[] holds the prediction, ready for the dense sensing step below.
+    if (ctx->sparse_mode) {
+        if (sparse_update(ctx, last_act, lik)) return;
+        last_act = -1;
+    }
+
+    //acting - the motion model is precompiled by build_transition_tables() into one sparse table per action (and
+    //         per action when bouncing off the red border), so the prediction is a single pass over its entries
+    if (last_act >= 0 && last_act <= 3) {
+        // The two belief buffers swap roles instead of copying the grid: the previous posterior becomes
+        // last_beliefs[] and every entry of beliefs[] is overwritten by the prediction.
+        tmp = ctx->last_beliefs;
+        ctx->last_beliefs = ctx->beliefs;
+        ctx->beliefs = tmp;
+        T = &ctx->motion[ctx->redflag ? 1 : 0][last_act];
+        if (ctx->log_beliefs) {
+            ctx->belief_log_max = apply_transition_log(T, ctx->last_beliefs, ctx->beliefs);
+        } else {
+            C = apply_transition(T, ctx->last_beliefs, ctx->beliefs);
+        }
+    }
+    b = ctx->beliefs;
+    C0 = C;
+
+    if (ctx->log_beliefs) {
+        // In the log domain sensing is an add, and nothing needs normalizing until the values drift far enough from
+        // 0 to lose precision when exponentiated, or until probabilities are asked for (see normalize_beliefs()).
+        // The scan's evidence is the only reason to exponentiate here, taken relative to the largest prediction.
+        mx = ctx->belief_log_max;
+        if (mx == -INFINITY) mx = 0;
+        for (int s = 0; s < N_STATES(m); s++) P += exp(b[s] - mx);
+        if (exact) {
+            L = P;
+            for (int k = m->sig_start[sig]; k < m->sig_start[sig + 1]; k++) {
+                L += exp(b[m->sig_states[k]] - mx) * ((ctx->p.p_hit / ctx->p.p_miss) - 1.0);
+                b[m->sig_states[k]] += log(ctx->p.p_hit / ctx->p.p_miss);
+                if (b[m->sig_states[k]] > ctx->belief_log_max) ctx->belief_log_max = b[m->sig_states[k]];
+            }
+            L *= ctx->p.p_miss;
+        } else {
+            ctx->belief_log_max = -INFINITY;
+            for (int s = 0; s < N_STATES(m); s++) {
+                b[s] += log(lik[m->map_sig[s]]);
+                L += exp(b[s] - mx);
+                if (b[s] > ctx->belief_log_max) ctx->belief_log_max = b[s];
+            }
+        }
+        ctx->scan_evidence = (P > 0 && L > 0) ? log(L / P) : -INFINITY;
+        if (fabs(ctx->belief_log_max) > LOG_RENORM_RANGE) normalize_beliefs(ctx);
+        return;
+    }
+
+    // The prediction is left unnormalized. The mass of the matching states gives the normalizer up front, so sensing
+    // and normalization are one masked multiply over the whole grid, which also fills ctx->summary.
+    reset_stats(&ctx->summary);
+    if (exact) {
+        M = 0;
+        for (int k = m->sig_start[sig]; k < m->sig_start[sig + 1]; k++) M += b[m->sig_states[k]];
+        C = C + (M * ((ctx->p.p_hit / ctx->p.p_miss) - 1.0));
+        masked_scale(b, m->map_sig, (unsigned char) sig, (ctx->p.p_hit / ctx->p.p_miss) / C, 1.0 / C, N_STATES(m),
+                     &ctx->summary);
+        ctx->scan_evidence = log(ctx->p.p_miss * C / C0);
+    } else {
+        // Here the normalizer is only known after the multiply, so it takes a second pass
+        C = 0;
+        for (int s = 0; s < N_STATES(m); s++) C += (b[s] *= lik[m->map_sig[s]]);
+        ctx->scan_evidence = (C > 0) ? log(C / C0) : -INFINITY;
+        for (int s = 0; s < N_STATES(m); s++) {
+            b[s] /= C;
+            track_stats(&ctx->summary, b[s], s);
+            if (b[s] > 0) ctx->summary.entropy -= b[s] * log(b[s]);
+        }
+    }
+    // Only worth looking for a top-K set once the best state alone could make up its share of the mass
+    if (ctx->summary.max * SPARSE_K >= SPARSE_ENTER_MASS) enter_sparse_mode(ctx);
+}
+
+/*!
+ * Viterbi score of state s after the previous scan: v[] is indexed by state, or by entry of the previous slot if it
+ * was sparse (k_old states, listed in mark[] as entry + 1)
+ */
+static double viterbi_score(const double *v, const unsigned char *mark, int k_old, int s) {
+    if (k_old == 0) return (v[s]);
+    return (mark[s] ? v[mark[s] - 1] : -INFINITY);
+}
+
+/*!
+ * Adds the scan just filtered to the history ring: its action, bounce flag and likelihoods, the filtered beliefs (as
+ * linear probabilities, whatever mode the filter runs in), and one max-product step of the Viterbi recursion. The
+ * oldest scan is dropped once the ring is full, so each scan costs one pass over the transition table however long
+ * the run has been. In top-K mode the slot only keeps the active states, and the Viterbi step only scores them, so
+ * tracking stays O(SPARSE_K) per scan. States outside the set have no mass in the filter and score -inf.
+ */
+static void push_history(struct loc_context *ctx, int act, const double *lik) {
+    const struct loc_map *m = ctx->m;
+    const struct transition_table *T = NULL;
+    int n = N_STATES(m);
+    int slot = (ctx->hist_len == 0) ? 0 : (ctx->hist_head + 1) % HISTORY_LEN;
+    int k_new = ctx->sparse_mode ? ctx->n_active : n;
+    int k_old = (ctx->hist_len == 0) ? 0 : ctx->hist_sparse[ctx->hist_head];
+    const int *old = ctx->hist_states + ((size_t) ctx->hist_head * SPARSE_K);
+    int *states = ctx->hist_states + ((size_t) slot * SPARSE_K);
+    double *alpha = ctx->hist_filtered + ((size_t) slot * n);
+    int *back = ctx->viterbi_back + ((size_t) slot * n);
+    double *v = ctx->viterbi, *vt = ctx->viterbi_tmp;
+    unsigned char *mark = ctx->sparse_mark;
+    double mx = -INFINITY, C = 0, best, score;
+    int arg, s, src;
+
+    if (ctx->log_beliefs) {
+        for (s = 0; s < n; s++) if (ctx->beliefs[s] > mx) mx = ctx->beliefs[s];
+        for (s = 0; s < n; s++) C += (alpha[s] = exp(ctx->beliefs[s] - mx));
+        for (s = 0; s < n; s++) alpha[s] /= C;
+    } else if (ctx->sparse_mode) {
+        // Entry t of the slot is state states[t], for alpha[], back[] and the Viterbi scores alike
+        for (int t = 0; t < k_new; t++) {
+            states[t] = ctx->active_states[t];
+            alpha[t] = ctx->beliefs[states[t]];
+        }
+    } else {
+        memcpy(alpha, ctx->beliefs, n * sizeof(double));
+    }
+
+    if (ctx->hist_len == 0) {
+        // The path starts from the filtered beliefs, which already hold the prior and the first scan
+        for (int t = 0; t < k_new; t++) v[t] = log(alpha[t]);
+    } else {
+        if (act >= 0 && act <= 3) T = &ctx->motion[ctx->redflag ? 1 : 0][act];
+        // Scores of a sparse previous scan are looked up through sparse_mark[] (entry + 1, 0 if not in the set)
+        for (int t = 0; t < k_old; t++) mark[old[t]] = (unsigned char) (t + 1);
+        mx = -INFINITY;
+        for (int t = 0; t < k_new; t++) {
+            s = ctx->sparse_mode ? states[t] : t;
+            best = viterbi_score(v, mark, k_old, s);
+            arg = s;
+            if (T != NULL) {
+                best = -INFINITY;
+                for (int k = T->start[s]; k < T->start[s + 1]; k++) {
+                    src = T->src[k];
+                    score = viterbi_score(v, mark, k_old, src) + T->lw[k];
+                    if (score > best) {
+                        best = score;
+                        arg = src;
+                    }
+                }
+            }
+            vt[t] = best + log(lik[m->map_sig[s]]);
+            back[t] = arg;
+            if (vt[t] > mx) mx = vt[t];
+        }
+        for (int t = 0; t < k_old; t++) mark[old[t]] = 0;
+        for (int t = 0; t < k_new; t++) vt[t] -= mx;
+        ctx->viterbi = vt;
+        ctx->viterbi_tmp = v;
+    }
+
+    ctx->hist_act[slot] = act;
+    ctx->hist_flag[slot] = ctx->redflag;
+    ctx->hist_sparse[slot] = ctx->sparse_mode ? k_new : 0;
+    memcpy(ctx->hist_lik[slot], lik, sizeof(ctx->hist_lik[slot]));
+    ctx->hist_head = slot;
+    if (ctx->hist_len < HISTORY_LEN) ctx->hist_len++;
+}
+
+/*!
+ * One filter step for the move last_act and the scan intersection_reading (see filter_update()), also recorded in the
+ * history ring for smooth_beliefs() and viterbi_path(). Corners that did not read as a building colour (Black from a
+ * failed read, or -1 for a corner that was not scanned) are left out of the update, so there is no need to rescan.
+ */
+void update_beliefs(struct loc_context *ctx, int last_act, const int intersection_reading[4]) {
+    double lik[256];
+
+    scan_likelihoods(ctx, intersection_reading, lik);
+    filter_update(ctx, last_act, pack_signature(intersection_reading), lik);
+    push_history(ctx, last_act, lik);
+}
+
+/*!
+ * Sensing likelihood of every map signature for a reading of colour indices, under the context's sensing model
+ */
+void scan_likelihoods(const struct loc_context *ctx, const int reading[4], double lik[256]) {
+    const double *lo, *hi;
+    double corner_lik[4][3];
+
+    if (!ctx->p.use_confusion) {
+        reading_likelihoods(reading, corner_lik);
+        signature_likelihoods(&ctx->p, corner_lik, lik);
+        return;
+    }
+    // Every sensor colour is evidence under the confusion model, Black included
+    lo = ctx->pair_lik[(7 * reading_index(reading[0])) + reading_index(reading[1])];
+    hi = ctx->pair_lik[(7 * reading_index(reading[2])) + reading_index(reading[3])];
+    for (int g = 0; g < 256; g++) lik[g] = lo[g & 15] * hi[g >> 4];
+}
+
+/*!
+ * Same as update_beliefs() for a scan given as per-corner likelihoods: corner_lik[k][c] is the likelihood of what the
+ * colour sensor saw at corner k (clockwise from the top-left, as seen by the robot) if the building there has colour
+ * code c (see colour_code()). Only ratios within a corner matter, a corner with equal values is not observed.
+ */
+void update_beliefs_soft(struct loc_context *ctx, int last_act, const double corner_lik[4][3]) {
+    double lik[256];
+
+    signature_likelihoods(&ctx->p, corner_lik, lik);
+    filter_update(ctx, last_act, certain_signature(corner_lik), lik);
+    push_history(ctx, last_act, lik);
+}
+
+/*!
+ * Prints the whole belief grid to stdout. This is slow for anything but tiny maps, the telemetry file (see
+ * EV3_Telemetry.h) holds the same snapshots without stalling the control loop.
+ */
+void print_belief_grid(const struct loc_context *ctx) {
+    const struct loc_map *m = ctx->m;
+
+    for (int j = 0; j < m->sy; j++) {
+        for (int i = 0; i < m->sx; i++) {
+            printf("i is %i j is %i :\n",i , j );
+            printf("direction is 0 belief is %2f \n", ctx->beliefs[STATE(m, i + (j * m->sx), 0)]);
+            printf("direction is 1 belief is %2f \n", ctx->beliefs[STATE(m, i + (j * m->sx), 1)]);
+            printf("direction is 2 belief is %2f \n", ctx->beliefs[STATE(m, i + (j * m->sx), 2)]);
+            printf("direction is 3 belief is %2f \n", ctx->beliefs[STATE(m, i + (j * m->sx), 3)]);
+            printf("\n");
+        }
+    }
+}
+
+/*!
+ * Sets beliefs[] to a uniform distribution over all intersections and directions, and forgets the scan window,
+ * history and expected state
+ */
+void uniform_beliefs(struct loc_context *ctx) {
+    int n = N_STATES(ctx->m);
+    double p = ctx->log_beliefs ? -log((double) n) : 1.0 / (double) n;
+
+    for (int s = 0; s < n; s++) ctx->beliefs[s] = p;
+    ctx->belief_log_max = p;
+    ctx->sparse_mode = 0;
+    ctx->n_window = 0;
+    ctx->hist_len = 0;
+    ctx->expected_state = -1;
+    ctx->match_score = 1.0;
+    ctx->scan_evidence = 0;
+    reset_stats(&ctx->summary);
+    ctx->summary.max = ctx->summary.second = 1.0 / (double) n;
+    ctx->summary.best = 0;
+    ctx->summary.runner_up = 1;
+    ctx->summary.entropy = log((double) n);
+}
+
+/*!
+ * Renormalizes beliefs[] so it sums to 1 and refreshes ctx->summary. In log-belief mode the values stay in the log
+ * domain and the log-sum-exp of the grid is subtracted, after which exp(beliefs[s]) are probabilities.
+ */
+void normalize_beliefs(struct loc_context *ctx) {
+    struct belief_stats *st = &ctx->summary;
+    double *b = ctx->beliefs;
+    int n = N_STATES(ctx->m);
+    double m, C = 0, E = 0;
+
+    reset_stats(st);
+    if (ctx->log_beliefs) {
+        // Best and runner-up are found on the log values, the entropy comes out of the log-sum-exp pass:
+        // with Z = sum(exp(b - m)), H = log(Z) - sum((b - m) * exp(b - m)) / Z
+        st->max = st->second = -INFINITY;
+        for (int s = 0; s < n; s++) track_stats(st, b[s], s);
+        m = st->max;
+        if (m == -INFINITY) return;
+        for (int s = 0; s < n; s++) {
+            if (b[s] == -INFINITY) continue;
+            C += exp(b[s] - m);
+            E += (b[s] - m) * exp(b[s] - m);
+        }
+        st->entropy = log(C) - (E / C);
+        C = m + log(C);
+        for (int s = 0; s < n; s++) b[s] -= C;
+        ctx->belief_log_max = m - C;
+        st->max = exp(st->max - C);
+        st->second = exp(st->second - C);
+        return;
+    }
+    for (int s = 0; s < n; s++) C += b[s];
+    masked_scale(b, ctx->m->map_sig, 0, 1.0 / C, 1.0 / C, n, st);
+}
+
+/*!
+ * Fills top[] with the (up to) k candidate states holding the largest values, using a min-heap of size k.
+ * @return int, number of states written to top[]
+ */
+int select_top_k(const int *cand, int m, const double *val, int k, int *top) {
+    int n = 0, c, i, j;
+
+    for (int t = 0; t < m; t++) {
+        c = (cand != NULL) ? cand[t] : t;
+        if (n < k) {
+            // Sift up
+            i = n++;
+            while (i > 0 && val[top[(i - 1) / 2]] > val[c]) {
+                top[i] = top[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            top[i] = c;
+        } else if (val[c] > val[top[0]]) {
+            // Replace the smallest and sift down
+            i = 0;
+            while ((j = (2 * i) + 1) < n) {
+                if (j + 1 < n && val[top[j + 1]] < val[top[j]]) j++;
+                if (val[top[j]] >= val[c]) break;
+                top[i] = top[j];
+                i = j;
+            }
+            top[i] = c;
+        }
+    }
+    return (n);
+}
+
+/*!
+ * Switches to tracking only the top SPARSE_K states if they hold at least SPARSE_ENTER_MASS of the (normalized)
+ * belief. The rest of beliefs[] is zeroed, so the grid stays a valid, if sparse, distribution. A map with no more than
+ * SPARSE_K states stays on the dense grid, there is nothing to prune.
+ */
+void enter_sparse_mode(struct loc_context *ctx) {
+    double *b = ctx->beliefs;
+    double R = 0;
+    int n = N_STATES(ctx->m);
+    int s;
+
+    if (ctx->log_beliefs || ctx->sparse_mode || n <= SPARSE_K) return;
+    ctx->n_active = select_top_k(NULL, n, b, SPARSE_K, ctx->active_states);
+    for (int t = 0; t < ctx->n_active; t++) R += b[ctx->active_states[t]];
+    if (R < SPARSE_ENTER_MASS) return;
+
+    for (int t = 0; t < ctx->n_active; t++) ctx->sparse_acc[ctx->active_states[t]] = b[ctx->active_states[t]] / R;
+    memset(b, 0, n * sizeof(double));
+    reset_stats(&ctx->summary);
+    for (int t = 0; t < ctx->n_active; t++) {
+        s = ctx->active_states[t];
+        b[s] = ctx->sparse_acc[s];
+        ctx->sparse_acc[s] = 0;
+        track_stats(&ctx->summary, b[s], s);
+        ctx->summary.entropy -= b[s] * log(b[s]);
+    }
+    ctx->sparse_mode = 1;
+}
+
+/*!
+ * Drops back to the dense grid: beliefs[] becomes the sparse distribution mixed with a uniform floor, so states
+ * outside the top-K set can recover.
+ */
+void leave_sparse_mode(struct loc_context *ctx) {
+    int n = N_STATES(ctx->m);
+
+    for (int s = 0; s < n; s++) {
+        ctx->beliefs[s] = ((1.0 - SPARSE_FLOOR) * ctx->beliefs[s]) + (SPARSE_FLOOR / (double) n);
+    }
+    ctx->sparse_mode = 0;
+}
+
+/*!
+ * update_beliefs() in top-K mode, touching only the active states and their successors: the prediction scatters the
+ * active states through the by-source transition table into sparse_acc[], sensing compares one signature byte per
+ * touched state, and the top SPARSE_K of the result become the new active set. beliefs[] is kept up to date (zero
+ * outside the active set).
+ *
+ * If the scan is poorly explained by the active set (the average observation likelihood falls below
+ * SPARSE_EXIT_LIKELIHOOD), or truncating to the top SPARSE_K would drop more than 1 - SPARSE_KEEP_MASS of the mass,
+ * the set no longer describes the robot. beliefs[] is then left holding the normalized prediction, mixed with a
+ * uniform floor, for the dense sensing step.
+ *
+ * @return int, 1 if the update was completed in top-K mode, 0 if it fell back to the dense grid
+ */
+int sparse_update(struct loc_context *ctx, int last_act, const double *lik) {
+    const struct transition_table *T =
+            (last_act >= 0 && last_act <= 3) ? &ctx->motion[ctx->redflag ? 1 : 0][last_act] : NULL;
+    const unsigned char *map_sig = ctx->m->map_sig;
+    double *b = ctx->beliefs;
+    double *acc = ctx->sparse_acc;
+    unsigned char *mark = ctx->sparse_mark;
+    int *touched = ctx->touched_states;
+    int *active = ctx->active_states;
+    double P = 0, L = 0, R = 0, p;
+    int n_touched = 0, s, d;
+
+    // Prediction
+    for (int t = 0; t < ctx->n_active; t++) {
+        s = active[t];
+        if (T == NULL) {
+            if (!mark[s]) {
+                mark[s] = 1;
+                touched[n_touched++] = s;
+            }
+            acc[s] += b[s];
+        } else {
+            for (int k = T->out_start[s]; k < T->out_start[s + 1]; k++) {
+                d = T->out_dst[k];
+                if (!mark[d]) {
+                    mark[d] = 1;
+                    touched[n_touched++] = d;
+                }
+                acc[d] += T->out_w[k] * b[s];
+            }
+        }
+        b[s] = 0;
+    }
+
+    // Sensing
+    for (int t = 0; t < n_touched; t++) {
+        s = touched[t];
+        P += acc[s];
+        acc[s] *= lik[map_sig[s]];
+        L += acc[s];
+    }
+
+    ctx->n_active = select_top_k(touched, n_touched, acc, SPARSE_K, active);
+    for (int t = 0; t < ctx->n_active; t++) R += acc[active[t]];
+
+    if (L < SPARSE_EXIT_LIKELIHOOD * P || R < SPARSE_KEEP_MASS * L) {
+        // Undo the sensing, the dense step redoes it on the whole grid
+        for (int t = 0; t < n_touched; t++) {
+            s = touched[t];
+            b[s] = acc[s] / (lik[map_sig[s]] * P);
+            acc[s] = 0;
+            mark[s] = 0;
+        }
+        leave_sparse_mode(ctx);
+        return (0);
+    }
+
+    ctx->scan_evidence = log(L / P);
+    reset_stats(&ctx->summary);
+    for (int t = 0; t < ctx->n_active; t++) {
+        s = active[t];
+        p = acc[s] / R;
+        b[s] = p;
+        track_stats(&ctx->summary, p, s);
+        ctx->summary.entropy -= p * log(p);
+    }
+    for (int t = 0; t < n_touched; t++) {
+        acc[touched[t]] = 0;
+        mark[touched[t]] = 0;
+    }
+    return (1);
+}
+
+int robot_localization(struct loc_context *ctx) {
+    /*  This function implements the main robot localization process. You have to write all code that will control the robot
+     *  and get it to carry out the actions required to achieve localization.
+     *
+     *  Localization process:
+     *
+     *  - Find the street, and drive along the street toward an intersection
+     *  - Scan the colours of buildings around the intersection
+     *  - Update the beliefs in the beliefs[][] array according to the sensor measurements and the map data
+     *  - Repeat the process until a single intersection/facing direction is distintly more likely than all the rest
+     *
+     *  * We have provided headers for the following functions:
+     *
+     *  find_street()
+     *  drive_along_street()
+     *  scan_intersection()
+     *  turn_at_intersection()
+     *
+     *  You *do not* have to use them, and can write your own to organize your robot's work as you like, they are
+     *  provided as a suggestion.
+     *
+     *  Note that *your bot must explore* the map to achieve reliable localization, this means your intersection
+     *  scanning strategy should not rely exclusively on moving forward, but should include turning and exploring
+     *  other streets than the one your bot was initially placed on.
+     *
+     *  For each of the control functions, however, you will need to use the EV3 API, so be sure to become familiar with
+     *  it.
+     *
+     *  In terms of sensor management - the API allows you to read colours either as indexed values or rgb, it's up to
+     *  you which one to use, and how to interpret the noisy, unreliable data you're likely to get from the sensor
+     *  in order to update beliefs.
+     *
+     *  HOWEVER: *** YOU must document clearly both in comments within this function, and in your report, how the
+     *               sensor is used to read colour data, and how the beliefs are updated based on the sensor readings.
+     *
+     *  DO NOT FORGET - Beliefs should always remain normalized to be a probability distribution, that means the
+     *                  sum of beliefs over all intersections and facing directions must be 1 at all times.
+     *
+     *  The function receives as input pointers to three integer values, these will be used to store the estimated
+     *   robot's location and facing direction. The direction is specified as:
+     *   0 - UP
+     *   1 - RIGHT
+     *   2 - BOTTOM
+     *   3 - LEFT
+     *
+     *  The function's return value is 1 if localization was successful, and 0 otherwise.
+     */
+
+    /************************************************************************************************************************
+     *   TO DO  -   Complete this function
+     ***********************************************************************************************************************/
+
+    // Return an invalid location/direction and notify that localization was unsuccessful (you will delete this and replace it
+    // with your code).
+    // The pass that normalized beliefs[] also left its best and runner-up states in ctx->summary, so this needs no
+    // pass over the grid. In log-belief mode the grid is only renormalized on demand, which fills ctx->summary.
+    const struct loc_map *m = ctx->m;
+    const struct belief_stats *st = &ctx->summary;
+
+    if (ctx->log_beliefs) normalize_beliefs(ctx);
+
+    if (ctx->verbose) {
+        printf("Max is %2f runner-up is %2f entropy is %2f\n", st->max, st->second, st->entropy);
+    }
+    if (st->best < 0 || st->max < LOCALIZATION_RATIO * st->second) {
+        ctx->rbt_x = -1;
+        ctx->rbt_y = -1;
+        ctx->rbt_dir = -1;
+        return(-1);
+    }
+    ctx->rbt_x = (st->best % (m->sx * m->sy)) % m->sx;
+    ctx->rbt_y = (st->best % (m->sx * m->sy)) / m->sx;
+    ctx->rbt_dir = st->best / (m->sx * m->sy);
+    if (ctx->verbose) {
+        printf("Find the localization: i is %i j is %i direction is %i \n", ctx->rbt_x, ctx->rbt_y, ctx->rbt_dir);
+    }
+    return (0);
+}
+
+/*!
+ * Records where the robot should end up after taking action act from its current fix (the exact move from the
+ * filter's best state), for check_expected() to compare the next scan against. Clears the expectation if the robot is
+ * not localized.
+ */
+void expect_move(struct loc_context *ctx, int act) {
+    int bounced;
+
+    if (ctx->rbt_x < 0 || ctx->summary.best < 0 || act < 0 || act > 3) {
+        ctx->expected_state = -1;
+        return;
+    }
+    ctx->expected_state = exact_move(ctx->m, ctx->summary.best, act, &bounced);
+}
+
+/*!
+ * Consistency monitor for a robot that thinks it knows where it is: compares the 4 corners read with the building
+ * colours of the expected intersection (see expect_move()) and updates the running match score. A single misread
+ * corner barely moves the score; a different intersection usually gets most corners wrong. Corners that are not a
+ * building colour were not read and do not count either way.
+ * @return int, 1 if the robot looks lost (too many corners wrong, or the score fell below MATCH_LOST), 0 otherwise
+ */
+int check_expected(struct loc_context *ctx, const int reading[4]) {
+    const struct loc_map *m = ctx->m;
+    int cells = m->sx * m->sy;
+    int s = ctx->expected_state, matched = 0, seen = 0;
+
+    if (s < 0) return (0);
+    ctx->expected_state = -1;
+    for (int k = 0; k < 4; k++) {
+        if (colour_code(reading[k]) == 3) continue;
+        seen++;
+        matched += (reading[k] == m->map[s % cells][(k + s / cells) % 4]);
+    }
+    if (seen == 0) return (0);
+    ctx->match_score = (MATCH_DECAY * ctx->match_score) + ((1.0 - MATCH_DECAY) * matched / (double) seen);
+    if (seen - matched >= MATCH_MAX_WRONG || ctx->match_score < MATCH_LOST) {
+        if (ctx->verbose) printf("Scan matches %d corners of the expected intersection, the robot is lost\n", matched);
+        ctx->match_score = 1.0;
+        return (1);
+    }
+    return (0);
+}
+
+/*!
+ * Partial belief reset after check_expected() found the robot lost: keeps RESET_KEEP of the current beliefs (in case
+ * the scan was misread), spreads RESET_FLOOR uniformly, and puts the rest on the states whose map signature matches
+ * the scan (from the map's signature index), so the filter restarts from a handful of candidates rather than from
+ * uniform beliefs.
+ */
+void partial_reset(struct loc_context *ctx, const int reading[4]) {
+    const struct loc_map *m = ctx->m;
+    double *b = ctx->beliefs;
+    int n = N_STATES(m);
+    int sig = pack_signature(reading);
+    int k = (sig >= 0) ? m->sig_start[sig + 1] - m->sig_start[sig] : 0;
+    double seed = (k > 0) ? 1.0 - RESET_KEEP - RESET_FLOOR : 0.0;
+    double mx = -INFINITY, C = 0;
+
+    // Current beliefs as normalized probabilities
+    if (ctx->log_beliefs) {
+        for (int s = 0; s < n; s++) if (b[s] > mx) mx = b[s];
+        for (int s = 0; s < n; s++) C += (b[s] = exp(b[s] - mx));
+    } else {
+        for (int s = 0; s < n; s++) C += b[s];
+    }
+    for (int s = 0; s < n; s++) b[s] = ((1.0 - seed - RESET_FLOOR) * b[s] / C) + (RESET_FLOOR / (double) n);
+    for (int j = 0; j < k; j++) b[m->sig_states[m->sig_start[sig] + j]] += seed / (double) k;
+    if (ctx->log_beliefs) {
+        for (int s = 0; s < n; s++) b[s] = log(b[s]);
+    }
+    ctx->sparse_mode = 0;
+    ctx->hist_len = 0;
+    ctx->expected_state = -1;
+    normalize_beliefs(ctx);
+}
+
+/*!
+ * Fixed-lag smoothing: the beliefs lag scans ago, given every scan since. The filtered beliefs of that scan come from
+ * the history ring and are multiplied by the backward message of the lag newer scans, which runs backwards through
+ * the by-source transition tables (rescaled at every step so it cannot underflow). Costs lag passes over the tables.
+ * @param out N_STATES() values, normalized and linear
+ * @return int, 1 success 0 fail (lag not in 0..hist_len-1)
+ */
+int smooth_beliefs(struct loc_context *ctx, int lag, double *out) {
+    const struct loc_map *m = ctx->m;
+    const struct transition_table *T;
+    int n = N_STATES(m);
+    double *beta = ctx->history_tmp, *tmp = ctx->history_tmp + n;
+    const double *alpha;
+    double mx, C = 0;
+    int slot = ctx->hist_head;
+
+    if (lag < 0 || lag >= ctx->hist_len) return (0);
+    for (int s = 0; s < n; s++) beta[s] = 1.0;
+    for (int k = 0; k < lag; k++) {
+        for (int s = 0; s < n; s++) tmp[s] = ctx->hist_lik[slot][m->map_sig[s]] * beta[s];
+        if (ctx->hist_act[slot] >= 0 && ctx->hist_act[slot] <= 3) {
+            T = &ctx->motion[ctx->hist_flag[slot] ? 1 : 0][ctx->hist_act[slot]];
+            for (int s = 0; s < n; s++) {
+                beta[s] = 0;
+                for (int j = T->out_start[s]; j < T->out_start[s + 1]; j++) beta[s] += T->out_w[j] * tmp[T->out_dst[j]];
+            }
+        } else {
+            memcpy(beta, tmp, n * sizeof(double));
+        }
+        mx = 0;
+        for (int s = 0; s < n; s++) if (beta[s] > mx) mx = beta[s];
+        if (mx > 0) for (int s = 0; s < n; s++) beta[s] /= mx;
+        slot = (slot + HISTORY_LEN - 1) % HISTORY_LEN;
+    }
+
+    alpha = ctx->hist_filtered + ((size_t) slot * n);
+    if (ctx->hist_sparse[slot]) {
+        memset(out, 0, n * sizeof(double));
+        for (int t = 0; t < ctx->hist_sparse[slot]; t++) {
+            int s = ctx->hist_states[((size_t) slot * SPARSE_K) + t];
+            C += (out[s] = alpha[t] * beta[s]);
+        }
+    } else {
+        for (int s = 0; s < n; s++) C += (out[s] = alpha[s] * beta[s]);
+    }
+    if (C <= 0) return (0);
+    for (int s = 0; s < n; s++) out[s] /= C;
+    return (1);
+}
+
+/*!
+ * The most likely sequence of states over the scans in the history ring (the Viterbi path), oldest first. The
+ * Viterbi scores cover the whole run, only the back-pointers are limited to the last HISTORY_LEN scans.
+ * @param path HISTORY_LEN values
+ * @return int, number of states written to path[] (hist_len)
+ */
+int viterbi_path(const struct loc_context *ctx, int *path) {
+    int n = N_STATES(ctx->m);
+    int slot = ctx->hist_head, t = 0, s, k_slot;
+    const int *states;
+
+    if (ctx->hist_len == 0) return (0);
+    k_slot = ctx->hist_sparse[slot] ? ctx->hist_sparse[slot] : n;
+    for (int k = 1; k < k_slot; k++) if (ctx->viterbi[k] > ctx->viterbi[t]) t = k;
+    // t is the entry in the slot, which is the state itself unless the slot only kept the top-K set
+    for (int k = ctx->hist_len - 1; k >= 0; k--) {
+        states = ctx->hist_states + ((size_t) slot * SPARSE_K);
+        path[k] = ctx->hist_sparse[slot] ? states[t] : t;
+        if (k == 0) break;
+        s = ctx->viterbi_back[((size_t) slot * n) + t];
+        slot = (slot + HISTORY_LEN - 1) % HISTORY_LEN;
+        t = s;
+        if (ctx->hist_sparse[slot]) {
+            states = ctx->hist_states + ((size_t) slot * SPARSE_K);
+            for (t = 0; t < ctx->hist_sparse[slot] && states[t] != s; t++);
+            if (t == ctx->hist_sparse[slot]) return (0);     // No surviving path, every score was -inf
+        }
+    }
+    return (ctx->hist_len);
+}
+
+/*!
+ * Expected information gain of taking action act and scanning the next intersection, for the (normalized,
+ * linear) beliefs b: the entropy of the prediction minus the expected entropy of the posterior.
+ *
+ * The prediction combines the normal and the bounce tables, pred = T[0][act] b + T[1][act] b - stay b. Both tables hold
+ * a stay term for every state, but a state only moves through one of them (the bounce table if its street runs into the
+ * red border), so stay is the weight of the other table. The gain is taken for a reading that matches the map, so
+ * signature z turns up with probability m[z], the predicted mass of the states showing z, and the expected posterior
+ * entropy is H(pred) - H(m). The gain is then just the entropy of the predicted signature: how well the scan separates
+ * the hypotheses. Scoring with the p_hit / p_miss model instead counts every rescan of the same intersection as fresh
+ * evidence, and the planner ends up bouncing off the border scanning the same buildings over and over.
+ *
+ * @param pred, tmp scratch buffers of N_STATES() values
+ * @return double, expected information gain in nats
+ */
+double expected_gain(const struct loc_context *ctx, const double *b, int act, double *pred, double *tmp) {
+    const struct loc_map *m = ctx->m;
+    double mz[256];
+    double M = 0, H = 0;
+    int n = N_STATES(m);
+    int cells = m->sx * m->sy;
+    double stay[2] = {action_weights(&ctx->p, 0, act).stay, action_weights(&ctx->p, 1, act).stay};
+    int bounces;
+
+    apply_transition(&ctx->motion[0][act], b, pred);
+    apply_transition(&ctx->motion[1][act], b, tmp);
+    memset(mz, 0, sizeof(mz));
+    for (int s = 0; s < n; s++) {
+        bounces = (m->street[s % cells][((s / cells) + act) % 4] == STREET_BORDER);
+        pred[s] += tmp[s] - (stay[bounces ? 0 : 1] * b[s]);
+        if (pred[s] <= 0) continue;
+        mz[m->map_sig[s]] += pred[s];
+        M += pred[s];
+    }
+    if (M <= 0) return (0);
+
+    for (int z = 0; z < 256; z++) {
+        if (mz[z] > 0) H -= (mz[z] / M) * log(mz[z] / M);
+    }
+    return (H);
+}
+
+// Shared by the exploration planner workers, one candidate action per task
+struct plan_job {
+    const struct loc_context *ctx;
+    const double *b;            // Current beliefs, normalized and linear
+    double *scratch;            // 2 * N_STATES() values per candidate
+    double h[4];                // Expected information gain of each action
+};
+
+static void plan_task(int act, int worker, void *arg) {
+    struct plan_job *job = (struct plan_job *) arg;
+    double *pred = job->scratch + (2 * act * N_STATES(job->ctx->m));
+
+    (void) worker;
+    job->h[act] = expected_gain(job->ctx, job->b, act, pred, pred + N_STATES(job->ctx->m));
+}
+
+/*!
+ * Picks the action to take while the robot is not localized: the one whose next scan is expected to cut the
+ * entropy of the beliefs the most (see expected_gain()). The four candidates are evaluated in parallel.
+ * Ties go to straight, then right, left, and last the U-turn, which costs the most driving.
+ * @return int, action 0 straight, 1 right, 2 back, 3 left (0 if the planner could not run)
+ */
+int plan_exploration(struct loc_context *ctx) {
+    const int order[4] = {0, 1, 3, 2};
+    struct plan_job job;
+    int n = N_STATES(ctx->m);
+    int best = 0;
+
+    // The scratch buffers are allocated on the first call and kept, the planner runs after every scan
+    if (ctx->plan_scratch == NULL) ctx->plan_scratch = (double *) malloc(9 * (size_t) n * sizeof(double));
+    if (ctx->plan_scratch == NULL) return (0);
+    job.ctx = ctx;
+    job.scratch = ctx->plan_scratch;
+    job.b = ctx->beliefs;
+    if (ctx->log_beliefs) {
+        normalize_beliefs(ctx);
+        job.b = ctx->plan_scratch + (8 * (size_t) n);
+        for (int s = 0; s < n; s++) ctx->plan_scratch[(8 * (size_t) n) + s] = exp(ctx->beliefs[s]);
+    }
+
+    parallel_for(4, 4, plan_task, &job);
+    for (int k = 1; k < 4; k++) {
+        if (job.h[order[k]] > job.h[best] + 1e-9) best = order[k];
+    }
+    if (ctx->verbose) {
+        printf("Expected gain: straight %f right %f back %f left %f, exploring with action %d\n", job.h[0],
+               job.h[1], job.h[2], job.h[3], best);
+    }
+    return (best);
+}
+
+/*!
+ * Reseeds the beliefs from the last RELOC_WINDOW scans: the states that can end that scan sequence on the map (looked
+ * up in the map's sequence index) share 1 - RELOC_FLOOR of the mass, and the rest is spread uniformly so a misread
+ * scan can still be recovered from. After the robot gets lost this replaces the slow re-convergence from uniform
+ * beliefs.
+ * @return int, number of candidate states, 0 if the window is not full yet or matches nothing (beliefs unchanged)
+ */
+int relocalize(struct loc_context *ctx) {
+    const int *cand;
+    int n = N_STATES(ctx->m), k;
+
+    if (ctx->n_window < RELOC_WINDOW) return (0);
+    k = lookup_sequence(ctx->m, sequence_key(RELOC_WINDOW, ctx->window_sig, ctx->window_act, ctx->window_flag),
+                        &cand);
+    if (k == 0) return (0);
+
+    for (int s = 0; s < n; s++) ctx->beliefs[s] = RELOC_FLOOR / (double) n;
+    for (int c = 0; c < k; c++) ctx->beliefs[cand[c]] += (1.0 - RELOC_FLOOR) / (double) k;
+    if (ctx->log_beliefs) {
+        for (int s = 0; s < n; s++) ctx->beliefs[s] = log(ctx->beliefs[s]);
+    }
+    ctx->sparse_mode = 0;
+    ctx->hist_len = 0;          // The history explains the old beliefs, not the reseeded ones
+    normalize_beliefs(ctx);
+    return (k);
+}
+
+/*!
+ * Loads the analysis EV3_Ambiguity wrote for map m. Lines are 'x y dir scans class', '#' starts a comment.
+ * @return int, 1 success 0 fail (missing file, or computed for a map of another size)
+ */
+int load_ambiguity(const char *filename, const struct loc_map *m, struct loc_ambiguity *amb) {
+    char line[1024];
+    int sx = -1, sy = -1, x, y, dir, scans, cls, s, got = 0;
+    unsigned char *seen;
+    FILE *f;
+
+    memset(amb, 0, sizeof(*amb));
+    f = fopen(filename, "r");
+    if (f == NULL) return (0);
+    amb->n = N_STATES(m);
+    amb->scans = (int *) calloc(amb->n, sizeof(int));
+    amb->cls = (int *) calloc(amb->n, sizeof(int));
+    amb->cls_size = (int *) calloc(amb->n, sizeof(int));
+    seen = (unsigned char *) calloc(amb->n, sizeof(unsigned char));
+    if (amb->scans == NULL || amb->cls == NULL || amb->cls_size == NULL || seen == NULL) got = -1;
+
+    while (got >= 0 && fgets(line, sizeof(line), f) != NULL) {
+        if (line[strspn(line, " \t\r\n")] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+        if (sx < 0) {
+            if (sscanf(line, "%d %d", &sx, &sy) != 2 || sx != m->sx || sy != m->sy) got = -1;
+            continue;
+        }
+        if (sscanf(line, "%d %d %d %d %d", &x, &y, &dir, &scans, &cls) != 5 || x < 0 || x >= sx || y < 0 ||
+            y >= sy || dir < 0 || dir > 3 || cls < 0 || cls >= amb->n) {
+            got = -1;
+            continue;
+        }
+        s = STATE(m, x + (y * sx), dir);
+        // A state listed twice would hide a missing one from the count below
+        if (seen[s]) {
+            got = -1;
+            continue;
+        }
+        seen[s] = 1;
+        amb->scans[s] = scans;
+        amb->cls[s] = cls;
+        amb->cls_size[cls]++;
+        if (scans > amb->worst) amb->worst = scans;
+        if (scans == -1) amb->never++;
+        got++;
+    }
+    fclose(f);
+    free(seen);
+    if (got != amb->n) {
+        free_ambiguity(amb);
+        return (0);
+    }
+    return (1);
+}
+
+void free_ambiguity(struct loc_ambiguity *amb) {
+    free(amb->scans);
+    free(amb->cls);
+    free(amb->cls_size);
+    memset(amb, 0, sizeof(*amb));
+}
+
+/*!
+ * Checks whether more scans can still help: the beliefs have settled on a class of states the map cannot tell apart
+ * (they hold at least AMBIGUITY_STALL_MASS between them), so robot_localization() will never single one out. Call
+ * after robot_localization(), which leaves the beliefs normalized.
+ * @return int, 1 if exploring further is pointless, 0 otherwise (or if no analysis is loaded)
+ */
+int ambiguity_stalled(const struct loc_context *ctx, const struct loc_ambiguity *amb) {
+    int best = ctx->summary.best;
+    double mass = 0;
+
+    if (amb->n != N_STATES(ctx->m) || best < 0 || amb->cls_size[amb->cls[best]] < 2) return (0);
+    for (int s = 0; s < amb->n; s++) {
+        if (amb->cls[s] != amb->cls[best]) continue;
+        mass += ctx->log_beliefs ? exp(ctx->beliefs[s]) : ctx->beliefs[s];
+    }
+    return (mass >= AMBIGUITY_STALL_MASS);
+}
+
+static int is_yellow(const unsigned char *px) {
+    return (px[0] == 255 && px[1] == 255 && px[2] == 0);
+}
+
+// An intersection found in a map image: a connected group of yellow pixels
+struct yellow_component {
+    long long area;         // Pixels in the component
+    double cx, cy;          // Centroid
+    int x0, y0, x1, y1;     // Bounding box, inclusive
+};
+
+// A horizontal run of intersection pixels, the unit of the connected-component labelling in label_intersections()
+struct yellow_run {
+    int y;                  // Row,
+    int x0, x1;             //  first and last pixel
+    int parent;             // Union-find link to another run of the same component, the run itself at the root
+};
+
+// One horizontal tile of the image, labelled by label_task()
+struct label_tile {
+    int y0, y1;                 // Rows y0..y1-1
+    struct yellow_run *runs;    // Runs found in the tile in raster order, parent links local to the tile
+    int n_runs, cap;
+    int ok;                     // 0 if the tile ran out of memory
+};
+
+// Shared by the labelling workers, one tile per task
+struct label_job {
+    const unsigned char *img;
+    int rx;
+    struct label_tile *tiles;
+};
+
+/*!
+ * Finds the root of run r's component, halving the path on the way
+ */
+static int find_run(struct yellow_run *runs, int r) {
+    while (runs[r].parent != r) {
+        runs[r].parent = runs[runs[r].parent].parent;
+        r = runs[r].parent;
+    }
+    return (r);
+}
+
+/*!
+ * Joins the components of runs a and b. The root with the lower index wins, so every component ends up rooted at its
+ * first run in raster order whatever order the joins come in.
+ */
+static void join_runs(struct yellow_run *runs, int a, int b) {
+    a = find_run(runs, a);
+    b = find_run(runs, b);
+    if (a < b) runs[b].parent = a;
+    else if (b < a) runs[a].parent = b;
+}
+
+/*!
+ * Joins every run in runs[cur..end-1] (one row) with the runs in runs[prev..cur-1] (the row above) it touches,
+ * diagonals included. Both rows are sorted by x, so one sweep does it.
+ */
+static void join_rows(struct yellow_run *runs, int prev, int cur, int end) {
+    int p = prev;
+
+    for (int r = cur; r < end; r++) {
+        while (p < cur && runs[p].x1 + 1 < runs[r].x0) p++;
+        for (int q = p; q < cur && runs[q].x0 <= runs[r].x1 + 1; q++) join_runs(runs, q, r);
+    }
+}
+
+/*!
+ * Labels the intersection pixels of one tile: finds the runs of each row with the yellow search kernel, and joins each
+ * row's runs to the row above
+ */
+static void label_task(int t, int worker, void *arg) {
+    struct label_job *job = (struct label_job *) arg;
+    struct label_tile *tile = &job->tiles[t];
+    struct yellow_run *grown;
+    const unsigned char *row;
+    int prev = 0, cur, x;
+    long k;
+
+    (void) worker;
+    tile->ok = 1;
+    for (int y = tile->y0; y < tile->y1; y++) {
+        row = job->img + ((size_t) y * job->rx * 3);
+        cur = tile->n_runs;
+        for (x = 0; x < job->rx && (k = find_rgb(row + (3 * x), job->rx - x, 255, 255, 0)) >= 0; x++) {
+            if (tile->n_runs == tile->cap) {
+                tile->cap = (tile->cap == 0) ? 256 : tile->cap * 2;
+                grown = (struct yellow_run *) realloc(tile->runs, tile->cap * sizeof(struct yellow_run));
+                if (grown == NULL) {
+                    tile->ok = 0;
+                    return;
+                }
+                tile->runs = grown;
+            }
+            x += (int) k;
+            tile->runs[tile->n_runs].y = y;
+            tile->runs[tile->n_runs].x0 = x;
+            while (x + 1 < job->rx && is_yellow(row + (3 * (x + 1)))) x++;
+            tile->runs[tile->n_runs].x1 = x;
+            tile->runs[tile->n_runs].parent = tile->n_runs;
+            tile->n_runs++;
+        }
+        join_rows(tile->runs, prev, cur, tile->n_runs);
+        prev = cur;
+    }
+}
+
+/*!
+ * Finds the intersections of a map image: the connected components of its yellow pixels. The image is cut into
+ * horizontal tiles that are labelled in parallel (see label_task()), then the components that cross the seam between
+ * two tiles are joined, which only needs the last row of one tile and the first of the next. Components smaller than
+ * COMPONENT_MIN_SHARE of the largest are taken for stray marks and dropped.
+ * @param out set to the components found, in raster order of their first pixel (free() it)
+ * @return int, number of components, -1 if out of memory
+ */
+static int label_intersections(const unsigned char *img, int rx, int ry, struct yellow_component **out) {
+    struct label_job job;
+    struct label_tile *tiles;
+    struct yellow_run *runs = NULL;
+    struct yellow_component *comp = NULL, *c;
+    int n_tiles = default_workers() * LABEL_TILES_PER_WORKER;
+    int n_runs = 0, n_comp = 0, ok = 1, prev, cur, end, r, len;
+    int *comp_of = NULL;
+    long long largest = 0;
+
+    if (n_tiles > ry) n_tiles = ry;
+    tiles = (struct label_tile *) calloc(n_tiles, sizeof(struct label_tile));
+    if (tiles == NULL) return (-1);
+    for (int t = 0; t < n_tiles; t++) {
+        tiles[t].y0 = (int) (((long) ry * t) / n_tiles);
+        tiles[t].y1 = (int) (((long) ry * (t + 1)) / n_tiles);
+    }
+    job.img = img;
+    job.rx = rx;
+    job.tiles = tiles;
+    parallel_for(n_tiles, default_workers(), label_task, &job);
+
+    // Gather the runs of all tiles, moving their links to global indices, and join across the seams
+    for (int t = 0; t < n_tiles; t++) {
+        ok = ok && tiles[t].ok;
+        n_runs += tiles[t].n_runs;
+    }
+    if (ok && n_runs > 0) {
+        runs = (struct yellow_run *) malloc(n_runs * sizeof(struct yellow_run));
+        comp_of = (int *) malloc(n_runs * sizeof(int));
+        comp = (struct yellow_component *) calloc(n_runs, sizeof(struct yellow_component));
+        ok = (runs != NULL && comp_of != NULL && comp != NULL);
+    }
+    if (ok && n_runs > 0) {
+        n_runs = 0;
+        for (int t = 0; t < n_tiles; t++) {
+            for (int k = 0; k < tiles[t].n_runs; k++) {
+                runs[n_runs + k] = tiles[t].runs[k];
+                runs[n_runs + k].parent += n_runs;
+            }
+            // The last row of the tile above is the suffix of its runs with y == y0 - 1
+            for (prev = n_runs; prev > 0 && runs[prev - 1].y == tiles[t].y0 - 1; prev--);
+            for (end = n_runs; end < n_runs + tiles[t].n_runs && runs[end].y == tiles[t].y0; end++);
+            join_rows(runs, prev, n_runs, end);
+            n_runs += tiles[t].n_runs;
+        }
+
+        // Area, centroid and bounding box of every component. The sums are exact integers, so the result does not
+        // depend on the number of tiles.
+        for (r = 0; r < n_runs; r++) {
+            cur = find_run(runs, r);
+            if (cur == r) comp_of[r] = n_comp++;
+            c = &comp[comp_of[cur]];
+            len = runs[r].x1 - runs[r].x0 + 1;
+            if (c->area == 0) {
+                c->x0 = runs[r].x0;
+                c->x1 = runs[r].x1;
+                c->y0 = runs[r].y;
+            }
+            c->area += len;
+            c->cx += (double) (runs[r].x0 + runs[r].x1) * len / 2;
+            c->cy += (double) runs[r].y * len;
+            if (runs[r].x0 < c->x0) c->x0 = runs[r].x0;
+            if (runs[r].x1 > c->x1) c->x1 = runs[r].x1;
+            c->y1 = runs[r].y;
+            if (c->area > largest) largest = c->area;
+        }
+        end = 0;
+        for (int k = 0; k < n_comp; k++) {
+            if (comp[k].area < COMPONENT_MIN_SHARE * largest) continue;
+            comp[end] = comp[k];
+            comp[end].cx /= comp[end].area;
+            comp[end].cy /= comp[end].area;
+            end++;
+        }
+        n_comp = end;
+    }
+
+    for (int t = 0; t < n_tiles; t++) free(tiles[t].runs);
+    free(tiles);
+    free(runs);
+    free(comp_of);
+    if (!ok) {
+        free(comp);
+        return (-1);
+    }
+    *out = comp;
+    return (n_comp);
+}
+
+// A component's centre along one axis, sorted by group_lines()
+struct line_key {
+    double pos;
+    int comp;
+};
+
+static int compare_line_keys(const void *a, const void *b) {
+    double x = ((const struct line_key *) a)->pos;
+    double y = ((const struct line_key *) b)->pos;
+    return ((x > y) - (x < y));
+}
+
+/*!
+ * Groups n components into lines (columns, or rows) by their centres along one axis: sorted, a gap wider than gap
+ * between two consecutive centres starts a new line
+ * @param line set to the line of each component, counted from the left (or top)
+ * @param spacing set to the average distance between neighbouring lines, 0 if there is only one
+ * @return int, number of lines
+ */
+static int group_lines(struct line_key *keys, int n, double gap, int *line, int *spacing) {
+    int lines = 1;
+
+    qsort(keys, n, sizeof(struct line_key), compare_line_keys);
+    for (int k = 0; k < n; k++) {
+        if (k > 0 && keys[k].pos - keys[k - 1].pos > gap) lines++;
+        line[keys[k].comp] = lines - 1;
+    }
+    *spacing = (lines > 1) ? (int) lround((keys[n - 1].pos - keys[0].pos) / (lines - 1)) : 0;
+    return (lines);
+}
+
+/*!
+ * Lays the intersections found by label_intersections() out on a grid. Their centres are grouped into columns and
+ * rows, so the spacing may be uneven and a hand-drawn intersection may sit off its line by up to half the size of an
+ * intersection. Every column must cross every row at exactly one intersection.
+ * @return int *, the component at each grid cell (sx * sy, raster order, free() it), NULL if the intersections do not
+ *         make a grid or out of memory
+ */
+static int *grid_cells(const struct yellow_component *comp, int n, int *sx, int *sy, int *dx, int *dy) {
+    struct line_key *keys;
+    int *col, *row, *cells = NULL;
+    double wx = 0, wy = 0;
+
+    keys = (struct line_key *) malloc(n * sizeof(struct line_key));
+    col = (int *) malloc(n * sizeof(int));
+    row = (int *) malloc(n * sizeof(int));
+    if (keys != NULL && col != NULL && row != NULL) {
+        for (int k = 0; k < n; k++) {
+            wx += comp[k].x1 - comp[k].x0 + 1;
+            wy += comp[k].y1 - comp[k].y0 + 1;
+        }
+        for (int k = 0; k < n; k++) {
+            keys[k].pos = comp[k].cx;
+            keys[k].comp = k;
+        }
+        *sx = group_lines(keys, n, wx / (2 * n), col, dx);
+        for (int k = 0; k < n; k++) {
+            keys[k].pos = comp[k].cy;
+            keys[k].comp = k;
+        }
+        *sy = group_lines(keys, n, wy / (2 * n), row, dy);
+        cells = (int *) malloc(*sx * *sy * sizeof(int));
+    }
+    if (cells == NULL) {
+        fprintf(stderr, "Out of memory laying out %d intersections\n", n);
+    } else {
+        for (int k = 0; k < *sx * *sy; k++) cells[k] = -1;
+        for (int k = 0; k < n && cells != NULL; k++) {
+            if (cells[col[k] + (row[k] * *sx)] >= 0) {
+                fprintf(stderr, "Two intersections at %d,%d (near pixel %.0f, %.0f)\n", col[k], row[k], comp[k].cx,
+                        comp[k].cy);
+                free(cells);
+                cells = NULL;
+            } else {
+                cells[col[k] + (row[k] * *sx)] = k;
+            }
+        }
+        for (int k = 0; k < *sx * *sy && cells != NULL; k++) {
+            if (cells[k] < 0) {
+                fprintf(stderr, "No intersection at %d,%d where its column and row cross\n", k % *sx, k / *sx);
+                free(cells);
+                cells = NULL;
+            }
+        }
+    }
+    free(keys);
+    free(col);
+    free(row);
+    return (cells);
+}
+
+/*!
+ * Colour code (2 Blue, 3 Green, 6 White) of the building at pixel (x, y), 0 if it is not a building colour or the
+ * pixel is outside the image
+ */
+static int building_colour(const unsigned char *img, int rx, int ry, int x, int y) {
+    const unsigned char *px;
+
+    if (x < 0 || x >= rx || y < 0 || y >= ry) return (0);
+    px = img + (((size_t) y * rx + x) * 3);
+    if (px[0] == 0 && px[1] == 255 && px[2] == 0) return (3);
+    if (px[0] == 0 && px[1] == 0 && px[2] == 255) return (2);
+    if (px[0] == 255 && px[1] == 255 && px[2] == 255) return (6);
+    return (0);
+}
+
+/*!
+ * Whether the pixels on the line from (x0, y0) to (x1, y1) are a street: more than half of them dark. Anti-aliased
+ * edges and the odd stray pixel do not break a street, a white gap (or a building) across it does.
+ */
+static int is_street(const unsigned char *img, int rx, int x0, int y0, int x1, int y1) {
+    const unsigned char *px;
+    int len = (abs(x1 - x0) > abs(y1 - y0)) ? abs(x1 - x0) : abs(y1 - y0);
+    int dark = 0, x, y;
+
+    for (int k = 0; k <= len; k++) {
+        x = (len == 0) ? x0 : x0 + (int) lround((double) (x1 - x0) * k / len);
+        y = (len == 0) ? y0 : y0 + (int) lround((double) (y1 - y0) * k / len);
+        px = img + (((size_t) y * rx + x) * 3);
+        if (px[0] < 128 && px[1] < 128 && px[2] < 128) dark++;
+    }
+    return (2 * dark > len + 1);
+}
+
+int parse_map(struct loc_map *m, const unsigned char *map_img, int rx, int ry) {
+    /*
+      This function takes an input image map array, and two integers that specify the image size.
+      It attempts to parse this image into a representation of the map in the image. The size
+      and resolution of the map image should not affect the parsing (i.e. you can make your own
+      maps without worrying about the exact position of intersections, roads, buildings, etc.).
+
+      However, this function requires:
+
+      * White background for the image  [255 255 255]
+      * Red borders around the map  [255 0 0]
+      * Black roads  [0 0 0]
+      * Yellow intersections  [255 255 0]
+      * Buildings that are pure green [0 255 0], pure blue [0 0 255], or white [255 255 255]
+      (any other colour values are ignored - so you can add markings if you like, those
+       will not affect parsing)
+
+      The image must be a properly formated .ppm image, see load_ppm below for details of
+      the format. The GIMP image editor saves properly formatted .ppm images, as does the
+      imagemagick image processing suite.
+
+      The map representation is read into the map array, with each row in the array corrsponding
+      to one intersection, in raster order, that is, for a map with k intersections along its width:
+
+       (row index for the intersection)
+
+       0     1     2    3 ......   k-1
+
+       k    k+1   k+2  ........
+
+       Each row will then contain the colour values for buildings around the intersection
+       clockwise from top-left, that is
+
+
+       top-left               top-right
+
+               intersection
+
+       bottom-left           bottom-right
+
+       So, for the first intersection (at row 0 in the map array)
+       map[0][0] <---- colour for the top-left building
+       map[0][1] <---- colour for the top-right building
+       map[0][2] <---- colour for the bottom-right building
+       map[0][3] <---- colour for the bottom-left building
+
+       Color values for map locations are defined as follows (this agrees with what the
+       EV3 sensor returns in indexed-colour-reading mode):
+
+       1 -  Black
+       2 -  Blue
+       3 -  Green
+       4 -  Yellow
+       5 -  Red
+       6 -  White
+
+       If you find a 0, that means you're trying to access an intersection that is not on the
+       map! Also note that in practice, because of how the map is defined, you should find
+       only Green, Blue, or White around a given intersection.
+
+       The map size (the number of intersections along the horizontal and vertical directions) is
+       left in m->sx and m->sy, the colours in m->map.
+
+       Intersections are found as connected groups of yellow pixels, so they may be any shape
+       and size (hand-drawn, say), and the buildings are read one intersection size away from
+       each one's centre. Streets may be left out (giving dead ends) and the intersections may
+       be unevenly spaced, as long as every column of intersections crosses every row. The streets found are left
+       in the street graph, m->street and m->street_len: for each intersection and heading, the
+       intersection a robot driving that way reaches and how far it is, or whether the street
+       is missing or runs into the red border.
+
+       Feel free to create your own maps for testing (you'll have to print them to a reasonable
+       size to use with your bot).
+
+    */
+
+    int x, y, w, h;
+    int idx;
+    int sx, sy, dx, dy;
+    int (*map)[4];
+    int *cells;                     // Component (see label_intersections()) at each intersection, raster order
+    int n_comp, n_streets = 0, n_missing = 0;
+    struct yellow_component *comp = NULL;
+    const struct yellow_component *a, *b;
+    const char *corner_name[4] = {"Top-Left", "Top-Right", "Bottom-Right", "Bottom-Left"};
+    const int corner_x[4] = {-1, 1, 1, -1}, corner_y[4] = {-1, -1, 1, 1};
+
+    // Find the intersections as the connected groups of yellow pixels, and lay them out on a grid. They need not be
+    // evenly spaced, square or all the same size, so hand-drawn maps work as well as printed ones.
+    n_comp = label_intersections(map_img, rx, ry, &comp);
+    if (n_comp < 0) {
+        fprintf(stderr, "Out of memory parsing a %d x %d map image\n", rx, ry);
+        return (0);
+    }
+    if (n_comp == 0 || (cells = grid_cells(comp, n_comp, &sx, &sy, &dx, &dy)) == NULL) {
+        fprintf(stderr, "Unable to determine intersection geometry!\n");
+        free(comp);
+        return (0);
+    }
+    a = &comp[cells[0]];
+    fprintf(stderr,
+            "Intersection parameters: base_x=%d, base_y=%d, width=%d, height=%d, horiz_distance=%d, vertical_distance=%d\n",
+            a->x0, a->y0, a->x1 - a->x0 + 1, a->y1 - a->y0 + 1, dx, dy);
+    fprintf(stderr, "Map size: Number of horizontal intersections=%d, number of vertical intersections=%d\n", sx, sy);
+
+    free_loc_map(m);
+    m->sx = sx;
+    m->sy = sy;
+    m->map = (int (*)[4]) calloc(sx * sy, sizeof(*m->map));
+    m->street = (int (*)[4]) calloc(sx * sy, sizeof(*m->street));
+    m->street_len = (int (*)[4]) calloc(sx * sy, sizeof(*m->street_len));
+    if (m->map == NULL || m->street == NULL || m->street_len == NULL) {
+        fprintf(stderr, "Out of memory allocating space for a %d x %d map\n", sx, sy);
+        free(cells);
+        free(comp);
+        free_loc_map(m);
+        return (0);
+    }
+    map = m->map;
+
+    // Scan for building colours around each intersection, one intersection size away from its centre diagonally
+    for (int j = 0; j < sy; j++)
+        for (int i = 0; i < sx; i++) {
+            idx = i + (j * sx);
+            a = &comp[cells[idx]];
+            x = (int) lround(a->cx);
+            y = (int) lround(a->cy);
+            w = a->x1 - a->x0 + 1;
+            h = a->y1 - a->y0 + 1;
+
+            fprintf(stderr, "Intersection location: %d, %d\n", x, y);
+            for (int k = 0; k < 4; k++) {
+                map[idx][k] = building_colour(map_img, rx, ry, x + (corner_x[k] * w), y + (corner_y[k] * h));
+                if (map[idx][k] == 0) {
+                    fprintf(stderr, "Colour is not valid for intersection %d,%d, %s at %d,%d\n", i, j, corner_name[k],
+                            x + (corner_x[k] * w), y + (corner_y[k] * h));
+                }
+            }
+            fprintf(stderr, "Colours for this intersection: %d, %d, %d, %d\n", map[idx][0], map[idx][1], map[idx][2],
+                    map[idx][3]);
+        }
+
+    // Trace the streets between neighbouring intersections, each once (to the right and down) and mirrored for the
+    // way back, from the edge of one to the edge of the other. Streets off the edge of the grid end at the red border.
+    for (int j = 0; j < sy; j++)
+        for (int i = 0; i < sx; i++) {
+            idx = i + (j * sx);
+            a = &comp[cells[idx]];
+            if (i == 0) m->street[idx][3] = STREET_BORDER;
+            if (j == 0) m->street[idx][0] = STREET_BORDER;
+            if (i == sx - 1) {
+                m->street[idx][1] = STREET_BORDER;
+            } else {
+                b = &comp[cells[idx + 1]];
+                if (b->x0 <= a->x1 + 1 ||
+                    is_street(map_img, rx, a->x1 + 1, (int) lround(a->cy), b->x0 - 1, (int) lround(b->cy))) {
+                    m->street[idx][1] = idx + 1;
+                    m->street[idx + 1][3] = idx;
+                    m->street_len[idx][1] = (int) lround(hypot(b->cx - a->cx, b->cy - a->cy));
+                    m->street_len[idx + 1][3] = m->street_len[idx][1];
+                    n_streets++;
+                } else {
+                    m->street[idx][1] = m->street[idx + 1][3] = STREET_NONE;
+                    n_missing++;
+                }
+            }
+            if (j == sy - 1) {
+                m->street[idx][2] = STREET_BORDER;
+            } else {
+                b = &comp[cells[idx + sx]];
+                if (b->y0 <= a->y1 + 1 ||
+                    is_street(map_img, rx, (int) lround(a->cx), a->y1 + 1, (int) lround(b->cx), b->y0 - 1)) {
+                    m->street[idx][2] = idx + sx;
+                    m->street[idx + sx][0] = idx;
+                    m->street_len[idx][2] = (int) lround(hypot(b->cx - a->cx, b->cy - a->cy));
+                    m->street_len[idx + sx][0] = m->street_len[idx][2];
+                    n_streets++;
+                } else {
+                    m->street[idx][2] = m->street[idx + sx][0] = STREET_NONE;
+                    n_missing++;
+                }
+            }
+        }
+    free(cells);
+    free(comp);
+    fprintf(stderr, "Street graph: %d streets, %d missing\n", n_streets, n_missing);
+
+    if (build_signature_index(m) == 0 || build_sequence_index(m) == 0) {
+        fprintf(stderr, "Out of memory allocating space for a %d x %d map\n", sx, sy);
+        free_loc_map(m);
+        return (0);
+    }
+    return (1);
+}
+
+/*!
+ * 64-bit FNV-1a hash of a parsed map (its size, the building colours around every intersection and the street graph
+ * with its lengths), to tell whether saved state such as a checkpoint belongs to this map
+ */
+unsigned long long map_hash(const struct loc_map *m) {
+    unsigned long long h = 14695981039346656037ULL;
+    int cells = m->sx * m->sy;
+    int v;
+
+    for (int i = -2; i < cells * 12; i++) {
+        if (i < 0) v = (i == -2) ? m->sx : m->sy;
+        else if (i < cells * 4) v = m->map[i / 4][i % 4];
+        else if (i < cells * 8) v = m->street[(i / 4) - cells][i % 4];
+        else v = m->street_len[(i / 4) - (2 * cells)][i % 4];
+        for (int k = 0; k < 4; k++) {
+            h ^= (unsigned char) (v >> (8 * k));
+            h *= 1099511628211ULL;
+        }
+    }
+    return (h);
+}
+
+/*!
+ * Releases what parse_map() allocated in a map. Safe to call on a zeroed or already released map.
+ */
+void free_loc_map(struct loc_map *m) {
+    if (m->cache != NULL) {
+        munmap(m->cache, m->cache_size);
+    } else {
+        free(m->map);
+        free(m->map_sig);
+        free(m->sig_states);
+        free(m->seq_keys);
+        free(m->seq_start);
+        free(m->seq_count);
+        free(m->seq_states);
+        free(m->street);
+        free(m->street_len);
+    }
+    m->cache = NULL;
+    m->cache_size = 0;
+    m->map = NULL;
+    m->map_sig = NULL;
+    m->sig_states = NULL;
+    m->seq_keys = NULL;
+    m->seq_start = NULL;
+    m->seq_count = NULL;
+    m->seq_states = NULL;
+    m->street = NULL;
+    m->street_len = NULL;
+    m->seq_cap = 0;
+    m->sx = m->sy = 0;
+}
+
+/*!
+ * Fills in the default model weights (P_MOVE, P_DRIFT, P_STAY, P_HIT, P_MISS), the same for every action, with the
+ * confusion model off
+ */
+void default_params(struct loc_params *p) {
+    p->p_move = P_MOVE;
+    p->p_drift = P_DRIFT;
+    p->p_stay = P_STAY;
+    p->per_action = 0;
+    for (int r = 0; r < 2; r++) {
+        for (int a = 0; a < 4; a++) {
+            p->act_w[r][a].move = P_MOVE;
+            p->act_w[r][a].drift = P_DRIFT;
+            p->act_w[r][a].stay = P_STAY;
+        }
+    }
+    p->p_hit = P_HIT;
+    p->p_miss = P_MISS;
+    p->use_confusion = 0;
+    for (int i = 0; i < N_COLOURS; i++) {
+        for (int j = 0; j < N_COLOURS; j++) p->confusion[i][j] = (i == j) ? 1.0 : 0.0;
+    }
+}
+
+/*!
+ * Sets up a filter over a parsed map: allocates its belief buffers, compiles the weights in p into its transition
+ * tables and starts it from uniform beliefs. The map is only read, so many contexts can share it.
+ * @return int, 1 success 0 fail (the context is left released)
+ */
+int init_context(struct loc_context *ctx, const struct loc_map *m, const struct loc_params *p) {
+    int n = N_STATES(m);
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->m = m;
+    ctx->p = *p;
+    ctx->rbt_x = ctx->rbt_y = ctx->rbt_dir = -1;
+    ctx->log_beliefs = LOG_BELIEFS;
+    ctx->verbose = 1;
+    if (n <= 0) return (0);
+    ctx->beliefs = (double *) calloc(n, sizeof(double));
+    ctx->last_beliefs = (double *) calloc(n, sizeof(double));
+    ctx->active_states = (int *) calloc(SPARSE_K, sizeof(int));
+    ctx->touched_states = (int *) calloc(n, sizeof(int));
+    ctx->sparse_acc = (double *) calloc(n, sizeof(double));
+    ctx->sparse_mark = (unsigned char *) calloc(n, sizeof(unsigned char));
+    ctx->hist_filtered = (double *) calloc((size_t) HISTORY_LEN * n, sizeof(double));
+    ctx->viterbi_back = (int *) calloc((size_t) HISTORY_LEN * n, sizeof(int));
+    ctx->hist_states = (int *) calloc((size_t) HISTORY_LEN * SPARSE_K, sizeof(int));
+    ctx->viterbi = (double *) calloc(n, sizeof(double));
+    ctx->viterbi_tmp = (double *) calloc(n, sizeof(double));
+    ctx->history_tmp = (double *) calloc(2 * n, sizeof(double));
+    if (ctx->beliefs == NULL || ctx->last_beliefs == NULL || ctx->active_states == NULL ||
+        ctx->touched_states == NULL || ctx->sparse_acc == NULL || ctx->sparse_mark == NULL ||
+        ctx->hist_filtered == NULL || ctx->viterbi_back == NULL || ctx->viterbi == NULL ||
+        ctx->viterbi_tmp == NULL || ctx->history_tmp == NULL || ctx->hist_states == NULL ||
+        build_transition_tables(ctx) == 0) {
+        free_context(ctx);
+        return (0);
+    }
+    build_sensing_table(ctx);
+    uniform_beliefs(ctx);
+    return (1);
+}
+
+/*!
+ * Switches a context to new model weights, recompiling its transition and sensing tables. The beliefs are reset to
+ * uniform.
+ * @return int, 1 success 0 fail (the context then has no tables and must be released)
+ */
+int set_params(struct loc_context *ctx, const struct loc_params *p) {
+    free_transition_tables(ctx);
+    ctx->p = *p;
+    if (build_transition_tables(ctx) == 0) return (0);
+    build_sensing_table(ctx);
+    uniform_beliefs(ctx);
+    return (1);
+}
+
+/*!
+ * Releases the belief buffers and transition tables of a context (not its map)
+ */
+void free_context(struct loc_context *ctx) {
+    free_transition_tables(ctx);
+    free(ctx->beliefs);
+    free(ctx->last_beliefs);
+    free(ctx->active_states);
+    free(ctx->touched_states);
+    free(ctx->sparse_acc);
+    free(ctx->sparse_mark);
+    free(ctx->hist_filtered);
+    free(ctx->viterbi_back);
+    free(ctx->hist_states);
+    free(ctx->viterbi);
+    free(ctx->viterbi_tmp);
+    free(ctx->history_tmp);
+    free(ctx->plan_scratch);
+    ctx->beliefs = NULL;
+    ctx->last_beliefs = NULL;
+    ctx->active_states = NULL;
+    ctx->touched_states = NULL;
+    ctx->sparse_acc = NULL;
+    ctx->sparse_mark = NULL;
+    ctx->hist_filtered = NULL;
+    ctx->viterbi_back = NULL;
+    ctx->hist_states = NULL;
+    ctx->viterbi = NULL;
+    ctx->viterbi_tmp = NULL;
+    ctx->history_tmp = NULL;
+    ctx->plan_scratch = NULL;
+}
+
+/*!
+ * Releases the transition tables of a context
+ */
+void free_transition_tables(struct loc_context *ctx) {
+    struct transition_table *T;
+
+    for (int r = 0; r < 2; r++) {
+        for (int a = 0; a < 4; a++) {
+            T = &ctx->motion[r][a];
+            free(T->start);
+            free(T->src);
+            free(T->w);
+            free(T->lw);
+            free(T->run_dst);
+            free(T->run_src);
+            free(T->run_len);
+            free(T->run_w);
+            free(T->out_start);
+            free(T->out_dst);
+            free(T->out_w);
+            free(T->kind);
+            memset(T, 0, sizeof(*T));
+        }
+    }
+}
+
+/*!
+ * Compiles the motion model into sparse transition tables, one per action (0 straight, 1 right, 2 back, 3 left) and
+ * per action when the robot bounced off the red border, from the weights in ctx->p. Rows are indexed by destination
+ * state (see STATE()) and list the source states feeding them, so update_beliefs() needs no bounds checks or
+ * branching. The entries are also grouped into runs (see compile_runs()) for the vector kernels.
+ *
+ * Moves follow the map's street graph. After action a, a robot facing d turns to face h = (d + a) % 4 and then:
+ *  - drives along the street out of its intersection on h to the next intersection (p_move), or to one of the two
+ *    intersections beside that one (p_drift each, if streets lead there)
+ *  - if that street runs into the red border, it turns around and stays put facing (h + 2) % 4 (p_move), or ends up
+ *    at a neighbour along the border (p_drift each)
+ *  - if there is no street on h (a dead end), it finds nothing to drive along and stays put facing h
+ *    (p_move + 2 * p_drift, counted as a move)
+ *  - in any case, stays at its intersection with its old heading (p_stay)
+ * With per_action set the three weights come from act_w[][] for each table instead (see action_weights()). Each
+ * destination has at most three sources besides itself, so building and applying a table takes time in proportion to
+ * the number of streets.
+ *
+ * @return int, 1 success 0 fail
+ */
+int build_transition_tables(struct loc_context *ctx) {
+    const struct loc_map *m = ctx->m;
+    const struct loc_params *p = &ctx->p;
+    int cells = m->sx * m->sy;
+    int n = N_STATES(m);
+    int cnt, h, d, c, q, t, side;
+    struct transition_table *T;
+    struct motion_weights mw;
+
+    for (int r = 0; r < 2; r++) {
+        for (int a = 0; a < 4; a++) {
+            T = &ctx->motion[r][a];
+            mw = action_weights(p, r, a);
+            T->n = n;
+            T->start = (int *) calloc(n + 1, sizeof(int));
+            T->src = (int *) calloc(n * 5, sizeof(int));
+            T->w = (double *) calloc(n * 5, sizeof(double));
+            T->lw = (double *) calloc(n * 5, sizeof(double));
+            T->kind = (unsigned char *) calloc(n * 5, sizeof(unsigned char));
+            if (T->start == NULL || T->src == NULL || T->w == NULL || T->lw == NULL || T->kind == NULL) return (0);
+
+            cnt = 0;
+            for (int s = 0; s < n; s++) {
+                c = s % cells;
+                T->start[s] = cnt;
+                if (r == 0) {
+                    h = s / cells;          // heading at the destination
+                    d = (h - a + 4) % 4;    // heading before the action
+                    // Sources that meant to reach the intersection on the left of c, c itself, or the one on its
+                    // right: the intersection behind each of them along h
+                    for (int k = -1; k <= 1; k++) {
+                        side = (h + 4 + k) % 4;
+                        t = (k == 0) ? c : m->street[c][side];
+                        q = (t >= 0) ? m->street[t][(h + 2) % 4] : STREET_NONE;
+                        if (q >= 0) {
+                            T->src[cnt] = STATE(m, q, d);
+                            T->w[cnt] = (k == 0) ? mw.move : mw.drift;
+                            T->kind[cnt] = (k == 0) ? MOVE_ENTRY : DRIFT_ENTRY;
+                            cnt++;
+                        }
+                    }
+                    if (m->street[c][h] == STREET_NONE) {
+                        T->src[cnt] = STATE(m, c, d);
+                        T->w[cnt] = mw.move + (2 * mw.drift);
+                        T->kind[cnt] = MOVE_ENTRY;
+                        cnt++;
+                    }
+                } else {
+                    h = (s / cells + 2) % 4;    // heading the robot had when it hit the border
+                    d = (h - a + 4) % 4;
+                    if (m->street[c][h] == STREET_BORDER) {
+                        for (int k = -1; k <= 1; k++) {
+                            q = (k == 0) ? c : m->street[c][(h + 4 + k) % 4];
+                            if (q >= 0 && m->street[q][h] == STREET_BORDER) {
+                                T->src[cnt] = STATE(m, q, d);
+                                T->w[cnt] = (k == 0) ? mw.move : mw.drift;
+                                T->kind[cnt] = (k == 0) ? MOVE_ENTRY : DRIFT_ENTRY;
+                                cnt++;
+                            }
+                        }
+                    }
+                }
+                T->src[cnt] = s;
+                T->w[cnt] = mw.stay;
+                T->kind[cnt] = STAY_ENTRY;
+                cnt++;
+            }
+            T->start[n] = cnt;
+            for (int k = 0; k < cnt; k++) T->lw[k] = log(T->w[k]);
+            if (compile_runs(T) == 0 || transpose_table(T) == 0) return (0);
+        }
+    }
+    return (1);
+}
+
+/*!
+ * Motion weights for action act (bounced 1 if the robot hit the red border on the way): act_w[bounced][act] with
+ * per_action set, p_move / p_drift / p_stay otherwise
+ */
+struct motion_weights action_weights(const struct loc_params *p, int bounced, int act) {
+    struct motion_weights mw;
+
+    if (p->per_action) return (p->act_w[bounced ? 1 : 0][act]);
+    mw.move = p->p_move;
+    mw.drift = p->p_drift;
+    mw.stay = p->p_stay;
+    return (mw);
+}
+
+/*!
+ * Reads per-action motion weights (as written by write_motion_params(), e.g. fitted by EV3_Replay -b) into p and
+ * turns per_action on. One line per table, '#' starts a comment:
+ *
+ *   bounced act move drift stay
+ *
+ * Tables not listed keep p_move / p_drift / p_stay.
+ * @return int, 1 success 0 fail (p unchanged)
+ */
+int load_motion_params(const char *filename, struct loc_params *p) {
+    struct motion_weights w[2][4];
+    char line[1024];
+    int r, a, lineno = 0;
+    double mv, dr, st;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (f == NULL) return (0);
+    for (r = 0; r < 2; r++) {
+        for (a = 0; a < 4; a++) w[r][a] = action_weights(p, r, a);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+        if (sscanf(line, "%d %d %lf %lf %lf", &r, &a, &mv, &dr, &st) != 5 || r < 0 || r > 1 || a < 0 || a > 3 ||
+            mv <= 0 || dr <= 0 || st <= 0) {
+            fprintf(stderr, "%s:%d: expected 'bounced act move drift stay' with positive weights\n", filename, lineno);
+            fclose(f);
+            return (0);
+        }
+        w[r][a].move = mv;
+        w[r][a].drift = dr;
+        w[r][a].stay = st;
+    }
+    fclose(f);
+    memcpy(p->act_w, w, sizeof(w));
+    p->per_action = 1;
+    return (1);
+}
+
+/*!
+ * Writes the motion weights of every table in the format load_motion_params() reads
+ * @return int, 1 success 0 fail
+ */
+int write_motion_params(const char *filename, const struct loc_params *p) {
+    struct motion_weights mw;
+    FILE *f;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create %s\n", filename);
+        return (0);
+    }
+    fprintf(f, "# bounced act move drift stay\n");
+    for (int r = 0; r < 2; r++) {
+        for (int a = 0; a < 4; a++) {
+            mw = action_weights(p, r, a);
+            fprintf(f, "%d %d %.6f %.6f %.6f\n", r, a, mw.move, mw.drift, mw.stay);
+        }
+    }
+    fclose(f);
+    return (1);
+}
+
+/*!
+ * 2-bit code for a building colour: Blue 0, Green 1, White 2, anything else 3 (never found around an intersection)
+ */
+int colour_code(int colour) {
+    if (colour == 2) return (0);
+    if (colour == 3) return (1);
+    if (colour == 6) return (2);
+    return (3);
+}
+
+/*!
+ * Packs a 4-corner reading (top-left, top-right, bottom-right, bottom-left as seen by the robot) into one byte,
+ * two bits per corner.
+ * @return int, the signature, or -1 if some corner is not a building colour (Blue, Green or White)
+ */
+int pack_signature(const int reading[4]) {
+    int sig = 0;
+    for (int k = 0; k < 4; k++) {
+        if (colour_code(reading[k]) == 3) return (-1);
+        sig |= colour_code(reading[k]) << (2 * k);
+    }
+    return (sig);
+}
+
+/*!
+ * Reads a confusion count file (see write_confusion_counts()): N_COLOURS rows of N_COLOURS counts, row i for the
+ * colour i + 1 under the sensor and column j for the colour j + 1 it was read as. Lines starting with '#' are skipped.
+ * @return int, 1 success 0 fail (counts left zero)
+ */
+int read_confusion_counts(const char *filename, double counts[N_COLOURS][N_COLOURS]) {
+    char line[1024];
+    char *at;
+    int row = 0, used;
+    FILE *f;
+
+    memset(counts, 0, N_COLOURS * N_COLOURS * sizeof(double));
+    f = fopen(filename, "r");
+    if (f == NULL) return (0);
+    while (row < N_COLOURS && fgets(line, sizeof(line), f) != NULL) {
+        if (line[strspn(line, " \t\r\n")] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+        at = line;
+        for (int j = 0; j < N_COLOURS; j++) {
+            if (sscanf(at, "%lf%n", &counts[row][j], &used) != 1 || counts[row][j] < 0) {
+                fprintf(stderr, "%s: expected %d counts on row %d\n", filename, N_COLOURS, row + 1);
+                memset(counts, 0, N_COLOURS * N_COLOURS * sizeof(double));
+                fclose(f);
+                return (0);
+            }
+            at += used;
+        }
+        row++;
+    }
+    fclose(f);
+    if (row < N_COLOURS) {
+        fprintf(stderr, "%s: expected %d rows of counts\n", filename, N_COLOURS);
+        memset(counts, 0, N_COLOURS * N_COLOURS * sizeof(double));
+        return (0);
+    }
+    return (1);
+}
+
+/*!
+ * Writes confusion counts in the format read_confusion_counts() expects
+ * @return int, 1 success 0 fail
+ */
+int write_confusion_counts(const char *filename, const double counts[N_COLOURS][N_COLOURS]) {
+    FILE *f;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create %s\n", filename);
+        return (0);
+    }
+    fprintf(f, "# Colour confusion counts, one row per colour under the sensor, one column per colour read\n");
+    fprintf(f, "# Black Blue Green Yellow Red White\n");
+    for (int i = 0; i < N_COLOURS; i++) {
+        for (int j = 0; j < N_COLOURS; j++) fprintf(f, "%s%g", j ? " " : "", counts[i][j]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return (1);
+}
+
+/*!
+ * Switches p to the confusion sensing model, with each row of counts normalized into P(read | colour) after adding
+ * CONFUSION_PRIOR to every cell. Contexts pick the new model up through set_params().
+ */
+void set_confusion(struct loc_params *p, const double counts[N_COLOURS][N_COLOURS]) {
+    double C;
+
+    for (int i = 0; i < N_COLOURS; i++) {
+        C = 0;
+        for (int j = 0; j < N_COLOURS; j++) C += counts[i][j] + CONFUSION_PRIOR;
+        for (int j = 0; j < N_COLOURS; j++) p->confusion[i][j] = (counts[i][j] + CONFUSION_PRIOR) / C;
+    }
+    p->use_confusion = 1;
+}
+
+/*!
+ * Per-corner likelihoods (see update_beliefs_soft()) for a reading of colour indices: 1 for the colour read and 0 for
+ * the others, or 1 for every colour if the corner is not a building colour (not observed)
+ */
+void reading_likelihoods(const int reading[4], double corner_lik[4][3]) {
+    int c;
+
+    for (int k = 0; k < 4; k++) {
+        c = colour_code(reading[k]);
+        for (int j = 0; j < 3; j++) corner_lik[k][j] = (c == 3 || c == j) ? 1.0 : 0.0;
+    }
+}
+
+/*!
+ * The signature a set of per-corner likelihoods pins down, if every corner allows exactly one colour
+ * @return int, the signature, or -1 if some corner is uncertain
+ */
+int certain_signature(const double corner_lik[4][3]) {
+    int sig = 0, c, n;
+
+    for (int k = 0; k < 4; k++) {
+        n = 0;
+        for (int j = 0; j < 3; j++) {
+            if (corner_lik[k][j] > 0) {
+                c = j;
+                n++;
+            }
+        }
+        if (n != 1) return (-1);
+        sig |= c << (2 * k);
+    }
+    return (sig);
+}
+
+/*!
+ * Builds m->map_sig[], the signature a robot at each intersection and facing each direction would read (indexed by
+ * STATE()), and the inverted index from signature to the list of states that produce it. Facing direction d, the
+ * robot's corner k is the map's corner (k + d) % 4.
+ * @return int, 1 success 0 fail
+ */
+int build_signature_index(struct loc_map *m) {
+    int n = N_STATES(m);
+    int cells = m->sx * m->sy;
+    int sig;
+    int fill[256];
+
+    m->map_sig = (unsigned char *) calloc(n, sizeof(unsigned char));
+    m->sig_states = (int *) calloc(n, sizeof(int));
+    if (m->map_sig == NULL || m->sig_states == NULL) return (0);
+
+    memset(&m->sig_start[0], 0, sizeof(m->sig_start));
+    for (int s = 0; s < n; s++) {
+        sig = 0;
+        for (int k = 0; k < 4; k++) sig |= colour_code(m->map[s % cells][(k + s / cells) % 4]) << (2 * k);
+        m->map_sig[s] = (unsigned char) sig;
+        m->sig_start[sig + 1]++;
+    }
+    for (int g = 0; g < 256; g++) {
+        m->sig_start[g + 1] += m->sig_start[g];
+        fill[g] = m->sig_start[g];
+    }
+    for (int s = 0; s < n; s++) m->sig_states[fill[m->map_sig[s]]++] = s;
+    return (1);
+}
+
+/*!
+ * Where the robot ends up from state s after action act if the move goes exactly as planned: the next intersection
+ * along the street on the new heading, the same intersection turned around if that street runs into the red border,
+ * or the same intersection facing the new heading if there is no street that way.
+ * @param bounced set to 1 if the move bounced off the border, 0 otherwise
+ * @return int, the state reached
+ */
+int exact_move(const struct loc_map *m, int s, int act, int *bounced) {
+    int cells = m->sx * m->sy;
+    int c = s % cells, h = (s / cells + act) % 4;
+    int next = m->street[c][h];
+
+    *bounced = (next == STREET_BORDER);
+    if (*bounced) return (STATE(m, c, (h + 2) % 4));
+    if (next == STREET_NONE) return (STATE(m, c, h));
+    return (STATE(m, next, h));
+}
+
+// An intersection waiting in route_distances(), with its distance when it was queued
+struct route_entry {
+    double dist;
+    int node;
+};
+
+static void route_push(struct route_entry *heap, int *n, double dist, int node) {
+    int k = (*n)++, up;
+
+    while (k > 0 && heap[up = (k - 1) / 2].dist > dist) {
+        heap[k] = heap[up];
+        k = up;
+    }
+    heap[k].dist = dist;
+    heap[k].node = node;
+}
+
+static struct route_entry route_pop(struct route_entry *heap, int *n) {
+    struct route_entry top = heap[0], last = heap[--(*n)];
+    int k = 0, child;
+
+    while ((child = (2 * k) + 1) < *n) {
+        if (child + 1 < *n && heap[child + 1].dist < heap[child].dist) child++;
+        if (heap[child].dist >= last.dist) break;
+        heap[k] = heap[child];
+        k = child;
+    }
+    heap[k] = last;
+    return (top);
+}
+
+/*!
+ * Shortest distances along the streets (in pixels) from every intersection to intersection target, with Dijkstra's
+ * algorithm over the street graph. Streets are the same length both ways, so the search runs outwards from the
+ * target. Every intersection is settled once and every street looked at once from each end, so the cost grows with
+ * the number of streets.
+ * @param dist sx * sy values, set to the distance from each intersection, INFINITY where no street leads to the target
+ * @return int, 1 success 0 fail (out of memory, or target not on the map)
+ */
+int route_distances(const struct loc_map *m, int target, double *dist) {
+    struct route_entry *heap, e;
+    int cells = m->sx * m->sy, n = 0, next;
+
+    if (target < 0 || target >= cells) return (0);
+    heap = (struct route_entry *) calloc((cells * 4) + 1, sizeof(struct route_entry));
+    if (heap == NULL) return (0);
+    for (int c = 0; c < cells; c++) dist[c] = INFINITY;
+    dist[target] = 0;
+    route_push(heap, &n, 0, target);
+    while (n > 0) {
+        e = route_pop(heap, &n);
+        if (e.dist > dist[e.node]) continue;    // Already settled through a shorter route
+        for (int h = 0; h < 4; h++) {
+            next = m->street[e.node][h];
+            if (next < 0 || e.dist + m->street_len[e.node][h] >= dist[next]) continue;
+            dist[next] = e.dist + m->street_len[e.node][h];
+            route_push(heap, &n, dist[next], next);
+        }
+    }
+    free(heap);
+    return (1);
+}
+
+/*!
+ * Action (0 straight, 1 right, 2 back, 3 left) that takes a robot in state s towards the target of dist[] (see
+ * route_distances()) along the shortest route: the street out of its intersection whose length plus the distance
+ * left from its far end is smallest. Ties go to going straight, then right, left and back, which need fewer turns.
+ * @return int, the action, -1 if no street from here leads to the target (or the robot is already there)
+ */
+int route_action(const struct loc_map *m, const double *dist, int s) {
+    const int order[4] = {0, 1, 3, 2};
+    int cells = m->sx * m->sy;
+    int c = s % cells, best = -1, h, next;
+    double cost, best_cost = INFINITY;
+
+    if (dist[c] == 0 || isinf(dist[c])) return (-1);
+    for (int k = 0; k < 4; k++) {
+        h = (s / cells + order[k]) % 4;
+        next = m->street[c][h];
+        if (next < 0) continue;
+        cost = m->street_len[c][h] + dist[next];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = order[k];
+        }
+    }
+    return (best);
+}
+
+/*!
+ * Packs a sequence of n scans (n at most 5) into one key: the first signature, then for every later scan the action
+ * taken to reach it, its bounce flag and its signature, 11 bits each. The action before the first scan is ignored.
+ */
+unsigned long long sequence_key(int n, const int *sig, const int *act, const int *flag) {
+    unsigned long long key = (unsigned long long) sig[0];
+
+    for (int i = 1; i < n; i++) {
+        key = (key << 11) | (unsigned long long) ((act[i] << 9) | ((flag[i] ? 1 : 0) << 8) | sig[i]);
+    }
+    return (key);
+}
+
+static unsigned int sequence_slot(unsigned long long key, int cap) {
+    return ((unsigned int) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1));
+}
+
+// One path of the sequence index while it is built
+struct seq_entry {
+    unsigned long long key;
+    int state;
+};
+
+static int compare_seq_entries(const void *a, const void *b) {
+    unsigned long long x = ((const struct seq_entry *) a)->key;
+    unsigned long long y = ((const struct seq_entry *) b)->key;
+    return ((x > y) - (x < y));
+}
+
+/*!
+ * Builds the map's scan-sequence index: every path of RELOC_WINDOW scans the robot can drive (any action between
+ * scans, with exact moves), keyed by sequence_key() of what it reads, to the state where the path ends. The keys go
+ * into an open-addressing hash table, so relocalize() finds the candidates with one lookup.
+ * @return int, 1 success 0 fail
+ */
+int build_sequence_index(struct loc_map *m) {
+    struct seq_entry *e;
+    int n = N_STATES(m);
+    int n_paths = n << (2 * (RELOC_WINDOW - 1));
+    int sig[RELOC_WINDOW], act[RELOC_WINDOW], flag[RELOC_WINDOW];
+    int s, p, n_keys = 0, i, j;
+    unsigned int h;
+
+    e = (struct seq_entry *) calloc(n_paths, sizeof(struct seq_entry));
+    if (e == NULL) return (0);
+    for (p = 0; p < n_paths; p++) {
+        s = p >> (2 * (RELOC_WINDOW - 1));
+        sig[0] = m->map_sig[s];
+        act[0] = flag[0] = 0;
+        for (i = 1; i < RELOC_WINDOW; i++) {
+            act[i] = (p >> (2 * (i - 1))) & 3;
+            s = exact_move(m, s, act[i], &flag[i]);
+            sig[i] = m->map_sig[s];
+        }
+        e[p].key = sequence_key(RELOC_WINDOW, sig, act, flag);
+        e[p].state = s;
+    }
+    qsort(e, n_paths, sizeof(struct seq_entry), compare_seq_entries);
+    for (p = 0; p < n_paths; p++) {
+        if (p == 0 || e[p].key != e[p - 1].key) n_keys++;
+    }
+
+    for (m->seq_cap = 1; m->seq_cap < 2 * n_keys; m->seq_cap *= 2);
+    m->seq_keys = (unsigned long long *) calloc(m->seq_cap, sizeof(unsigned long long));
+    m->seq_start = (int *) calloc(m->seq_cap, sizeof(int));
+    m->seq_count = (int *) calloc(m->seq_cap, sizeof(int));
+    m->seq_states = (int *) calloc(n_paths, sizeof(int));
+    if (m->seq_keys == NULL || m->seq_start == NULL || m->seq_count == NULL || m->seq_states == NULL) {
+        free(e);
+        return (0);
+    }
+    for (i = 0; i < n_paths; i = j) {
+        for (j = i; j < n_paths && e[j].key == e[i].key; j++) m->seq_states[j] = e[j].state;
+        for (h = sequence_slot(e[i].key, m->seq_cap); m->seq_count[h] != 0; h = (h + 1) & (m->seq_cap - 1));
+        m->seq_keys[h] = e[i].key;
+        m->seq_start[h] = i;
+        m->seq_count[h] = j - i;
+    }
+    free(e);
+    return (1);
+}
+
+/*!
+ * Looks up a scan sequence key (see sequence_key()) in the map's sequence index
+ * @param states set to the states that can end the sequence
+ * @return int, number of states, 0 if no path on the map reads that sequence
+ */
+int lookup_sequence(const struct loc_map *m, unsigned long long key, const int **states) {
+    unsigned int h;
+
+    if (m->seq_cap == 0) return (0);
+    for (h = sequence_slot(key, m->seq_cap); m->seq_count[h] != 0; h = (h + 1) & (m->seq_cap - 1)) {
+        if (m->seq_keys[h] == key) {
+            *states = &m->seq_states[m->seq_start[h]];
+            return (m->seq_count[h]);
+        }
+    }
+    return (0);
+}
+
+/*!
+ * Groups the entries of a transition table into runs: consecutive destination states fed by consecutive source
+ * states with the same weight. On the plane-per-direction layout a move becomes a shifted copy of most of a plane,
+ * so a prediction is a handful of long runs the vector kernels can stream through.
+ * @return int, 1 success 0 fail
+ */
+int compile_runs(struct transition_table *T) {
+    int *open;          // Runs that end at the current destination state and could still be extended
+    int n_open = 0, n_next;
+    int found;
+    int cap = T->start[T->n];
+
+    T->run_dst = (int *) calloc(cap, sizeof(int));
+    T->run_src = (int *) calloc(cap, sizeof(int));
+    T->run_len = (int *) calloc(cap, sizeof(int));
+    T->run_w = (double *) calloc(cap, sizeof(double));
+    open = (int *) calloc(cap, sizeof(int));
+    if (T->run_dst == NULL || T->run_src == NULL || T->run_len == NULL || T->run_w == NULL || open == NULL) {
+        free(open);
+        return (0);
+    }
+
+    T->n_runs = 0;
+    for (int s = 0; s < T->n; s++) {
+        n_next = 0;
+        for (int k = T->start[s]; k < T->start[s + 1]; k++) {
+            found = -1;
+            for (int o = 0; o < n_open && found < 0; o++) {
+                int r = open[o];
+                if (r >= 0 && T->run_w[r] == T->w[k] && T->run_src[r] - T->run_dst[r] == T->src[k] - s) found = o;
+            }
+            if (found >= 0) {
+                T->run_len[open[found]]++;
+                open[n_open + n_next++] = open[found];
+                open[found] = -1;
+            } else {
+                T->run_dst[T->n_runs] = s;
+                T->run_src[T->n_runs] = T->src[k];
+                T->run_len[T->n_runs] = 1;
+                T->run_w[T->n_runs] = T->w[k];
+                open[n_open + n_next++] = T->n_runs++;
+            }
+        }
+        // Only the runs extended at s can continue at s + 1
+        memmove(open, open + n_open, n_next * sizeof(int));
+        n_open = n_next;
+    }
+    free(open);
+    return (1);
+}
+
+/*!
+ * Fills the by-source copy of a transition table (out_start, out_dst, out_w), used to push a few states forward in
+ * top-K mode.
+ * @return int, 1 success 0 fail
+ */
+int transpose_table(struct transition_table *T) {
+    int cnt = T->start[T->n];
+    int *fill;
+
+    T->out_start = (int *) calloc(T->n + 1, sizeof(int));
+    T->out_dst = (int *) calloc(cnt, sizeof(int));
+    T->out_w = (double *) calloc(cnt, sizeof(double));
+    fill = (int *) calloc(T->n, sizeof(int));
+    if (T->out_start == NULL || T->out_dst == NULL || T->out_w == NULL || fill == NULL) {
+        free(fill);
+        return (0);
+    }
+    for (int k = 0; k < cnt; k++) T->out_start[T->src[k] + 1]++;
+    for (int s = 0; s < T->n; s++) {
+        T->out_start[s + 1] += T->out_start[s];
+        fill[s] = T->out_start[s];
+    }
+    for (int s = 0; s < T->n; s++) {
+        for (int k = T->start[s]; k < T->start[s + 1]; k++) {
+            T->out_dst[fill[T->src[k]]] = s;
+            T->out_w[fill[T->src[k]]++] = T->w[k];
+        }
+    }
+    free(fill);
+    return (1);
+}
+
+/*!
+ * One sparse matrix-vector product with a transition table: out[s] = sum of w * in[src] over the row of s, applied
+ * run by run with the vector kernels.
+ * @return double, total mass of out (for normalization)
+ */
+double apply_transition(const struct transition_table *T, const double *in, double *out) {
+    double C = 0;
+
+    memset(out, 0, T->n * sizeof(double));
+    for (int r = 0; r < T->n_runs; r++) {
+        C += axpy_run(out + T->run_dst[r], in + T->run_src[r], T->run_w[r], T->run_len[r]);
+    }
+    return (C);
+}
+
+/*!
+ * apply_transition() for log-beliefs: out[s] is the log-sum-exp of lw + in[src] over the row of s.
+ * @return double, largest value written to out
+ */
+double apply_transition_log(const struct transition_table *T, const double *in, double *out) {
+    double top = -INFINITY;
+    double m, acc;
+
+    for (int s = 0; s < T->n; s++) {
+        m = -INFINITY;
+        for (int k = T->start[s]; k < T->start[s + 1]; k++) {
+            if (T->lw[k] + in[T->src[k]] > m) m = T->lw[k] + in[T->src[k]];
+        }
+        if (m == -INFINITY) {
+            out[s] = m;
+            continue;
+        }
+        acc = 0;
+        for (int k = T->start[s]; k < T->start[s + 1]; k++) acc += exp(T->lw[k] + in[T->src[k]] - m);
+        out[s] = m + log(acc);
+        if (out[s] > top) top = out[s];
+    }
+    return (top);
+}
+
+/*!
+ * Skips whitespace and '#' comments (which run to the end of the line) in a .ppm file
+ * @return offset of the next token, n if the file ends first
+ */
+static size_t ppm_skip(const unsigned char *p, size_t n, size_t at) {
+    while (at < n) {
+        if (p[at] == '#') {
+            while (at < n && p[at] != '\n' && p[at] != '\r') at++;
+        } else if (p[at] == ' ' || p[at] == '\t' || p[at] == '\n' || p[at] == '\r' || p[at] == '\v' ||
+                   p[at] == '\f') {
+            at++;
+        } else {
+            break;
+        }
+    }
+    return (at);
+}
+
+/*!
+ * Reads the decimal number at offset *at of a .ppm file, skipping whitespace and comments before it, and moves *at
+ * past it.
+ * @return the number, -1 if there is none or it is larger than INT_MAX
+ */
+static long ppm_number(const unsigned char *p, size_t n, size_t *at) {
+    long v = -1;
+
+    *at = ppm_skip(p, n, *at);
+    while (*at < n && p[*at] >= '0' && p[*at] <= '9') {
+        v = ((v < 0) ? 0 : v * 10) + (p[*at] - '0');
+        if (v > INT_MAX) return (-1);
+        (*at)++;
+    }
+    return (v);
+}
+
+/*!
+ * Loads a .ppm map image. The file is memory-mapped and its header parsed in place:
+ *
+ *   P6 or P3                       - binary or ASCII samples
+ *   width height maxval            - decimal, separated by any whitespace, with '#' comments (to the end of the line)
+ *                                    allowed anywhere between them
+ *   samples                        - after a single whitespace character for P6: R, G, B per pixel in row-major
+ *                                    order, 1 byte each if maxval < 256 and 2 bytes (most significant first)
+ *                                    otherwise. For P3 decimal numbers separated by whitespace.
+ *
+ * The common case, P6 with maxval 255, is not copied at all: img->rgb points into the read-only mapping and the
+ * pages are only read in as parse_map() touches them. Anything else is converted into an allocated buffer of 8-bit
+ * samples scaled to 0..255, so pure colours in a 16-bit or P3 map stay pure. GIMP and imagemagick both save
+ * suitable files.
+ * @return int, 1 success 0 fail (with a message, and nothing left to free)
+ */
+int load_ppm(const char *filename, struct ppm_image *img) {
+    const unsigned char *p;
+    unsigned char *out;
+    struct stat st;
+    void *map;
+    size_t n, at = 2, n_pix;
+    long rx, ry, maxval, v = 0;
+    int fd, ascii, bytes;
+
+    memset(img, 0, sizeof(*img));
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file %s for reading, please check name and path\n", filename);
+        return (0);
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < 3 ||
+        (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Unable to read %s\n", filename);
+        close(fd);
+        return (0);
+    }
+    close(fd);
+    n = (size_t) st.st_size;
+    p = (const unsigned char *) map;
+    img->mapping = map;
+    img->map_size = n;
+
+    if (p[0] != 'P' || (p[1] != '6' && p[1] != '3')) {
+        fprintf(stderr, "Wrong file format, %s is not a P6 or P3 .ppm file\n", filename);
+        free_ppm(img);
+        return (0);
+    }
+    ascii = (p[1] == '3');
+    rx = ppm_number(p, n, &at);
+    ry = ppm_number(p, n, &at);
+    maxval = ppm_number(p, n, &at);
+    if (rx <= 0 || ry <= 0 || maxval <= 0 || maxval > 65535 || (size_t) rx * (size_t) ry > ((size_t) INT_MAX) / 3) {
+        fprintf(stderr, "Bad .ppm header in %s\n", filename);
+        free_ppm(img);
+        return (0);
+    }
+    n_pix = (size_t) rx * (size_t) ry;
+    bytes = (maxval > 255) ? 2 : 1;
+    img->rx = (int) rx;
+    img->ry = (int) ry;
+    fprintf(stderr, "%s: P%c, nx=%ld, ny=%ld, maxval %ld\n", filename, p[1], rx, ry, maxval);
+
+    if (!ascii) {
+        at++;
+        if (at > n || (n - at) / (3 * bytes) < n_pix) {
+            fprintf(stderr, "%s is truncated\n", filename);
+            free_ppm(img);
+            return (0);
+        }
+        if (maxval == 255) {
+            img->rgb = p + at;
+            madvise(map, n, MADV_SEQUENTIAL);
+            return (1);
+        }
+    }
+
+    // Other depths are converted, after which the mapping is no longer needed
+    out = (unsigned char *) malloc(n_pix * 3);
+    if (out == NULL) {
+        fprintf(stderr, "Out of memory allocating space for image\n");
+        free_ppm(img);
+        return (0);
+    }
+    for (size_t k = 0; k < n_pix * 3; k++) {
+        if (ascii) v = ppm_number(p, n, &at);
+        else if (bytes == 2) v = (p[at + (2 * k)] << 8) | p[at + (2 * k) + 1];
+        else v = p[at + k];
+        if (v < 0) {
+            fprintf(stderr, "%s is truncated\n", filename);
+            free(out);
+            free_ppm(img);
+            return (0);
+        }
+        if (v > maxval) v = maxval;
+        out[k] = (unsigned char) (((v * 255) + (maxval / 2)) / maxval);
+    }
+    munmap(map, n);
+    img->mapping = NULL;
+    img->map_size = 0;
+    img->owned = out;
+    img->rgb = out;
+    return (1);
+}
+
+void free_ppm(struct ppm_image *img) {
+    if (img->mapping != NULL) munmap(img->mapping, img->map_size);
+    free(img->owned);
+    memset(img, 0, sizeof(*img));
+}
+
+/*!
+ * Reads a .ppm map into a newly allocated buffer of rx * ry packed 8-bit RGB pixels, for callers that want their
+ * own copy (free() it). See load_ppm() for the formats read.
+ * @return the pixels, NULL on failure
+ */
+unsigned char *readPPMimage(const char *filename, int *rx, int *ry) {
+    struct ppm_image img;
+    unsigned char *im;
+
+    if (load_ppm(filename, &img) == 0) return (NULL);
+    im = (unsigned char *) malloc((size_t) img.rx * img.ry * 3);
+    if (im == NULL) fprintf(stderr, "Out of memory allocating space for image\n");
+    else memcpy(im, img.rgb, (size_t) img.rx * img.ry * 3);
+    *rx = img.rx;
+    *ry = img.ry;
+    free_ppm(&img);
+    return (im);
+}
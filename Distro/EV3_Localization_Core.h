@@ -0,0 +1,292 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Headers for the localization core (EV3_Localization_Core.c): map parsing, motion and sensing models, and the
+histogram filter. The core has no dependency on the robot or on bluetooth, programs that only need the filter (such
+as EV3_Replay) link this file and EV3_Kernels.c alone.
+
+*/
+
+#ifndef __localization_core_header
+#define __localization_core_header
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<math.h>
+#include<malloc.h>
+#include "EV3_Kernels.h"
+
+#ifndef LOG_BELIEFS
+#define LOG_BELIEFS 0       // Build with -DLOG_BELIEFS=1 to keep beliefs as log-probabilities
+#endif
+
+#ifndef RELOC_WINDOW
+#define RELOC_WINDOW 3      // Scans per key in the map's scan-sequence index (at most 5)
+#endif
+
+#ifndef HISTORY_LEN
+#define HISTORY_LEN 8       // Scans kept for smoothing and the Viterbi path
+#endif
+
+// Default motion model weights (see struct loc_params)
+#define P_MOVE 0.8          // moved to the next intersection along the new heading
+#define P_DRIFT 0.05        // ended up at one of the intersections beside that one
+#define P_STAY 0.1          // did not leave the intersection
+
+// Default sensing model weights
+#define P_HIT 0.7           // all four building colours match the map for that intersection and direction
+#define P_MISS 0.3          // anything else
+
+#define N_COLOURS 6         // Colour indices read by the sensor: 1 Black, 2 Blue, 3 Green, 4 Yellow, 5 Red, 6 White
+
+// Index of the belief for intersection idx (raster order) and direction dir on map M. Beliefs are stored as 4 planes
+// of sx*sy values, one per direction, so neighbouring intersections with the same heading are contiguous.
+#define STATE(M, idx, dir) ((dir) * (M)->sx * (M)->sy + (idx))
+#define N_STATES(M) ((M)->sx * (M)->sy * 4)
+
+// Sparse motion model, rows indexed by destination state
+struct transition_table {
+    int n;              // Number of states (rows)
+    int *start;         // n + 1 offsets into src[] and w[]
+    int *src;           // Source state of each entry
+    double *w;          // Transition probability of each entry
+    double *lw;         // log(w), for log-belief mode
+    int n_runs;         // The same entries grouped into runs: out[run_dst + k] += run_w * in[run_src + k]
+    int *run_dst;       //  for k in 0..run_len-1
+    int *run_src;
+    int *run_len;
+    double *run_w;
+    int *out_start;     // The same entries by source state: state s feeds out_dst[k] with weight out_w[k]
+    int *out_dst;       //  for k in out_start[s]..out_start[s + 1]-1
+    double *out_w;
+    unsigned char *kind;    // Outcome each entry (in row order) stands for: MOVE_ENTRY, DRIFT_ENTRY or STAY_ENTRY
+};
+
+#define MOVE_ENTRY 0
+#define DRIFT_ENTRY 1
+#define STAY_ENTRY 2
+
+#define STREET_NONE -1      // loc_map.street[][] for a heading with no street out of the intersection (a dead end)
+#define STREET_BORDER -2    //  and for a street that runs into the red border
+
+// Motion weights of one action, see build_transition_tables()
+struct motion_weights {
+    double move;
+    double drift;
+    double stay;
+};
+
+// A parsed map. Filled in by parse_map() and only read afterwards, so it can be shared by any number of contexts.
+struct loc_map {
+    int sx, sy;                 // Size of the map (number of intersections along x and y)
+    int (*map)[4];              // Building colours around each intersection, sx*sy rows in raster order,
+                                //  clockwise from the top-left
+    unsigned char *map_sig;     // Packed building colours each state (see STATE()) expects to read
+    int sig_start[257];         // Inverted index: the states with signature g are sig_states[sig_start[g]] up to
+    int *sig_states;            //  sig_states[sig_start[g + 1] - 1]
+    int seq_cap;                // Hash table of scan sequences (see sequence_key()), seq_cap slots (a power of 2).
+    unsigned long long *seq_keys;   //  The states where the sequence in slot h can end are
+    int *seq_start;             //  seq_states[seq_start[h]] up to seq_states[seq_start[h] + seq_count[h] - 1],
+    int *seq_count;             //  seq_count[h] is 0 for an empty slot
+    int *seq_states;
+    int (*street)[4];           // Street graph: the intersection reached from each intersection along each heading
+                                //  (UP, RIGHT, DOWN, LEFT), or STREET_NONE / STREET_BORDER
+    int (*street_len)[4];       // Length of each street in pixels, centre to centre (0 if there is none)
+    void *cache;                // Compiled map file the arrays above point into (see map_cache_read()), NULL if
+    size_t cache_size;          //  parse_map() allocated them
+};
+
+// Model weights, compiled into the transition and sensing tables of a context by init_context()
+struct loc_params {
+    double p_move;              // Moved to the next intersection along the new heading
+    double p_drift;             // Ended up at one of the intersections beside that one
+    double p_stay;              // Did not leave the intersection
+    int per_action;             // 1 to use act_w[][] instead of p_move / p_drift / p_stay for every action
+    struct motion_weights act_w[2][4];  // Weights by [1 if bounced off the red border][last action], see
+                                        //  load_motion_params()
+    double p_hit;               // All four building colours match the map for that intersection and direction
+    double p_miss;              // Anything else
+    int use_confusion;          // 1 to score each corner with confusion[][] instead of p_hit / p_miss for the scan
+    double confusion[N_COLOURS][N_COLOURS]; // P(sensor reads colour j + 1 | the colour is i + 1), see set_confusion()
+};
+
+// One histogram filter over a map. Contexts share nothing but their (read-only) map.
+struct loc_context {
+    const struct loc_map *m;
+    struct loc_params p;
+    struct transition_table motion[2][4];   // Motion model, [1 if bounced off the red border][last action]
+    double *beliefs;            // Beliefs for each location and motion direction, index with STATE()
+    double *last_beliefs;       // Second belief buffer, swaps roles with beliefs[] on every prediction step
+    int redflag;                // 1 if the robot bounced off the red border on its way to the current intersection
+    int rbt_x, rbt_y, rbt_dir;  // Pose found by robot_localization(), -1 if not localized
+    int log_beliefs;            // 1 if beliefs[] holds unnormalized log-probabilities
+    double belief_log_max;      // Largest log-belief, tracked to decide when to renormalize in log-belief mode
+    struct belief_stats summary;    // Best / runner-up states and entropy of beliefs[] as of its last normalization
+    int verbose;                // 0 silences the per-scan messages of robot_localization()
+    int sparse_mode;            // 1 while only the top SPARSE_K states are tracked (see sparse_update())
+    int n_active;               // Number of states in the top-K set
+    int *active_states;         // The top-K set, beliefs[] is zero everywhere else in top-K mode
+    int *touched_states;        // Scratch for sparse_update(): states reached by the prediction,
+    double *sparse_acc;         //  their accumulated beliefs (kept all zero between updates)
+    unsigned char *sparse_mark; //  and a flag marking them as already listed
+    int n_window;               // Scans in the relocalization window, oldest first (up to RELOC_WINDOW):
+    int window_sig[RELOC_WINDOW];   //  signature read,
+    int window_act[RELOC_WINDOW];   //  action taken to get there
+    int window_flag[RELOC_WINDOW];  //  and whether it bounced off the red border
+    int hist_len;               // Scans in the history ring (up to HISTORY_LEN), see smooth_beliefs() and
+    int hist_head;              //  viterbi_path(). Slot of the newest scan, and for each slot:
+    int hist_act[HISTORY_LEN];  //  action taken to get there,
+    int hist_flag[HISTORY_LEN]; //  whether it bounced off the red border,
+    double hist_lik[HISTORY_LEN][256];  //  sensing likelihood of every map signature for the scan,
+    int hist_sparse[HISTORY_LEN];   //  number of states kept if in top-K mode (0 if it kept the whole grid),
+    int *hist_states;           //  which states those are (SPARSE_K values per slot),
+    double *hist_filtered;      //  the filtered beliefs after the scan (N_STATES() values, linear, or one per state
+                                //  kept),
+    int *viterbi_back;          //  and the best predecessor of every (kept) state (N_STATES() values)
+    double *viterbi;            // Log-score of the most likely path ending in each (kept) state, shifted so the best
+                                //  is 0. Indexed like the newest slot of the history ring.
+    double *viterbi_tmp;        // Second Viterbi buffer
+    double *history_tmp;        // Scratch for smooth_beliefs(), 2 * N_STATES() values
+    double *plan_scratch;       // Scratch for plan_exploration(), 9 * N_STATES() values, allocated on first use
+    int expected_state;         // State the robot should reach at its next scan if its fix is right, -1 if none
+    double match_score;         // Running average of the fraction of corners that matched the expected states
+    double scan_evidence;       // log P(last scan | the scans before it), the normalizer of the last update: how
+                                //  well this context's map explains the scan (see multi_update())
+    double pair_lik[49][16];    // Confusion model likelihood of two adjacent corners read as colours (a, b) (index
+                                //  7 * a + b, colour - 1 or 6 if not read) given their 4-bit map signature
+};
+
+// Result of the offline map analysis (see EV3_Ambiguity.c), loaded with load_ambiguity()
+struct loc_ambiguity {
+    int n;                      // N_STATES() of the map, 0 if nothing is loaded
+    int *scans;                 // Scans to localize from each start state, -1 never, -2 more than the analysis looked at
+    int *cls;                   // States with the same class read the same for every sequence of moves
+    int *cls_size;              // Number of states in each class
+    int worst;                  // Largest number of scans any localizable start state needs
+    int never;                  // Number of states another state is indistinguishable from
+};
+
+// A map image loaded by load_ppm(): rx * ry pixels, 3 bytes (R, G, B) each, in row-major order
+struct ppm_image {
+    int rx, ry;
+    const unsigned char *rgb;   // The pixels, read-only
+    void *mapping;              // The mapped file, if rgb points into it (NULL otherwise)
+    size_t map_size;
+    unsigned char *owned;       // The converted pixels, if the file was not 8-bit P6 (NULL otherwise)
+};
+
+extern int step_x[4];
+extern int step_y[4];
+
+int parse_map(struct loc_map *m, const unsigned char *map_img, int rx, int ry);
+
+void free_loc_map(struct loc_map *m);
+
+unsigned long long map_hash(const struct loc_map *m);
+
+void default_params(struct loc_params *p);
+
+int init_context(struct loc_context *ctx, const struct loc_map *m, const struct loc_params *p);
+
+void free_context(struct loc_context *ctx);
+
+int set_params(struct loc_context *ctx, const struct loc_params *p);
+
+void free_transition_tables(struct loc_context *ctx);
+
+int build_transition_tables(struct loc_context *ctx);
+
+struct motion_weights action_weights(const struct loc_params *p, int bounced, int act);
+
+int load_motion_params(const char *filename, struct loc_params *p);
+
+int write_motion_params(const char *filename, const struct loc_params *p);
+
+int colour_code(int colour);
+
+int pack_signature(const int reading[4]);
+
+void reading_likelihoods(const int reading[4], double corner_lik[4][3]);
+
+int certain_signature(const double corner_lik[4][3]);
+
+int build_signature_index(struct loc_map *m);
+
+int exact_move(const struct loc_map *m, int s, int act, int *bounced);
+
+unsigned long long sequence_key(int n, const int *sig, const int *act, const int *flag);
+
+int build_sequence_index(struct loc_map *m);
+
+int lookup_sequence(const struct loc_map *m, unsigned long long key, const int **states);
+
+int route_distances(const struct loc_map *m, int target, double *dist);
+
+int route_action(const struct loc_map *m, const double *dist, int s);
+
+int compile_runs(struct transition_table *T);
+
+int transpose_table(struct transition_table *T);
+
+double apply_transition(const struct transition_table *T, const double *in, double *out);
+
+double apply_transition_log(const struct transition_table *T, const double *in, double *out);
+
+void update_beliefs(struct loc_context *ctx, int last_act, const int intersection_reading[4]);
+
+void update_beliefs_soft(struct loc_context *ctx, int last_act, const double corner_lik[4][3]);
+
+void scan_likelihoods(const struct loc_context *ctx, const int reading[4], double lik[256]);
+
+int read_confusion_counts(const char *filename, double counts[N_COLOURS][N_COLOURS]);
+
+int write_confusion_counts(const char *filename, const double counts[N_COLOURS][N_COLOURS]);
+
+void set_confusion(struct loc_params *p, const double counts[N_COLOURS][N_COLOURS]);
+
+void uniform_beliefs(struct loc_context *ctx);
+
+void normalize_beliefs(struct loc_context *ctx);
+
+void print_belief_grid(const struct loc_context *ctx);
+
+int select_top_k(const int *cand, int m, const double *val, int k, int *top);
+
+void enter_sparse_mode(struct loc_context *ctx);
+
+void leave_sparse_mode(struct loc_context *ctx);
+
+int sparse_update(struct loc_context *ctx, int last_act, const double *lik);
+
+int robot_localization(struct loc_context *ctx);
+
+void expect_move(struct loc_context *ctx, int act);
+
+int check_expected(struct loc_context *ctx, const int reading[4]);
+
+void partial_reset(struct loc_context *ctx, const int reading[4]);
+
+int smooth_beliefs(struct loc_context *ctx, int lag, double *out);
+
+int viterbi_path(const struct loc_context *ctx, int *path);
+
+double expected_gain(const struct loc_context *ctx, const double *b, int act, double *pred, double *tmp);
+
+int plan_exploration(struct loc_context *ctx);
+
+int relocalize(struct loc_context *ctx);
+
+int load_ambiguity(const char *filename, const struct loc_map *m, struct loc_ambiguity *amb);
+
+void free_ambiguity(struct loc_ambiguity *amb);
+
+int ambiguity_stalled(const struct loc_context *ctx, const struct loc_ambiguity *amb);
+
+int load_ppm(const char *filename, struct ppm_image *img);
+
+void free_ppm(struct ppm_image *img);
+
+unsigned char *readPPMimage(const char *filename, int *rx, int *ry);
+
+#endif
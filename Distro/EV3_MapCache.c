@@ -0,0 +1,186 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Compiled map cache, see EV3_MapCache.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "EV3_MapCache.h"
+
+#define HASH_PRIME 1099511628211ULL
+
+/*!
+ * Size of a cache file with the given header, 0 if the header makes no sense
+ */
+static size_t cache_size(const struct map_cache_header *h) {
+    size_t n;
+
+    if (h->sx <= 0 || h->sy <= 0 || h->seq_cap <= 0 || h->n_seq_states < 0) return (0);
+    n = (size_t) h->sx * h->sy * 4;
+    return (sizeof(struct map_cache_header) + ((size_t) h->seq_cap * sizeof(unsigned long long)) +
+            (n * sizeof(int)) + (257 * sizeof(int)) + (n * sizeof(int)) + (2 * (size_t) h->seq_cap * sizeof(int)) +
+            ((size_t) h->n_seq_states * sizeof(int)) + (2 * n * sizeof(int)) + n);
+}
+
+/*!
+ * 64-bit hash of an image's size and pixels. Four lanes take 8 bytes each per step, (h ^ word) * prime followed by
+ * an xor-shift, so the multiplies of one step overlap; the lanes are folded together at the end. Every step is
+ * invertible, so changing any single 8-byte word of the image always changes the hash.
+ */
+unsigned long long image_hash(const struct ppm_image *img) {
+    unsigned long long h[4] = {14695981039346656037ULL, 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+                               0x165667b19e3779f9ULL};
+    unsigned long long w, out = 14695981039346656037ULL;
+    const unsigned char *p = img->rgb;
+    size_t n = (size_t) img->rx * img->ry * 3, k = 0;
+
+    for (; k + 32 <= n; k += 32) {
+        for (int l = 0; l < 4; l++) {
+            memcpy(&w, p + k + (8 * l), sizeof(w));
+            h[l] = (h[l] ^ w) * HASH_PRIME;
+            h[l] ^= h[l] >> 29;
+        }
+    }
+    for (; k < n; k++) h[0] = (h[0] ^ p[k]) * HASH_PRIME;
+    h[1] ^= (unsigned long long) img->rx;
+    h[2] ^= (unsigned long long) img->ry << 32;
+    for (int l = 0; l < 4; l++) {
+        out = (out ^ h[l]) * HASH_PRIME;
+        out ^= out >> 29;
+    }
+    return (out);
+}
+
+/*!
+ * Maps a compiled map and points m's arrays into it (m is freed first). The file must be for an image with the given
+ * hash and built with this RELOC_WINDOW.
+ * @return int, 1 success 0 fail (missing, stale or damaged file, m is left empty)
+ */
+int map_cache_read(const char *filename, unsigned long long hash, struct loc_map *m) {
+    const struct map_cache_header *h;
+    struct stat st;
+    unsigned char *p;
+    void *map;
+    int fd, n;
+
+    free_loc_map(m);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return (0);
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct map_cache_header) ||
+        (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return (0);
+    }
+    close(fd);
+    h = (const struct map_cache_header *) map;
+    if (h->magic != MAP_CACHE_MAGIC || h->version != MAP_CACHE_VERSION || h->image_hash != hash ||
+        h->reloc_window != RELOC_WINDOW || cache_size(h) != (size_t) st.st_size) {
+        munmap(map, (size_t) st.st_size);
+        return (0);
+    }
+
+    m->sx = h->sx;
+    m->sy = h->sy;
+    m->seq_cap = h->seq_cap;
+    n = N_STATES(m);
+    p = (unsigned char *) map + sizeof(struct map_cache_header);
+    m->seq_keys = (unsigned long long *) p;
+    p += (size_t) h->seq_cap * sizeof(unsigned long long);
+    m->map = (int (*)[4]) p;
+    p += (size_t) n * sizeof(int);
+    memcpy(m->sig_start, p, sizeof(m->sig_start));
+    p += sizeof(m->sig_start);
+    m->sig_states = (int *) p;
+    p += (size_t) n * sizeof(int);
+    m->seq_start = (int *) p;
+    p += (size_t) h->seq_cap * sizeof(int);
+    m->seq_count = (int *) p;
+    p += (size_t) h->seq_cap * sizeof(int);
+    m->seq_states = (int *) p;
+    p += (size_t) h->n_seq_states * sizeof(int);
+    m->street = (int (*)[4]) p;
+    p += (size_t) n * sizeof(int);
+    m->street_len = (int (*)[4]) p;
+    p += (size_t) n * sizeof(int);
+    m->map_sig = p;
+    m->cache = map;
+    m->cache_size = (size_t) st.st_size;
+    return (1);
+}
+
+/*!
+ * Writes the compiled form of m, parsed from an image with the given hash. The file is written under a temporary
+ * name and renamed into place, so a run that stops halfway never leaves a damaged cache behind.
+ * @return int, 1 success 0 fail
+ */
+int map_cache_write(const char *filename, unsigned long long hash, const struct loc_map *m) {
+    struct map_cache_header h;
+    char tmp_name[1100];
+    size_t n = (size_t) N_STATES(m);
+    FILE *f;
+    int ok;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = MAP_CACHE_MAGIC;
+    h.version = MAP_CACHE_VERSION;
+    h.image_hash = hash;
+    h.reloc_window = RELOC_WINDOW;
+    h.sx = m->sx;
+    h.sy = m->sy;
+    h.seq_cap = m->seq_cap;
+    h.n_seq_states = (int32_t) (n << (2 * (RELOC_WINDOW - 1)));
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+    f = fopen(tmp_name, "wb");
+    if (f == NULL) return (0);
+    ok = (fwrite(&h, sizeof(h), 1, f) == 1 &&
+          fwrite(m->seq_keys, sizeof(unsigned long long), m->seq_cap, f) == (size_t) m->seq_cap &&
+          fwrite(m->map, sizeof(int), n, f) == n &&
+          fwrite(m->sig_start, sizeof(m->sig_start), 1, f) == 1 &&
+          fwrite(m->sig_states, sizeof(int), n, f) == n &&
+          fwrite(m->seq_start, sizeof(int), m->seq_cap, f) == (size_t) m->seq_cap &&
+          fwrite(m->seq_count, sizeof(int), m->seq_cap, f) == (size_t) m->seq_cap &&
+          fwrite(m->seq_states, sizeof(int), h.n_seq_states, f) == (size_t) h.n_seq_states &&
+          fwrite(m->street, sizeof(int), n, f) == n &&
+          fwrite(m->street_len, sizeof(int), n, f) == n &&
+          fwrite(m->map_sig, 1, n, f) == n);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_name, filename) != 0) {
+        remove(tmp_name);
+        return (0);
+    }
+    return (1);
+}
+
+/*!
+ * Loads the map in a .ppm image, from its compiled cache (filename + MAP_CACHE_SUFFIX) if that was built from the
+ * same pixels, otherwise with parse_map(), after which the cache is written for next time.
+ * @return int, 1 success 0 fail
+ */
+int load_map(const char *filename, struct loc_map *m) {
+    struct ppm_image img;
+    char cache_name[1100];
+    unsigned long long hash;
+    int ok;
+
+    if (load_ppm(filename, &img) == 0) return (0);
+    hash = image_hash(&img);
+    snprintf(cache_name, sizeof(cache_name), "%s%s", filename, MAP_CACHE_SUFFIX);
+    if (map_cache_read(cache_name, hash, m)) {
+        free_ppm(&img);
+        fprintf(stderr, "Loaded the compiled map %s (%d x %d)\n", cache_name, m->sx, m->sy);
+        return (1);
+    }
+    ok = parse_map(m, img.rgb, img.rx, img.ry);
+    free_ppm(&img);
+    if (ok && map_cache_write(cache_name, hash, m)) fprintf(stderr, "Wrote the compiled map %s\n", cache_name);
+    return (ok);
+}
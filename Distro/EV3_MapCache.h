@@ -0,0 +1,60 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Compiled map cache. parse_map() walks the image, prints every intersection and then builds the signature and
+scan-sequence indices, which for a large map takes far longer than anything else at startup. load_map() keeps the
+result in map_name.cmap next to the image, keyed by a hash of the image's pixels, and on the next start maps that file
+read-only and points the struct loc_map straight into it instead of parsing. Editing (or replacing) the image changes
+the hash, and the cache is rebuilt.
+
+ The transition tables are not cached: they depend on the model weights of each context, not on the map alone.
+
+ File layout (host byte order), every array directly after the previous one:
+
+   struct map_cache_header
+   unsigned long long seq_keys[seq_cap]
+   int map[sx * sy][4]
+   int sig_start[257]
+   int sig_states[N_STATES()]
+   int seq_start[seq_cap]
+   int seq_count[seq_cap]
+   int seq_states[n_seq_states]
+   int street[sx * sy][4]
+   int street_len[sx * sy][4]
+   unsigned char map_sig[N_STATES()]
+
+*/
+
+#ifndef __mapcache_header
+#define __mapcache_header
+
+#include <stdint.h>
+#include "EV3_Localization_Core.h"
+
+#define MAP_CACHE_MAGIC 0x50414d43      // "CMAP" on disk
+// Bumped whenever the layout or parse_map()'s output changes: 2 added the street graph, 3 dropped the intersection
+// geometry, 4 finds intersections by labelling yellow components and samples buildings beside them
+#define MAP_CACHE_VERSION 4
+#define MAP_CACHE_SUFFIX ".cmap"        // map_name.cmap holds the compiled map_name
+
+struct map_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t image_hash;    // image_hash() of the pixels the map was parsed from
+    int32_t reloc_window;   // RELOC_WINDOW the scan-sequence index was built for
+    int32_t sx, sy;
+    int32_t seq_cap;
+    int32_t n_seq_states;
+    int32_t unused;         // Keeps the header a multiple of 8 bytes, so seq_keys[] is aligned
+};
+
+unsigned long long image_hash(const struct ppm_image *img);
+
+int map_cache_read(const char *filename, unsigned long long hash, struct loc_map *m);
+
+int map_cache_write(const char *filename, unsigned long long hash, const struct loc_map *m);
+
+int load_map(const char *filename, struct loc_map *m);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Localization over several candidate maps, see EV3_MultiMap.h.
+
+*/
+
+#include <string.h>
+#include "EV3_MultiMap.h"
+#include "EV3_ThreadPool.h"
+
+// One scan for the workers, each task updates the context of one map
+struct multi_job {
+    struct multi_loc *ml;
+    int last_act;
+    int redflag;
+    const int *reading;
+};
+
+/*!
+ * Sets up one context per map, all with the same model weights, and uniform beliefs over maps and poses.
+ * @return int, 1 success 0 fail (out of memory, or n_maps not in 1..MAX_MAPS)
+ */
+int init_multi(struct multi_loc *ml, const struct loc_map *maps, int n_maps, const struct loc_params *p,
+               int n_workers) {
+    memset(ml, 0, sizeof(*ml));
+    if (n_maps < 1 || n_maps > MAX_MAPS) return (0);
+    ml->ctx = (struct loc_context *) calloc(n_maps, sizeof(struct loc_context));
+    ml->log_weight = (double *) calloc(n_maps, sizeof(double));
+    if (ml->ctx == NULL || ml->log_weight == NULL) {
+        free_multi(ml);
+        return (0);
+    }
+    ml->maps = maps;
+    ml->n_workers = (n_workers < 1) ? 1 : n_workers;
+    ml->verbose = 1;
+    for (int k = 0; k < n_maps; k++) {
+        if (init_context(&ml->ctx[k], &maps[k], p) == 0) {
+            free_multi(ml);
+            return (0);
+        }
+        ml->ctx[k].verbose = 0;
+        ml->n_maps++;
+    }
+    multi_uniform(ml);
+    return (1);
+}
+
+void free_multi(struct multi_loc *ml) {
+    for (int k = 0; k < ml->n_maps; k++) free_context(&ml->ctx[k]);
+    free(ml->ctx);
+    free(ml->log_weight);
+    memset(ml, 0, sizeof(*ml));
+}
+
+/*!
+ * Uniform beliefs on every map, and every map equally likely
+ */
+void multi_uniform(struct multi_loc *ml) {
+    for (int k = 0; k < ml->n_maps; k++) {
+        uniform_beliefs(&ml->ctx[k]);
+        ml->log_weight[k] = -log((double) ml->n_maps);
+    }
+    ml->best_map = 0;
+    ml->best = ml->second = 0;
+}
+
+static void multi_task(int task, int worker, void *arg) {
+    struct multi_job *job = (struct multi_job *) arg;
+    struct loc_context *ctx = &job->ml->ctx[task];
+
+    (void) worker;
+    ctx->redflag = job->redflag;
+    update_beliefs(ctx, job->last_act, job->reading);
+}
+
+/*!
+ * Runs update_beliefs() on the context of every map in parallel, then reweighs the maps by how well each explained
+ * the scan: log_weight[k] += scan_evidence, renormalized with a log-sum-exp over the maps.
+ */
+void multi_update(struct multi_loc *ml, int last_act, int redflag, const int reading[4]) {
+    struct multi_job job;
+    double mx = -INFINITY, C = 0;
+
+    job.ml = ml;
+    job.last_act = last_act;
+    job.redflag = redflag;
+    job.reading = reading;
+    parallel_for(ml->n_maps, ml->n_workers, multi_task, &job);
+
+    for (int k = 0; k < ml->n_maps; k++) {
+        ml->log_weight[k] += ml->ctx[k].scan_evidence;
+        if (ml->log_weight[k] > mx) mx = ml->log_weight[k];
+    }
+    for (int k = 0; k < ml->n_maps; k++) C += exp(ml->log_weight[k] - mx);
+    for (int k = 0; k < ml->n_maps; k++) ml->log_weight[k] -= mx + log(C);
+}
+
+/*!
+ * Finds the likeliest map-and-pose from the best and runner-up states each context keeps in its summary, and commits
+ * to it if it is MAP_RATIO times likelier than the runner-up over all maps. The pose on the chosen map is then in
+ * that context's rbt_x, rbt_y and rbt_dir (see robot_localization()).
+ * @return int, index of the map the robot is on, -1 if no map-and-pose dominates yet
+ */
+int multi_localization(struct multi_loc *ml) {
+    struct loc_context *ctx;
+    double w, best = 0, second = 0;
+    int best_map = 0;
+
+    for (int k = 0; k < ml->n_maps; k++) {
+        ctx = &ml->ctx[k];
+        if (ctx->log_beliefs) normalize_beliefs(ctx);
+        w = exp(ml->log_weight[k]);
+        if (w * ctx->summary.max > best) {
+            second = (best > w * ctx->summary.second) ? best : w * ctx->summary.second;
+            best = w * ctx->summary.max;
+            best_map = k;
+        } else if (w * ctx->summary.max > second) {
+            second = w * ctx->summary.max;
+        }
+    }
+    ml->best_map = best_map;
+    ml->best = best;
+    ml->second = second;
+
+    if (ml->verbose) {
+        printf("Map weights:");
+        for (int k = 0; k < ml->n_maps; k++) printf(" %.3f", exp(ml->log_weight[k]));
+        printf(", best is map %d at %f, runner-up %f\n", best_map, best, second);
+    }
+    if (best <= 0 || best < MAP_RATIO * second) return (-1);
+    if (robot_localization(&ml->ctx[best_map]) < 0) return (-1);
+    return (best_map);
+}
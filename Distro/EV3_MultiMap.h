@@ -0,0 +1,46 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Localization over several candidate maps, for when it is not known which printed map the robot was put on. Each map
+gets its own context (and belief grid); every scan updates all of them on the thread pool, one map per task. The
+normalizer of each update is how likely that map made the scan (loc_context.scan_evidence), so summing them gives the
+log-probability of the whole run under each map, and from there the posterior over maps. The joint belief that the
+robot is on map k in state s is P(map k) * beliefs_k[s].
+
+ The run commits to a map once its best state is MAP_RATIO times likelier, jointly, than the runner-up on any map.
+
+*/
+
+#ifndef __multimap_header
+#define __multimap_header
+
+#include "EV3_Localization_Core.h"
+
+#define MAX_MAPS 8          // Largest number of candidate maps
+#define MAP_RATIO 2.0       // The best map-and-pose must be this many times likelier than any other to commit
+
+struct multi_loc {
+    int n_maps;
+    const struct loc_map *maps;     // The candidate maps (owned by the caller)
+    struct loc_context *ctx;        // One context per map
+    double *log_weight;     // log P(map | scans so far), normalized over the maps
+    int n_workers;          // Threads for multi_update()
+    int best_map;           // Map holding the likeliest map-and-pose after the last update
+    double best;            // Joint probability of that map-and-pose,
+    double second;          //  and of the runner-up over all maps
+    int verbose;            // 0 silences the per-scan messages of multi_localization()
+};
+
+int init_multi(struct multi_loc *ml, const struct loc_map *maps, int n_maps, const struct loc_params *p,
+               int n_workers);
+
+void free_multi(struct multi_loc *ml);
+
+void multi_uniform(struct multi_loc *ml);
+
+void multi_update(struct multi_loc *ml, int last_act, int redflag, const int reading[4]);
+
+int multi_localization(struct multi_loc *ml);
+
+#endif
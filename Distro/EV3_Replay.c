@@ -0,0 +1,967 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Offline replay of recorded scan logs through the localization core, for tuning the sensing and motion weights
+without driving the robot. It links the localization core, kernels, thread pool and EV3_MultiMap.c (no bluetooth).
+
+ Usage:
+
+   EV3_Replay [-p hit miss move drift stay] [-c confusion_file] [-m motion_file] [-v] [-k] [-a other_map ...]
+              map_name log_file
+      Replays log_file and reports how quickly and how reliably the robot localized in each episode.
+      -p overrides the model weights (defaults P_HIT P_MISS P_MOVE P_DRIFT P_STAY), -c scores scans with the colour
+      confusion counts in confusion_file instead of hit / miss, -m uses the per-action motion weights in motion_file
+      (see load_motion_params()), -v prints one line per episode, -k checks each scan
+      against the expected intersection once localized and resets the beliefs partially when the robot looks lost
+      (check_expected() and partial_reset(), as the robot does). Each -a adds another candidate map: the log is then
+      replayed on all of them at once (see EV3_MultiMap.h) and a claim only counts as right if it picks map_name.
+
+   EV3_Replay -l map_name log_file confusion_file
+      Counts how often each building colour was read as each colour in log_file, from its ground truth, and writes
+      the counts to confusion_file (the format the robot reads, see read_confusion_counts()).
+
+   EV3_Replay -b [-i iterations] [-t threads] [-c confusion_file] [-m motion_file] map_name log_file motion_out
+      Fits the motion weights of each action, with and without a bounce off the red border, to the scans in
+      log_file by Baum-Welch (no ground truth needed), starting from the defaults (or motion_file) and spreading the
+      episodes over all cores (or threads). Writes them to motion_out, the file the robot loads at startup.
+
+   EV3_Replay -g grid_file [-t threads] [-p hit miss move drift stay] [-c confusion_file] [-m motion_file]
+              map_name log_file results_file
+      Sweep: replays log_file once for every combination of the weights listed in grid_file, spread over all cores
+      (or threads), and writes the combinations ranked best first to results_file. Each grid_file line names a
+      weight (hit, miss, move, drift, stay) followed by the values to try; weights not listed keep their default, or
+      the value given with -p. With -m the grid may only list hit and miss.
+
+   EV3_Replay -s [-e] [-k kidnap] [-f fail] [-m motion_file] episodes scans noise seed map_name log_file
+      Writes a simulated log instead: random walks on the map using the motion model, with each building colour
+      misread with probability noise. With -e the robot explores with plan_exploration() until it is localized, as
+      it does on the real map, instead of picking its actions at random. With -k the robot is picked up and put down
+      at a random pose with probability kidnap after each move. With -f each corner reads Black (a failed read) with
+      probability fail. With -m the moves follow the per-action weights in motion_file.
+
+ Log format, one scan per line, '#' starts a comment:
+
+   episode last_act r0 r1 r2 r3 x y dir redflag
+
+   episode   - scans with the same number form one run of the robot, beliefs are reset when it changes
+   last_act  - action taken since the previous scan (0 straight, 1 right, 2 back, 3 left, -1 none)
+   r0..r3    - building colours read, clockwise from the top-left as seen by the robot (same codes as map[][])
+   x y dir   - ground truth intersection and heading at the scan
+   redflag   - 1 if the robot bounced off the red border on its way to this intersection
+
+*/
+
+#include <string.h>
+#include <time.h>
+#include "EV3_Localization_Core.h"
+#include "EV3_ThreadPool.h"
+#include "EV3_MultiMap.h"
+#include "EV3_MapCache.h"
+
+#define REPLAY_LAG 2        // How far back the smoothed and Viterbi poses are checked, less than HISTORY_LEN
+#define EM_ITERATIONS 20    // Default number of Baum-Welch passes for -b
+#define EM_MIN_STEPS 5.0    // A table keeps its weights unless the log holds this many moves for it
+#define EM_MIN_WEIGHT 1e-4  // Smallest fitted weight, so no outcome becomes impossible
+
+struct scan_record {
+    int episode;
+    int act;
+    int reading[4];
+    int x, y, dir;
+    int redflag;
+};
+
+// How one set of weights did over a log
+struct replay_result {
+    struct loc_params p;
+    int episodes;
+    int localized;          // Episodes where the robot was correctly localized at some point,
+    int to_localize;        //  and the total number of scans that took
+    int claims;             // Scans where robot_localization() reported a pose,
+    int wrong;              //  and how many of those were wrong
+    int final_ok;           // Episodes ending with the correct pose
+    int resets;             // Partial resets by the consistency monitor (with -k)
+    int wrong_map;          // Claims on a map other than the log's (with -a)
+    int lagged;             // Scans with REPLAY_LAG newer scans in the same episode, and for how many of them the
+    int lag_filtered;       //  pose REPLAY_LAG scans back was right according to the filter at the time,
+    int lag_smoothed;       //  to smooth_beliefs() given the newer scans
+    int lag_viterbi;        //  and to viterbi_path()
+};
+
+// Shared by the sweep workers, only results[] is written (one entry per task)
+struct sweep_job {
+    const struct loc_map *m;
+    const struct scan_record *rec;
+    int n;
+    struct loc_context *ctx;        // One per worker
+    struct replay_result *results;  // One per weight combination
+};
+
+/*!
+ * Reads a scan log into memory.
+ * @return the records (n_out of them), NULL on failure
+ */
+struct scan_record *read_scan_log(const char *filename, int *n_out) {
+    struct scan_record *rec = NULL, *grown;
+    struct scan_record r;
+    char line[1024];
+    int n = 0, cap = 0, lineno = 0;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open scan log %s\n", filename);
+        return (NULL);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+        if (sscanf(line, "%d %d %d %d %d %d %d %d %d %d", &r.episode, &r.act, &r.reading[0], &r.reading[1],
+                   &r.reading[2], &r.reading[3], &r.x, &r.y, &r.dir, &r.redflag) != 10) {
+            fprintf(stderr, "%s:%d: expected 'episode last_act r0 r1 r2 r3 x y dir redflag'\n", filename, lineno);
+            free(rec);
+            fclose(f);
+            return (NULL);
+        }
+        if (n == cap) {
+            cap = (cap == 0) ? 1024 : cap * 2;
+            grown = (struct scan_record *) realloc(rec, cap * sizeof(struct scan_record));
+            if (grown == NULL) {
+                fprintf(stderr, "Out of memory reading scan log\n");
+                free(rec);
+                fclose(f);
+                return (NULL);
+            }
+            rec = grown;
+        }
+        rec[n++] = r;
+    }
+    fclose(f);
+    *n_out = n;
+    return (rec);
+}
+
+/*!
+ * Draws one outcome of the motion model p for action act from (x, y) facing dir on map m, updating the pose in place.
+ * Moves follow the map's street graph (see build_transition_tables()).
+ * @return 1 if the robot bounced off the red border, 0 otherwise
+ */
+int simulate_move(const struct loc_map *m, const struct loc_params *p, int act, int *x, int *y, int *dir) {
+    double u = rand() / (RAND_MAX + 1.0);
+    int h = (*dir + act) % 4;
+    int c = *x + (*y * m->sx), side = 0, next, bounce;
+    struct motion_weights mw;
+
+    next = m->street[c][h];
+    bounce = (next == STREET_BORDER);
+    mw = action_weights(p, bounce, act);
+    if (u >= mw.move + (2 * mw.drift)) return (0);      // Stayed, with the old heading
+    if (u >= mw.move) side = (u < mw.move + mw.drift) ? 3 : 1;
+
+    if (bounce) {
+        // Hit the red border: turn around, possibly sliding to a neighbour along it
+        next = (side == 0) ? c : m->street[c][(h + side) % 4];
+        if (next >= 0 && m->street[next][h] == STREET_BORDER) c = next;
+        *dir = (h + 2) % 4;
+    } else if (next == STREET_NONE) {
+        // No street that way: the robot turned but had nothing to drive along
+        *dir = h;
+        return (0);
+    } else {
+        if (side != 0) next = m->street[next][(h + side) % 4];
+        if (next < 0) return (0);
+        c = next;
+        *dir = h;
+    }
+    *x = c % m->sx;
+    *y = c / m->sx;
+    return (bounce);
+}
+
+/*!
+ * Writes a simulated scan log: episodes random walks of scans intersections each on map m. If explore is not NULL
+ * the walk is steered by plan_exploration() on that context while the robot is not localized. After each move the
+ * robot is put down at a random pose with probability kidnap, and each corner fails to read with probability fail.
+ * @return int, 1 success 0 fail
+ */
+int simulate_log(const char *filename, const struct loc_map *m, const struct loc_params *p, int episodes, int scans,
+                 double noise, double kidnap, double fail, struct loc_context *explore) {
+    int colours[3] = {2, 3, 6};
+    int x, y, dir, act, rf, r[4], c;
+    FILE *f;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create scan log %s\n", filename);
+        return (0);
+    }
+    fprintf(f, "# episode last_act r0 r1 r2 r3 x y dir redflag\n");
+    for (int e = 0; e < episodes; e++) {
+        x = rand() % m->sx;
+        y = rand() % m->sy;
+        dir = rand() % 4;
+        act = -1;
+        rf = 0;
+        if (explore != NULL) uniform_beliefs(explore);
+        for (int s = 0; s < scans; s++) {
+            if (s > 0 && rand() / (RAND_MAX + 1.0) < kidnap) {
+                x = rand() % m->sx;
+                y = rand() % m->sy;
+                dir = rand() % 4;
+            }
+            for (int k = 0; k < 4; k++) {
+                r[k] = m->map[x + (y * m->sx)][(k + dir) % 4];
+                if (rand() / (RAND_MAX + 1.0) < noise) {
+                    // Misread as one of the other two building colours
+                    do c = colours[rand() % 3]; while (c == r[k]);
+                    r[k] = c;
+                }
+                if (rand() / (RAND_MAX + 1.0) < fail) r[k] = 1;
+            }
+            fprintf(f, "%d %d %d %d %d %d %d %d %d %d\n", e, act, r[0], r[1], r[2], r[3], x, y, dir, rf);
+            if (explore != NULL) {
+                explore->redflag = rf;
+                update_beliefs(explore, act, r);
+                if (robot_localization(explore) < 0) {
+                    act = plan_exploration(explore);
+                    rf = simulate_move(m, p, act, &x, &y, &dir);
+                    continue;
+                }
+            }
+            // Mostly straight ahead, like the robot does while heading for its target
+            act = (rand() % 3 == 0) ? rand() % 4 : 0;
+            rf = simulate_move(m, p, act, &x, &y, &dir);
+        }
+    }
+    fclose(f);
+    return (1);
+}
+
+/*!
+ * Runs the n records of a log through the filter in ctx, which is left holding the last episode's beliefs.
+ * @param verbose 1 prints one line per episode
+ * @param monitor 1 runs the consistency monitor between scans like the robot does
+ */
+void replay_log(struct loc_context *ctx, const struct scan_record *rec, int n, int verbose, int monitor,
+                struct replay_result *res) {
+    int step = 0, first = -1, last_ok = 0, found, truth, b, len, j, lost = 0;
+    int filtered[REPLAY_LAG + 1];       // Filter's best state for the last few scans, by step % (REPLAY_LAG + 1)
+    int path[HISTORY_LEN];
+    double *smoothed;
+
+    smoothed = (double *) calloc(N_STATES(ctx->m), sizeof(double));
+
+    memset(res, 0, sizeof(*res));
+    res->p = ctx->p;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || rec[i].episode != rec[i - 1].episode) {
+            uniform_beliefs(ctx);
+            res->episodes++;
+            step = 0;
+            first = -1;
+        }
+        ctx->redflag = rec[i].redflag;
+        if (monitor) lost = check_expected(ctx, rec[i].reading);
+        update_beliefs(ctx, rec[i].act, rec[i].reading);
+        if (lost) {
+            partial_reset(ctx, rec[i].reading);
+            res->resets++;
+        }
+        found = robot_localization(ctx);
+        // The robot knows the action it is about to take, the log has it on the next scan
+        if (monitor && found >= 0 && i + 1 < n && rec[i + 1].episode == rec[i].episode) {
+            expect_move(ctx, rec[i + 1].act);
+        }
+        step++;
+        last_ok = (found >= 0 && ctx->rbt_x == rec[i].x && ctx->rbt_y == rec[i].y && ctx->rbt_dir == rec[i].dir);
+
+        // How well the pose REPLAY_LAG scans back is known now, against what the filter thought at the time
+        filtered[step % (REPLAY_LAG + 1)] = ctx->summary.best;
+        if (step > REPLAY_LAG && ctx->hist_len > REPLAY_LAG && smoothed != NULL) {
+            j = i - REPLAY_LAG;
+            truth = STATE(ctx->m, rec[j].x + (rec[j].y * ctx->m->sx), rec[j].dir);
+            res->lagged++;
+            res->lag_filtered += (filtered[(step - REPLAY_LAG) % (REPLAY_LAG + 1)] == truth);
+            if (smooth_beliefs(ctx, REPLAY_LAG, smoothed)) {
+                b = 0;
+                for (int s = 1; s < N_STATES(ctx->m); s++) if (smoothed[s] > smoothed[b]) b = s;
+                res->lag_smoothed += (b == truth);
+            }
+            len = viterbi_path(ctx, path);
+            res->lag_viterbi += (len > REPLAY_LAG && path[len - 1 - REPLAY_LAG] == truth);
+        }
+        if (found >= 0) {
+            res->claims++;
+            if (!last_ok) res->wrong++;
+            else if (first < 0) first = step;
+        }
+        if (i == n - 1 || rec[i + 1].episode != rec[i].episode) {
+            if (first > 0) {
+                res->localized++;
+                res->to_localize += first;
+            }
+            res->final_ok += last_ok;
+            if (verbose) {
+                printf("episode %d: %d scans, %s", rec[i].episode, step, last_ok ? "correct at the end" : "not localized");
+                if (first > 0) printf(", first correct after %d scans", first);
+                printf("\n");
+            }
+        }
+    }
+    free(smoothed);
+}
+
+/*!
+ * Runs the n records of a log through the filters of every candidate map in ml. The log was recorded on maps[0], a
+ * claim is right only if it names that map and the logged pose.
+ * @param verbose 1 prints one line per episode
+ */
+void replay_multi(struct multi_loc *ml, const struct scan_record *rec, int n, int verbose, struct replay_result *res) {
+    struct loc_context *ctx;
+    int step = 0, first = -1, last_ok = 0, found = -1;
+
+    memset(res, 0, sizeof(*res));
+    res->p = ml->ctx[0].p;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || rec[i].episode != rec[i - 1].episode) {
+            multi_uniform(ml);
+            res->episodes++;
+            step = 0;
+            first = -1;
+        }
+        multi_update(ml, rec[i].act, rec[i].redflag, rec[i].reading);
+        found = multi_localization(ml);
+        step++;
+        ctx = &ml->ctx[0];
+        last_ok = (found == 0 && ctx->rbt_x == rec[i].x && ctx->rbt_y == rec[i].y && ctx->rbt_dir == rec[i].dir);
+        if (found >= 0) {
+            res->claims++;
+            res->wrong_map += (found != 0);
+            if (!last_ok) res->wrong++;
+            else if (first < 0) first = step;
+        }
+        if (i == n - 1 || rec[i + 1].episode != rec[i].episode) {
+            if (first > 0) {
+                res->localized++;
+                res->to_localize += first;
+            }
+            res->final_ok += last_ok;
+            if (verbose) {
+                printf("episode %d: %d scans, %s", rec[i].episode, step,
+                       last_ok ? "correct at the end" : (found > 0 ? "on the wrong map" : "not localized"));
+                if (first > 0) printf(", first correct after %d scans", first);
+                printf("\n");
+            }
+        }
+    }
+}
+
+/*!
+ * Adds to counts how often each building colour in the n records of a log was read as each colour, using the ground
+ * truth pose of each scan
+ */
+void learn_confusion(const struct loc_map *m, const struct scan_record *rec, int n,
+                     double counts[N_COLOURS][N_COLOURS]) {
+    int truth, read;
+
+    for (int i = 0; i < n; i++) {
+        if (rec[i].x < 0 || rec[i].x >= m->sx || rec[i].y < 0 || rec[i].y >= m->sy) continue;
+        for (int k = 0; k < 4; k++) {
+            truth = m->map[rec[i].x + (rec[i].y * m->sx)][(k + rec[i].dir) % 4];
+            read = rec[i].reading[k];
+            if (truth >= 1 && truth <= N_COLOURS && read >= 1 && read <= N_COLOURS) counts[truth - 1][read - 1]++;
+        }
+    }
+}
+
+// Expected outcome counts of one Baum-Welch pass, by [bounced][last action]
+struct em_counts {
+    double kind[2][4][3];   // Moves that went each way (MOVE_ENTRY, DRIFT_ENTRY, STAY_ENTRY)
+    double steps[2][4];     // All moves
+    double loglik;          // Log-likelihood of the scans under the current weights
+};
+
+// Shared by the Baum-Welch workers, each writes only its own counts[] and scratch
+struct em_job {
+    const struct loc_context *ctx;      // Read only, holds the current weights
+    const struct scan_record *rec;
+    const int *ep_start;                // Records of episode e are ep_start[e] up to ep_start[e + 1] - 1
+    int max_len;                        // Longest episode
+    double **alpha;                     // Per worker: max_len * N_STATES() scaled forward beliefs,
+    double **lik;                       //  max_len * 256 scan likelihoods,
+    double **scale;                     //  max_len normalizers of the forward pass,
+    double **beta;                      //  and 2 * N_STATES() for the backward pass
+    struct em_counts *counts;           // Per worker
+};
+
+/*!
+ * Baum-Welch task: forward-backward over one episode with the weights in job->ctx, adding the expected number of
+ * moves of each kind to the worker's counts. Both passes are scaled by the per-scan normalizers c[t], so the
+ * expected transitions of each move sum to 1.
+ */
+void em_task(int task, int worker, void *arg) {
+    struct em_job *job = (struct em_job *) arg;
+    const struct loc_context *ctx = job->ctx;
+    const struct loc_map *m = ctx->m;
+    const struct scan_record *rec = job->rec + job->ep_start[task];
+    const struct transition_table *T;
+    struct em_counts *cnt = &job->counts[worker];
+    int len = job->ep_start[task + 1] - job->ep_start[task];
+    int n = N_STATES(m);
+    double *alpha = job->alpha[worker], *lik = job->lik[worker];
+    double *beta = job->beta[worker], *tmp = job->beta[worker] + n;
+    double *c = job->scale[worker];
+    double *a, *a0, *L, xi;
+    int r, act;
+
+    // Forward
+    for (int t = 0; t < len; t++) {
+        a = alpha + ((size_t) t * n);
+        L = lik + (256 * t);
+        scan_likelihoods(ctx, rec[t].reading, L);
+        act = rec[t].act;
+        if (t == 0) {
+            for (int s = 0; s < n; s++) a[s] = 1.0 / (double) n;
+        } else if (act >= 0 && act <= 3) {
+            apply_transition(&ctx->motion[rec[t].redflag ? 1 : 0][act], a - n, a);
+        } else {
+            memcpy(a, a - n, n * sizeof(double));
+        }
+        c[t] = 0;
+        for (int s = 0; s < n; s++) c[t] += (a[s] *= L[m->map_sig[s]]);
+        for (int s = 0; s < n; s++) a[s] /= c[t];
+        cnt->loglik += log(c[t]);
+    }
+
+    // Backward, collecting the expected transitions of the move into scan t on the way
+    for (int s = 0; s < n; s++) beta[s] = 1.0;
+    for (int t = len - 1; t > 0; t--) {
+        L = lik + (256 * t);
+        a0 = alpha + ((size_t) (t - 1) * n);
+        act = rec[t].act;
+        for (int s = 0; s < n; s++) tmp[s] = L[m->map_sig[s]] * beta[s] / c[t];
+        if (act < 0 || act > 3) {
+            memcpy(beta, tmp, n * sizeof(double));
+            continue;
+        }
+        r = rec[t].redflag ? 1 : 0;
+        T = &ctx->motion[r][act];
+        for (int s = 0; s < n; s++) {
+            for (int k = T->start[s]; k < T->start[s + 1]; k++) {
+                xi = a0[T->src[k]] * T->w[k] * tmp[s];
+                cnt->kind[r][act][T->kind[k]] += xi;
+                cnt->steps[r][act] += xi;
+            }
+        }
+        for (int s = 0; s < n; s++) {
+            beta[s] = 0;
+            for (int k = T->out_start[s]; k < T->out_start[s + 1]; k++) beta[s] += T->out_w[k] * tmp[T->out_dst[k]];
+        }
+    }
+}
+
+/*!
+ * Fits the motion weights of every table (bounced or not, each action) to the scans of a log with Baum-Welch,
+ * starting from p, running the episodes of each pass in parallel. The sensing model in p is kept as is. A move
+ * either goes ahead (move), to one side (drift, either side) or nowhere (stay), so the new weights are the expected
+ * share of moves of each kind, with drift split over the two sides.
+ * @return int, 1 success 0 fail (p is then unchanged)
+ */
+int fit_motion(const struct loc_map *m, const struct scan_record *rec, int n, struct loc_params *p, int iterations,
+               int n_workers) {
+    struct em_job job;
+    struct em_counts total;
+    struct loc_context ctx;
+    struct loc_params q = *p;
+    int *ep_start, n_ep = 0, used = 0, ok = 1, len;
+    double N, prev = -INFINITY;
+
+    ep_start = (int *) calloc(n + 1, sizeof(int));
+    if (ep_start == NULL || init_context(&ctx, m, &q) == 0) {
+        fprintf(stderr, "Out of memory setting up the fit\n");
+        free(ep_start);
+        return (0);
+    }
+    ctx.verbose = 0;
+    job.max_len = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || rec[i].episode != rec[i - 1].episode) ep_start[n_ep++] = i;
+    }
+    ep_start[n_ep] = n;
+    for (int e = 0; e < n_ep; e++) {
+        len = ep_start[e + 1] - ep_start[e];
+        if (len > job.max_len) job.max_len = len;
+    }
+    if (n_workers > n_ep) n_workers = n_ep;
+    if (n_workers < 1) n_workers = 1;
+    job.ctx = &ctx;
+    job.rec = rec;
+    job.ep_start = ep_start;
+    job.alpha = (double **) calloc(n_workers, sizeof(double *));
+    job.lik = (double **) calloc(n_workers, sizeof(double *));
+    job.scale = (double **) calloc(n_workers, sizeof(double *));
+    job.beta = (double **) calloc(n_workers, sizeof(double *));
+    job.counts = (struct em_counts *) calloc(n_workers, sizeof(struct em_counts));
+    if (job.alpha == NULL || job.lik == NULL || job.scale == NULL || job.beta == NULL || job.counts == NULL) ok = 0;
+    for (int w = 0; ok && w < n_workers; w++) {
+        job.alpha[w] = (double *) calloc((size_t) job.max_len * N_STATES(m), sizeof(double));
+        job.lik[w] = (double *) calloc((size_t) job.max_len * 256, sizeof(double));
+        job.scale[w] = (double *) calloc(job.max_len, sizeof(double));
+        job.beta[w] = (double *) calloc(2 * N_STATES(m), sizeof(double));
+        if (job.alpha[w] == NULL || job.lik[w] == NULL || job.scale[w] == NULL || job.beta[w] == NULL) ok = 0;
+    }
+    if (!ok) fprintf(stderr, "Out of memory setting up %d workers\n", n_workers);
+
+    for (int it = 0; ok && it < iterations; it++) {
+        memset(job.counts, 0, n_workers * sizeof(struct em_counts));
+        used = parallel_for(n_ep, n_workers, em_task, &job);
+        memset(&total, 0, sizeof(total));
+        for (int w = 0; w < n_workers; w++) {
+            total.loglik += job.counts[w].loglik;
+            for (int r = 0; r < 2; r++) {
+                for (int a = 0; a < 4; a++) {
+                    total.steps[r][a] += job.counts[w].steps[r][a];
+                    for (int k = 0; k < 3; k++) total.kind[r][a][k] += job.counts[w].kind[r][a][k];
+                }
+            }
+        }
+        printf("pass %d: log-likelihood %.3f\n", it + 1, total.loglik);
+
+        // M-step: tables the log says little about keep their weights
+        for (int r = 0; r < 2; r++) {
+            for (int a = 0; a < 4; a++) {
+                q.act_w[r][a] = action_weights(&q, r, a);
+                N = total.steps[r][a];
+                if (N < EM_MIN_STEPS) continue;
+                q.act_w[r][a].move = fmax(total.kind[r][a][MOVE_ENTRY] / N, EM_MIN_WEIGHT);
+                q.act_w[r][a].drift = fmax(total.kind[r][a][DRIFT_ENTRY] / (2 * N), EM_MIN_WEIGHT);
+                q.act_w[r][a].stay = fmax(total.kind[r][a][STAY_ENTRY] / N, EM_MIN_WEIGHT);
+            }
+        }
+        q.per_action = 1;
+        if (set_params(&ctx, &q) == 0) {
+            fprintf(stderr, "Out of memory building the motion model\n");
+            ok = 0;
+        }
+        if (total.loglik - prev < 1e-6 * fabs(total.loglik)) break;
+        prev = total.loglik;
+    }
+    if (ok) {
+        *p = q;
+        printf("%d episodes, %d scans, %d workers\n", n_ep, n, used);
+    }
+
+    for (int w = 0; w < n_workers; w++) {
+        if (job.alpha != NULL) free(job.alpha[w]);
+        if (job.lik != NULL) free(job.lik[w]);
+        if (job.scale != NULL) free(job.scale[w]);
+        if (job.beta != NULL) free(job.beta[w]);
+    }
+    free(job.alpha);
+    free(job.lik);
+    free(job.scale);
+    free(job.beta);
+    free(job.counts);
+    free(ep_start);
+    free_context(&ctx);
+    return (ok);
+}
+
+/*!
+ * Ranks sweep results: more episodes ending correctly first, then fewer wrong localizations, then fewer scans
+ */
+int compare_results(const void *a, const void *b) {
+    const struct replay_result *ra = (const struct replay_result *) a;
+    const struct replay_result *rb = (const struct replay_result *) b;
+    double wa = ra->claims ? (double) ra->wrong / ra->claims : 0;
+    double wb = rb->claims ? (double) rb->wrong / rb->claims : 0;
+    double sa = ra->localized ? (double) ra->to_localize / ra->localized : 1e9;
+    double sb = rb->localized ? (double) rb->to_localize / rb->localized : 1e9;
+
+    if (ra->final_ok != rb->final_ok) return (rb->final_ok - ra->final_ok);
+    if (wa != wb) return (wa < wb ? -1 : 1);
+    if (sa != sb) return (sa < sb ? -1 : 1);
+    return (0);
+}
+
+/*!
+ * Reads a sweep grid (one line per weight: name, then values) and expands it into every combination. Each combination
+ * starts as a copy of base (the weights, sensing model and per-action motion weights given on the command line), and
+ * weights not in the grid keep base's value. The per-action weights replace move, drift and stay, so a grid that
+ * sweeps those is refused when base has them.
+ * @return the combinations (n_out of them), NULL on failure
+ */
+struct loc_params *read_grid(const char *filename, const struct loc_params *base, int *n_out) {
+    const char *names[5] = {"move", "drift", "stay", "hit", "miss"};
+    double values[5][64];
+    int n_values[5] = {0, 0, 0, 0, 0};
+    struct loc_params *grid;
+    char line[1024], name[64];
+    char *at;
+    int used, w, n = 1, k;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open sweep grid %s\n", filename);
+        return (NULL);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%63s%n", name, &used) != 1 || name[0] == '#') continue;
+        for (w = 0; w < 5 && strcmp(name, names[w]) != 0; w++);
+        if (w == 5) {
+            fprintf(stderr, "Unknown weight '%s' in %s (use move, drift, stay, hit, miss)\n", name, filename);
+            fclose(f);
+            return (NULL);
+        }
+        at = line + used;
+        n_values[w] = 0;
+        while (n_values[w] < 64 && sscanf(at, "%lf%n", &values[w][n_values[w]], &used) == 1) {
+            n_values[w]++;
+            at += used;
+        }
+    }
+    fclose(f);
+    if (base->per_action && (n_values[0] > 0 || n_values[1] > 0 || n_values[2] > 0)) {
+        fprintf(stderr, "%s sweeps move, drift or stay, which the per-action weights of -m would override\n", filename);
+        return (NULL);
+    }
+
+    // Weights not in the grid keep their value in base
+    for (w = 0; w < 5; w++) {
+        if (n_values[w] == 0) {
+            values[w][0] = (w == 0) ? base->p_move : (w == 1) ? base->p_drift : (w == 2) ? base->p_stay :
+                           (w == 3) ? base->p_hit : base->p_miss;
+            n_values[w] = 1;
+        }
+        n *= n_values[w];
+    }
+    grid = (struct loc_params *) calloc(n, sizeof(struct loc_params));
+    if (grid == NULL) {
+        fprintf(stderr, "Out of memory expanding sweep grid\n");
+        return (NULL);
+    }
+    for (int g = 0; g < n; g++) {
+        k = g;
+        grid[g] = *base;
+        grid[g].p_move = values[0][k % n_values[0]];
+        k /= n_values[0];
+        grid[g].p_drift = values[1][k % n_values[1]];
+        k /= n_values[1];
+        grid[g].p_stay = values[2][k % n_values[2]];
+        k /= n_values[2];
+        grid[g].p_hit = values[3][k % n_values[3]];
+        k /= n_values[3];
+        grid[g].p_miss = values[4][k % n_values[4]];
+    }
+    *n_out = n;
+    return (grid);
+}
+
+/*!
+ * Sweep task: replays the whole log with one weight combination on the calling worker's own context
+ */
+void sweep_task(int task, int worker, void *arg) {
+    struct sweep_job *job = (struct sweep_job *) arg;
+    struct loc_context *ctx = &job->ctx[worker];
+
+    if (set_params(ctx, &job->results[task].p) == 0) {
+        fprintf(stderr, "Out of memory building the motion model for combination %d\n", task);
+        job->results[task].episodes = 0;
+        return;
+    }
+    replay_log(ctx, job->rec, job->n, 0, 0, &job->results[task]);
+}
+
+/*!
+ * Runs a sweep over every combination in grid and writes the ranked table to filename
+ * @return int, 1 success 0 fail
+ */
+int run_sweep(const struct loc_map *m, const struct scan_record *rec, int n, struct loc_params *grid, int n_grid,
+              int n_workers, const char *filename) {
+    struct sweep_job job;
+    struct timespec t0, t1;
+    struct replay_result *r;
+    double secs;
+    int ok = 1, used;
+    FILE *f;
+
+    f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create results file %s\n", filename);
+        return (0);
+    }
+    if (n_workers > n_grid) n_workers = n_grid;
+    job.m = m;
+    job.rec = rec;
+    job.n = n;
+    job.ctx = (struct loc_context *) calloc(n_workers, sizeof(struct loc_context));
+    job.results = (struct replay_result *) calloc(n_grid, sizeof(struct replay_result));
+    if (job.ctx == NULL || job.results == NULL) ok = 0;
+    for (int w = 0; ok && w < n_workers; w++) {
+        if (init_context(&job.ctx[w], m, &grid[0]) == 0) ok = 0;
+        job.ctx[w].verbose = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Out of memory setting up %d workers\n", n_workers);
+    } else {
+        for (int g = 0; g < n_grid; g++) job.results[g].p = grid[g];
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        used = parallel_for(n_grid, n_workers, sweep_task, &job);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        secs = (t1.tv_sec - t0.tv_sec) + ((t1.tv_nsec - t0.tv_nsec) * 1e-9);
+
+        qsort(job.results, n_grid, sizeof(struct replay_result), compare_results);
+        fprintf(f, "# %d combinations, %d scans each, %d workers, %.3f s\n", n_grid, n, used, secs);
+        fprintf(f, "# rank    hit   miss   move  drift   stay  final%%  localized%%  scans  wrong%%\n");
+        for (int g = 0; g < n_grid; g++) {
+            r = &job.results[g];
+            fprintf(f, "%6d %6.3f %6.3f %6.3f %6.3f %6.3f %7.2f %11.2f %6.2f %7.2f\n", g + 1, r->p.p_hit, r->p.p_miss,
+                    r->p.p_move, r->p.p_drift, r->p.p_stay, r->episodes ? 100.0 * r->final_ok / r->episodes : 0.0,
+                    r->episodes ? 100.0 * r->localized / r->episodes : 0.0,
+                    r->localized ? (double) r->to_localize / r->localized : 0.0,
+                    r->claims ? 100.0 * r->wrong / r->claims : 0.0);
+        }
+        printf("%d combinations x %d scans on %d workers in %.3f s (%.0f scans/s)\n", n_grid, n, used, secs,
+               secs > 0 ? (double) n_grid * n / secs : 0.0);
+        if (n_grid > 0) {
+            r = &job.results[0];
+            printf("best: hit %g miss %g move %g drift %g stay %g\n", r->p.p_hit, r->p.p_miss, r->p.p_move,
+                   r->p.p_drift, r->p.p_stay);
+        }
+    }
+    for (int w = 0; job.ctx != NULL && w < n_workers; w++) free_context(&job.ctx[w]);
+    free(job.ctx);
+    free(job.results);
+    fclose(f);
+    return (ok);
+}
+
+int main(int argc, char *argv[]) {
+    struct loc_map world, maps[MAX_MAPS];
+    struct loc_context ctx;
+    struct multi_loc ml;
+    struct loc_params params, *grid = NULL;
+    struct replay_result res;
+    struct scan_record *rec;
+    struct timespec t0, t1;
+    const char *grid_file = NULL, *confusion_file = NULL, *motion_file = NULL, *alt_name[MAX_MAPS];
+    double counts[N_COLOURS][N_COLOURS];
+    int n, n_grid = 0, a = 1, verbose = 0, monitor = 0, explore = 0, learn = 0, fit = 0, n_workers;
+    int iterations = EM_ITERATIONS, n_maps = 1;
+    double secs, kidnap = 0, fail = 0;
+
+    memset(&world, 0, sizeof(world));
+    default_params(&params);
+    n_workers = default_workers();
+
+    if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+        for (a = 2; a < argc && argv[a][0] == '-'; a++) {
+            if (strcmp(argv[a], "-e") == 0) explore = 1;
+            else if (strcmp(argv[a], "-k") == 0 && a + 1 < argc) kidnap = atof(argv[++a]);
+            else if (strcmp(argv[a], "-f") == 0 && a + 1 < argc) fail = atof(argv[++a]);
+            else if (strcmp(argv[a], "-m") == 0 && a + 1 < argc) motion_file = argv[++a];
+            else break;
+        }
+        if (argc != a + 6) {
+            fprintf(stderr, "Usage: EV3_Replay -s [-e] [-k kidnap] [-f fail] [-m motion_file] episodes scans noise "
+                            "seed map_name log_file\n");
+            exit(1);
+        }
+        if (motion_file != NULL && load_motion_params(motion_file, &params) == 0) {
+            fprintf(stderr, "Unable to read motion weights from %s\n", motion_file);
+            exit(1);
+        }
+        srand(atoi(argv[a + 3]));
+        select_kernels();
+        if (load_map(argv[a + 4], &world) == 0) {
+            fprintf(stderr, "Unable to read map %s\n", argv[a + 4]);
+            exit(1);
+        }
+        if (explore && init_context(&ctx, &world, &params) == 0) {
+            fprintf(stderr, "Out of memory setting up the beliefs\n");
+            free_loc_map(&world);
+            exit(1);
+        }
+        ctx.verbose = 0;
+        n = simulate_log(argv[a + 5], &world, &params, atoi(argv[a]), atoi(argv[a + 1]), atof(argv[a + 2]), kidnap,
+                         fail, explore ? &ctx : NULL);
+        if (explore) free_context(&ctx);
+        free_loc_map(&world);
+        exit(n ? 0 : 1);
+    }
+
+    while (a < argc && argv[a][0] == '-') {
+        if (strcmp(argv[a], "-p") == 0 && a + 5 < argc) {
+            params.p_hit = atof(argv[a + 1]);
+            params.p_miss = atof(argv[a + 2]);
+            params.p_move = atof(argv[a + 3]);
+            params.p_drift = atof(argv[a + 4]);
+            params.p_stay = atof(argv[a + 5]);
+            a += 6;
+        } else if (strcmp(argv[a], "-v") == 0) {
+            verbose = 1;
+            a++;
+        } else if (strcmp(argv[a], "-k") == 0) {
+            monitor = 1;
+            a++;
+        } else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc) {
+            confusion_file = argv[a + 1];
+            a += 2;
+        } else if (strcmp(argv[a], "-l") == 0) {
+            learn = 1;
+            a++;
+        } else if (strcmp(argv[a], "-m") == 0 && a + 1 < argc) {
+            motion_file = argv[a + 1];
+            a += 2;
+        } else if (strcmp(argv[a], "-b") == 0) {
+            fit = 1;
+            a++;
+        } else if (strcmp(argv[a], "-i") == 0 && a + 1 < argc) {
+            iterations = atoi(argv[a + 1]);
+            a += 2;
+        } else if (strcmp(argv[a], "-g") == 0 && a + 1 < argc) {
+            grid_file = argv[a + 1];
+            a += 2;
+        } else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+            n_workers = atoi(argv[a + 1]);
+            a += 2;
+        } else if (strcmp(argv[a], "-a") == 0 && a + 1 < argc && n_maps < MAX_MAPS) {
+            alt_name[n_maps++] = argv[a + 1];
+            a += 2;
+        } else {
+            break;
+        }
+    }
+    if (argc - a != ((grid_file != NULL || learn || fit) ? 3 : 2) || n_workers < 1) {
+        fprintf(stderr, "Usage: EV3_Replay [-p hit miss move drift stay] [-c confusion_file] [-m motion_file] [-v] "
+                        "[-k] [-a other_map ...] map_name log_file\n");
+        fprintf(stderr, "       EV3_Replay -l map_name log_file confusion_file\n");
+        fprintf(stderr, "       EV3_Replay -b [-i iterations] [-t threads] [-c confusion_file] [-m motion_file] "
+                        "map_name log_file motion_out\n");
+        fprintf(stderr, "       EV3_Replay -g grid_file [-t threads] [-p hit miss move drift stay] [-c confusion_file] "
+                        "[-m motion_file] map_name log_file results_file\n");
+        fprintf(stderr, "       EV3_Replay -s [-e] [-k kidnap] [-f fail] [-m motion_file] episodes scans noise "
+                        "seed map_name log_file\n");
+        exit(1);
+    }
+
+    if (confusion_file != NULL) {
+        if (read_confusion_counts(confusion_file, counts) == 0) {
+            fprintf(stderr, "Unable to read confusion counts from %s\n", confusion_file);
+            exit(1);
+        }
+        set_confusion(&params, counts);
+    }
+    if (motion_file != NULL && load_motion_params(motion_file, &params) == 0) {
+        fprintf(stderr, "Unable to read motion weights from %s\n", motion_file);
+        exit(1);
+    }
+
+    select_kernels();
+    if (load_map(argv[a], &world) == 0) {
+        fprintf(stderr, "Unable to read map %s\n", argv[a]);
+        exit(1);
+    }
+    rec = read_scan_log(argv[a + 1], &n);
+    if (rec == NULL) {
+        free_loc_map(&world);
+        exit(1);
+    }
+
+    if (fit) {
+        n = fit_motion(&world, rec, n, &params, iterations, n_workers) && write_motion_params(argv[a + 2], &params);
+        free(rec);
+        free_loc_map(&world);
+        exit(n ? 0 : 1);
+    }
+
+    if (learn) {
+        memset(counts, 0, sizeof(counts));
+        learn_confusion(&world, rec, n, counts);
+        n = write_confusion_counts(argv[a + 2], counts);
+        free(rec);
+        free_loc_map(&world);
+        exit(n ? 0 : 1);
+    }
+
+    if (grid_file != NULL) {
+        // The grid only varies the weights, every combination keeps the rest of the model chosen with -p, -c and -m
+        grid = read_grid(grid_file, &params, &n_grid);
+        n = (grid != NULL) ? run_sweep(&world, rec, n, grid, n_grid, n_workers, argv[a + 2]) : 0;
+        free(grid);
+        free(rec);
+        free_loc_map(&world);
+        exit(n ? 0 : 1);
+    }
+
+    if (n_maps > 1) {
+        // The log's own map is candidate 0, the others are only there to be ruled out
+        maps[0] = world;
+        for (int k = 1; k < n_maps; k++) {
+            memset(&maps[k], 0, sizeof(maps[k]));
+            if (load_map(alt_name[k], &maps[k]) == 0) {
+                fprintf(stderr, "Unable to read map %s\n", alt_name[k]);
+                n_maps = k;
+            }
+        }
+        n = (n_maps > 1 && init_multi(&ml, maps, n_maps, &params, n_workers)) ? n : -1;
+        if (n >= 0) {
+            ml.verbose = 0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            replay_multi(&ml, rec, n, verbose, &res);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            secs = (t1.tv_sec - t0.tv_sec) + ((t1.tv_nsec - t0.tv_nsec) * 1e-9);
+            printf("%d episodes, %d scans, %d candidate maps\n", res.episodes, n, n_maps);
+            printf("right map and pose in %d episodes (%.1f%%), after %.2f scans on average\n", res.localized,
+                   res.episodes ? 100.0 * res.localized / res.episodes : 0.0,
+                   res.localized ? (double) res.to_localize / res.localized : 0.0);
+            printf("wrong claims: %d of %d (%.2f%%), %d of them on the wrong map\n", res.wrong, res.claims,
+                   res.claims ? 100.0 * res.wrong / res.claims : 0.0, res.wrong_map);
+            printf("correct at the end of %d episodes (%.1f%%)\n", res.final_ok,
+                   res.episodes ? 100.0 * res.final_ok / res.episodes : 0.0);
+            printf("%.3f s, %.0f scans/s\n", secs, secs > 0 ? n / secs : 0.0);
+            free_multi(&ml);
+        }
+        for (int k = 1; k < n_maps; k++) free_loc_map(&maps[k]);
+        free(rec);
+        free_loc_map(&world);
+        exit(n >= 0 ? 0 : 1);
+    }
+
+    if (init_context(&ctx, &world, &params) == 0) {
+        fprintf(stderr, "Out of memory setting up the beliefs\n");
+        free(rec);
+        free_loc_map(&world);
+        exit(1);
+    }
+    ctx.verbose = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    replay_log(&ctx, rec, n, verbose, monitor, &res);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + ((t1.tv_nsec - t0.tv_nsec) * 1e-9);
+
+    printf("weights: hit %g miss %g move %g drift %g stay %g%s\n", params.p_hit, params.p_miss, params.p_move,
+           params.p_drift, params.p_stay, params.use_confusion ? ", sensing from the confusion matrix" : "");
+    printf("%d episodes, %d scans on a %d x %d map\n", res.episodes, n, world.sx, world.sy);
+    printf("localized in %d episodes (%.1f%%), after %.2f scans on average\n", res.localized,
+           res.episodes ? 100.0 * res.localized / res.episodes : 0.0,
+           res.localized ? (double) res.to_localize / res.localized : 0.0);
+    printf("wrong localizations: %d of %d claims (%.2f%%)\n", res.wrong, res.claims,
+           res.claims ? 100.0 * res.wrong / res.claims : 0.0);
+    printf("correct at the end of %d episodes (%.1f%%)\n", res.final_ok,
+           res.episodes ? 100.0 * res.final_ok / res.episodes : 0.0);
+    if (monitor) printf("partial resets: %d\n", res.resets);
+    printf("pose %d scans back: filtered %.1f%%, smoothed %.1f%%, Viterbi %.1f%% right\n", REPLAY_LAG,
+           res.lagged ? 100.0 * res.lag_filtered / res.lagged : 0.0,
+           res.lagged ? 100.0 * res.lag_smoothed / res.lagged : 0.0,
+           res.lagged ? 100.0 * res.lag_viterbi / res.lagged : 0.0);
+    printf("%.3f s, %.0f scans/s, %.0f episodes/s\n", secs, secs > 0 ? n / secs : 0.0,
+           secs > 0 ? res.episodes / secs : 0.0);
+
+    free_context(&ctx);
+    free(rec);
+    free_loc_map(&world);
+    return (0);
+}
@@ -0,0 +1,213 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Telemetry ring buffer and writer thread, see EV3_Telemetry.h. The control loop is the only producer and the writer
+thread the only consumer, so the ring needs no lock: the producer owns 'head', the consumer owns 'tail', and each
+publishes its index with a release store after touching the bytes it covers.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "EV3_Telemetry.h"
+
+#define RING_MASK (TELEMETRY_RING_SIZE - 1)
+
+static unsigned char *ring = NULL;
+static uint64_t head = 0;           // Bytes ever written by the control loop
+static uint64_t tail = 0;           // Bytes ever written to the file by the writer thread
+static int stop = 0;
+static FILE *out = NULL;
+static pthread_t writer;
+static uint32_t seq = 0;
+static uint32_t dropped = 0;
+static struct timespec t0;
+
+static uint32_t elapsed_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((uint32_t) (((t.tv_sec - t0.tv_sec) * 1000) + ((t.tv_nsec - t0.tv_nsec) / 1000000)));
+}
+
+/*!
+ * Copies len bytes into the ring at byte position pos, wrapping around its end
+ */
+static void ring_put(uint64_t pos, const void *data, uint32_t len) {
+    uint32_t at = (uint32_t) (pos & RING_MASK);
+    uint32_t first = (len < TELEMETRY_RING_SIZE - at) ? len : TELEMETRY_RING_SIZE - at;
+
+    memcpy(ring + at, data, first);
+    memcpy(ring, (const unsigned char *) data + first, len - first);
+}
+
+/*!
+ * Starts a record of type with a payload of size bytes.
+ * @return the ring position to write the payload at, or 0 if the record does not fit and was dropped
+ */
+static uint64_t begin_record(uint32_t type, uint32_t size) {
+    struct telemetry_record_header h;
+    uint64_t free_bytes = TELEMETRY_RING_SIZE - (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+
+    if (ring == NULL) return (0);
+    if (free_bytes < sizeof(h) + size) {
+        dropped++;
+        seq++;
+        return (0);
+    }
+    h.type = type;
+    h.size = size;
+    h.seq = seq++;
+    h.ms = elapsed_ms();
+    ring_put(head, &h, sizeof(h));
+    return (head + sizeof(h));
+}
+
+/*!
+ * Publishes a record to the writer thread once its payload, size bytes at ring position pos, is in place
+ */
+static void end_record(uint64_t pos, uint32_t size) {
+    __atomic_store_n(&head, pos + size, __ATOMIC_RELEASE);
+}
+
+static void *writer_main(void *arg) {
+    struct timespec nap = {0, 2000000};
+    uint64_t h, t, len;
+
+    (void) arg;
+    while (1) {
+        h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        t = tail;
+        if (h == t) {
+            if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE) && __atomic_load_n(&head, __ATOMIC_ACQUIRE) == t) break;
+            fflush(out);
+            nanosleep(&nap, NULL);
+            continue;
+        }
+        // Write the contiguous part, the wrapped remainder goes on the next pass
+        len = h - t;
+        if (len > TELEMETRY_RING_SIZE - (t & RING_MASK)) len = TELEMETRY_RING_SIZE - (t & RING_MASK);
+        fwrite(ring + (t & RING_MASK), 1, len, out);
+        __atomic_store_n(&tail, t + len, __ATOMIC_RELEASE);
+    }
+    return (NULL);
+}
+
+/*!
+ * Creates the telemetry file and starts the writer thread. Until this succeeds the telemetry_*() calls do nothing.
+ * @param filename output file
+ * @param sx map size along x, in intersections
+ * @param sy map size along y, in intersections
+ * @return int, 1 success 0 fail
+ */
+int telemetry_open(const char *filename, int sx, int sy) {
+    struct telemetry_file_header fh;
+
+    if (ring != NULL) return (0);
+    out = fopen(filename, "wb");
+    if (out == NULL) return (0);
+    fh.magic = TELEMETRY_MAGIC;
+    fh.version = TELEMETRY_VERSION;
+    fh.sx = sx;
+    fh.sy = sy;
+    fwrite(&fh, sizeof(fh), 1, out);
+
+    ring = (unsigned char *) malloc(TELEMETRY_RING_SIZE);
+    if (ring == NULL) {
+        fclose(out);
+        out = NULL;
+        return (0);
+    }
+    head = tail = 0;
+    stop = 0;
+    seq = dropped = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        free(ring);
+        ring = NULL;
+        fclose(out);
+        out = NULL;
+        return (0);
+    }
+    return (1);
+}
+
+/*!
+ * Drains whatever is left in the ring, records the number of dropped records and closes the file
+ */
+void telemetry_close(void) {
+    struct telemetry_record_header h;
+
+    if (ring == NULL) return;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+
+    // The writer is gone, so the file can be written directly
+    h.type = TLM_DROPPED;
+    h.size = sizeof(dropped);
+    h.seq = seq++;
+    h.ms = elapsed_ms();
+    fwrite(&h, sizeof(h), 1, out);
+    fwrite(&dropped, sizeof(dropped), 1, out);
+    fclose(out);
+    out = NULL;
+    free(ring);
+    ring = NULL;
+}
+
+/*!
+ * Records one intersection scan and the action that led to it
+ */
+void telemetry_scan(int last_act, int redflag, const int reading[4]) {
+    int32_t p[6] = {last_act, redflag, reading[0], reading[1], reading[2], reading[3]};
+    uint64_t pos = begin_record(TLM_SCAN, sizeof(p));
+
+    if (pos == 0) return;
+    ring_put(pos, p, sizeof(p));
+    end_record(pos, sizeof(p));
+}
+
+/*!
+ * Records a snapshot of the belief grid, converted to float32
+ * @param b beliefs, n values in STATE() order
+ * @param n number of states
+ * @param log_domain 1 if b holds log-probabilities
+ */
+void telemetry_beliefs(const double *b, int n, int log_domain) {
+    uint32_t size = sizeof(int32_t) + (n * sizeof(float));
+    uint64_t pos = begin_record(TLM_BELIEFS, size);
+    int32_t flag = log_domain;
+    float chunk[256];
+    uint64_t at;
+    int m;
+
+    if (pos == 0) return;
+    ring_put(pos, &flag, sizeof(flag));
+    at = pos + sizeof(flag);
+    for (int k = 0; k < n; k += m) {
+        m = (n - k < 256) ? n - k : 256;
+        for (int i = 0; i < m; i++) chunk[i] = (float) b[k + i];
+        ring_put(at, chunk, m * sizeof(float));
+        at += m * sizeof(float);
+    }
+    end_record(pos, size);
+}
+
+/*!
+ * Records the outcome of robot_localization()
+ */
+void telemetry_localized(int result, int x, int y, int dir, double max, double second, double entropy) {
+    unsigned char p[4 * sizeof(int32_t) + 3 * sizeof(double)];
+    int32_t r[4] = {result, x, y, dir};
+    double s[3] = {max, second, entropy};
+    uint64_t pos = begin_record(TLM_LOCALIZED, sizeof(p));
+
+    if (pos == 0) return;
+    memcpy(p, r, sizeof(r));
+    memcpy(p + sizeof(r), s, sizeof(s));
+    ring_put(pos, p, sizeof(p));
+    end_record(pos, sizeof(p));
+}
@@ -0,0 +1,63 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Binary telemetry for the localization loop. Scan events and belief snapshots are copied into a lock-free
+single-producer / single-consumer ring buffer and a background thread drains it to a file, so the control loop never
+waits on the terminal or the disk. If the ring is full the record is dropped (and counted) rather than blocking.
+
+ File layout (little-endian, as written by the EV3 host):
+
+   struct telemetry_file_header
+   repeated: struct telemetry_record_header, followed by 'size' bytes of payload
+
+ Payloads:
+
+   TLM_SCAN        int32 last action, int32 redflag, int32 reading[4]
+   TLM_BELIEFS     int32 log-domain flag, float32 beliefs[n_states] in STATE() order
+   TLM_LOCALIZED   int32 result, int32 x, int32 y, int32 dir, float64 max, float64 runner-up, float64 entropy
+   TLM_DROPPED     uint32 number of records dropped because the ring was full (written on close)
+
+ EV3_TelemetryDump.c decodes these files offline.
+
+*/
+
+#ifndef __telemetry_header
+#define __telemetry_header
+
+#include <stdint.h>
+
+#define TELEMETRY_MAGIC 0x544c4d45     // "EMLT" on disk
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_RING_SIZE (1 << 22)  // Bytes, must be a power of 2
+
+#define TLM_SCAN 1
+#define TLM_BELIEFS 2
+#define TLM_LOCALIZED 3
+#define TLM_DROPPED 4
+
+struct telemetry_file_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t sx;             // Map size in intersections, n_states = sx * sy * 4
+    int32_t sy;
+};
+
+struct telemetry_record_header {
+    uint32_t type;          // One of TLM_*
+    uint32_t size;          // Payload bytes following this header
+    uint32_t seq;           // Record counter, gaps mean dropped records
+    uint32_t ms;            // Milliseconds since telemetry_open()
+};
+
+int telemetry_open(const char *filename, int sx, int sy);
+
+void telemetry_close(void);
+
+void telemetry_scan(int last_act, int redflag, const int reading[4]);
+
+void telemetry_beliefs(const double *b, int n, int log_domain);
+
+void telemetry_localized(int result, int x, int y, int dir, double max, double second, double entropy);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Offline decoder for the telemetry files written by EV3_Telemetry.c. Prints one line per record, and with -g the
+full belief grid of every snapshot in the same layout the localization code used to print at run time.
+
+ Usage: EV3_TelemetryDump [-g] telemetry_file
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "EV3_Telemetry.h"
+
+int main(int argc, char *argv[]) {
+    struct telemetry_file_header fh;
+    struct telemetry_record_header h;
+    unsigned char *payload = NULL;
+    int32_t v[6];
+    double s[3];
+    float *b;
+    int grid = 0, n, best;
+    FILE *f;
+
+    if (argc == 3 && strcmp(argv[1], "-g") == 0) grid = 1;
+    if (argc != 2 + grid) {
+        fprintf(stderr, "Usage: EV3_TelemetryDump [-g] telemetry_file\n");
+        fprintf(stderr, "    -g - print the full belief grid of every snapshot\n");
+        exit(1);
+    }
+    f = fopen(argv[1 + grid], "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open %s\n", argv[1 + grid]);
+        exit(1);
+    }
+    if (fread(&fh, sizeof(fh), 1, f) != 1 || fh.magic != TELEMETRY_MAGIC || fh.version != TELEMETRY_VERSION) {
+        fprintf(stderr, "%s is not a telemetry file\n", argv[1 + grid]);
+        fclose(f);
+        exit(1);
+    }
+    n = fh.sx * fh.sy * 4;
+    printf("map %d x %d, %d states\n", fh.sx, fh.sy, n);
+
+    while (fread(&h, sizeof(h), 1, f) == 1) {
+        payload = (unsigned char *) realloc(payload, h.size + 1);
+        if (payload == NULL || fread(payload, 1, h.size, f) != h.size) {
+            fprintf(stderr, "Truncated record %u\n", h.seq);
+            break;
+        }
+        printf("%8u %8u ms  ", h.seq, h.ms);
+        if (h.type == TLM_SCAN && h.size == sizeof(v)) {
+            memcpy(v, payload, sizeof(v));
+            printf("scan      act %d redflag %d reading %d %d %d %d\n", v[0], v[1], v[2], v[3], v[4], v[5]);
+        } else if (h.type == TLM_BELIEFS && h.size == sizeof(int32_t) + (n * sizeof(float))) {
+            memcpy(v, payload, sizeof(int32_t));
+            b = (float *) malloc(n * sizeof(float));
+            if (b == NULL) break;
+            memcpy(b, payload + sizeof(int32_t), n * sizeof(float));
+            best = 0;
+            for (int k = 1; k < n; k++) if (b[k] > b[best]) best = k;
+            printf("beliefs   %s, best %d %d dir %d (%f)\n", v[0] ? "log" : "linear", (best % (fh.sx * fh.sy)) % fh.sx,
+                   (best % (fh.sx * fh.sy)) / fh.sx, best / (fh.sx * fh.sy), v[0] ? exp(b[best]) : b[best]);
+            if (grid) {
+                for (int j = 0; j < fh.sy; j++) {
+                    for (int i = 0; i < fh.sx; i++) {
+                        printf("i is %i j is %i :\n", i, j);
+                        for (int d = 0; d < 4; d++) {
+                            printf("direction is %d belief is %2f \n", d, b[(d * fh.sx * fh.sy) + i + (j * fh.sx)]);
+                        }
+                        printf("\n");
+                    }
+                }
+            }
+            free(b);
+        } else if (h.type == TLM_LOCALIZED && h.size == (4 * sizeof(int32_t)) + sizeof(s)) {
+            memcpy(v, payload, 4 * sizeof(int32_t));
+            memcpy(s, payload + (4 * sizeof(int32_t)), sizeof(s));
+            printf("localize  %s %d %d dir %d, max %f runner-up %f entropy %f\n", v[0] < 0 ? "fail" : "ok",
+                   v[1], v[2], v[3], s[0], s[1], s[2]);
+        } else if (h.type == TLM_DROPPED && h.size == sizeof(uint32_t)) {
+            memcpy(v, payload, sizeof(uint32_t));
+            printf("dropped   %u records\n", (uint32_t) v[0]);
+        } else {
+            printf("unknown record type %u, %u bytes\n", h.type, h.size);
+        }
+    }
+    free(payload);
+    fclose(f);
+    return (0);
+}
@@ -0,0 +1,190 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ Work-stealing parallel_for(), see EV3_ThreadPool.h. Each worker owns a range [next, end) of task indices behind its
+own mutex. It takes tasks from the front of its range; thieves take from the back, so the owner and a thief only meet
+on the lock, never on a task.
+
+ The worker threads are started the first time they are needed and then kept, asleep on a condition variable between
+calls, so a call on the robot's scan loop costs a wake-up rather than a thread start. A call made while the pool is
+already running a job (from a task, or from another thread) runs its tasks on the calling thread instead.
+
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "EV3_ThreadPool.h"
+
+struct work_range {
+    pthread_mutex_t lock;
+    int next;               // Next task to run
+    int end;                // One past the last task owned
+};
+
+struct pool_job {
+    struct work_range *ranges;
+    int n_workers;
+    void (*fn)(int task, int worker, void *arg);
+    void *arg;
+};
+
+#define MAX_POOL_THREADS 63     // Threads kept by the pool, worker 0 is always the calling thread
+
+// The kept threads, thread k runs as worker k + 1
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signalled when a job is posted,
+    pthread_cond_t done;        //  and when its last thread finishes
+    int n_threads;              // Threads started so far
+    int busy;                   // 1 while a job is running
+    unsigned long generation;   // Bumped for every job posted
+    struct pool_job *job;       // The job of the current generation
+    int pending;                // Threads of that job still running
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, 0};
+
+/*!
+ * Takes the next task of worker w, stealing half of another worker's range if w has none left.
+ * @return int, task index, or -1 if no work is left anywhere
+ */
+static int take_task(struct pool_job *job, int w) {
+    struct work_range *mine = &job->ranges[w];
+    struct work_range *v;
+    int task = -1, victim, left, best, lo = 0, hi = 0;
+
+    pthread_mutex_lock(&mine->lock);
+    if (mine->next < mine->end) task = mine->next++;
+    pthread_mutex_unlock(&mine->lock);
+    if (task >= 0) return (task);
+
+    while (1) {
+        // Pick the worker with the most work left. It may have changed by the time it is locked again, so recheck.
+        victim = -1;
+        best = 0;
+        for (int k = 1; k < job->n_workers; k++) {
+            v = &job->ranges[(w + k) % job->n_workers];
+            pthread_mutex_lock(&v->lock);
+            left = v->end - v->next;
+            pthread_mutex_unlock(&v->lock);
+            if (left > best) {
+                best = left;
+                victim = (w + k) % job->n_workers;
+            }
+        }
+        if (victim < 0) return (-1);
+
+        v = &job->ranges[victim];
+        pthread_mutex_lock(&v->lock);
+        left = v->end - v->next;
+        if (left > 0) {
+            hi = v->end;
+            lo = v->end - ((left + 1) / 2);
+            v->end = lo;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (left > 0) break;
+    }
+
+    // Run the first stolen task now, keep the rest for later (and for other thieves)
+    pthread_mutex_lock(&mine->lock);
+    mine->next = lo + 1;
+    mine->end = hi;
+    pthread_mutex_unlock(&mine->lock);
+    return (lo);
+}
+
+static void run_worker(struct pool_job *job, int w) {
+    int task;
+
+    while ((task = take_task(job, w)) >= 0) job->fn(task, w, job->arg);
+}
+
+static void *worker_main(void *p) {
+    int w = (int) (long) p;
+    unsigned long seen = 0;
+    struct pool_job *job;
+
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen) pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        job = pool.job;
+        // A thread the job does not need may only wake up after the job is over, and must not touch it
+        if (job == NULL || w >= job->n_workers) job = NULL;
+        pthread_mutex_unlock(&pool.lock);
+        if (job == NULL) continue;
+
+        run_worker(job, w);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return (NULL);
+}
+
+int parallel_for(int n_tasks, int n_workers, void (*fn)(int task, int worker, void *arg), void *arg) {
+    struct pool_job job;
+    pthread_t thread;
+    int used;
+
+    if (n_tasks <= 0) return (0);
+    if (n_workers > n_tasks) n_workers = n_tasks;
+    if (n_workers > MAX_POOL_THREADS + 1) n_workers = MAX_POOL_THREADS + 1;
+    if (n_workers < 1) n_workers = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.busy) n_workers = 1;
+    else if (n_workers > 1) pool.busy = 1;
+    pthread_mutex_unlock(&pool.lock);
+    job.ranges = (n_workers > 1) ? (struct work_range *) calloc(n_workers, sizeof(struct work_range)) : NULL;
+    if (job.ranges == NULL) {
+        // A single worker, a busy pool or no memory for the ranges: run everything here
+        for (int t = 0; t < n_tasks; t++) fn(t, 0, arg);
+        if (n_workers > 1) {
+            pthread_mutex_lock(&pool.lock);
+            pool.busy = 0;
+            pthread_mutex_unlock(&pool.lock);
+        }
+        return (1);
+    }
+    job.n_workers = n_workers;
+    job.fn = fn;
+    job.arg = arg;
+    for (int w = 0; w < n_workers; w++) {
+        pthread_mutex_init(&job.ranges[w].lock, NULL);
+        job.ranges[w].next = (int) (((long) n_tasks * w) / n_workers);
+        job.ranges[w].end = (int) (((long) n_tasks * (w + 1)) / n_workers);
+    }
+
+    // Start the threads this job needs that are not running yet. If one fails to start, the workers after it are
+    // left out and their ranges get stolen.
+    pthread_mutex_lock(&pool.lock);
+    while (pool.n_threads < n_workers - 1 &&
+           pthread_create(&thread, NULL, worker_main, (void *) (long) (pool.n_threads + 1)) == 0) {
+        pthread_detach(thread);
+        pool.n_threads++;
+    }
+    used = (pool.n_threads < n_workers - 1) ? pool.n_threads + 1 : n_workers;
+    pool.job = &job;
+    pool.pending = used - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_worker(&job, 0);
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pool.job = NULL;
+    pool.busy = 0;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int w = 0; w < n_workers; w++) pthread_mutex_destroy(&job.ranges[w].lock);
+    free(job.ranges);
+    return (used);
+}
+
+int default_workers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1 ? 1 : (int) n);
+}
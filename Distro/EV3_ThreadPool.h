@@ -0,0 +1,23 @@
+/*
+
+  CSC C85 - Embedded Systems - Project # 1 - EV3 Robot Localization
+
+ A small work-stealing pool, used by the offline tools and on the robot (map parsing, the exploration planner and the
+search over candidate maps). parallel_for() splits a range of task indices evenly over the workers; a worker that runs
+out steals the back half of the largest range left on another worker, so uneven tasks still keep every core busy. The
+calling thread is worker 0, the other workers are threads the pool keeps between calls.
+
+*/
+
+#ifndef __threadpool_header
+#define __threadpool_header
+
+// Runs fn(task, worker, arg) once for every task in 0..n_tasks-1 on n_workers threads (worker in 0..n_workers-1,
+// no two tasks run at the same time on one worker). Returns once all tasks are done.
+// @return int, number of workers actually used
+int parallel_for(int n_tasks, int n_workers, void (*fn)(int task, int worker, void *arg), void *arg);
+
+// Number of online processors, at least 1
+int default_workers(void);
+
+#endif
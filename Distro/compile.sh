@@ -1 +1,4 @@
-g++ EV3_Localization.c ./EV3_RobotControl/btcomm.c -lbluetooth
+g++ -O2 EV3_Localization.c EV3_Localization_Core.c EV3_Kernels.c EV3_ThreadPool.c EV3_Telemetry.c EV3_Checkpoint.c EV3_MultiMap.c EV3_MapCache.c ./EV3_RobotControl/btcomm.c -lbluetooth -lpthread
+g++ -O2 -o EV3_TelemetryDump EV3_TelemetryDump.c
+g++ -O2 -o EV3_Replay EV3_Replay.c EV3_Localization_Core.c EV3_Kernels.c EV3_ThreadPool.c EV3_MultiMap.c EV3_MapCache.c -lpthread
+g++ -O2 -o EV3_Ambiguity EV3_Ambiguity.c EV3_Localization_Core.c EV3_Kernels.c EV3_ThreadPool.c EV3_MapCache.c -lpthread